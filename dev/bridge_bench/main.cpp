@@ -0,0 +1,515 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <clara.hpp>
+
+#include <fmt/format.h>
+
+//
+// Сравнительный замер всех вариантов bridge_server.
+//
+// На loopback-интерфейсе запускается delay_server, перед ним поочередно
+// каждый из вариантов bridge_server, а нагрузка на них подается с помощью
+// load_generator. Для каждого сочетания варианта, задержек delay_server
+// и количества одновременных запросов bridge_server запускается заново,
+// чтобы результаты замеров не влияли друг на друга.
+//
+// Кроме показателей load_generator для каждого замера фиксируется
+// процессорное время, которое потратил bridge_server (из /proc/PID/stat),
+// а также его текущий и пиковый размер резидентной памяти
+// (из /proc/PID/status).
+//
+// Результаты выводятся на стандартный вывод в формате CSV, по строке
+// на каждый замер. Вариант direct означает, что load_generator обращается
+// к delay_server напрямую, это дает базу для сравнения.
+//
+
+// Диапазон задержек delay_server, мс.
+struct delay_range_t {
+	long min_;
+	long max_;
+};
+
+// Конфигурация замеров.
+struct config_t {
+	// Каталог с исполняемыми файлами delay_server, bridge_server-ов
+	// и load_generator.
+	std::string bin_dir_;
+
+	// Варианты, которые нужно сравнить.
+	std::vector<std::string> variants_{
+			"direct",
+			"bridge_server_1",
+			"bridge_server_1_pipe",
+			"bridge_server_1_poll",
+			"bridge_server_2"};
+	// Количество одновременных запросов от load_generator.
+	std::vector<std::size_t> concurrency_{16u, 64u, 256u};
+	// Задержки delay_server.
+	std::vector<delay_range_t> delays_{{1, 5}, {50, 100}};
+
+	// Длительность одного замера.
+	std::chrono::seconds duration_{10};
+	// Количество нитей load_generator и delay_server.
+	std::size_t generator_threads_{2u};
+	std::size_t delay_threads_{2u};
+
+	// Количество нитей curl_multi для bridge_server_1 и рабочих нитей
+	// для bridge_server_2. Задается явно, чтобы сравнение не зависело
+	// от умолчаний самих вариантов. У bridge_server_1_pipe
+	// и bridge_server_1_poll всегда одна нить curl_multi.
+	std::size_t bridge_threads_{1u};
+	// Размер кэша ответов bridge_server_2, байт. 0 означает, что кэш
+	// не используется.
+	std::size_t bridge_cache_size_{0u};
+
+	// Даты в запросах. По умолчанию все запросы различны, чтобы
+	// объединение запросов в bridge_server_2 (и его кэш, если он включен
+	// через --bridge-cache-size) не искажали сравнение.
+	std::size_t dates_{1000000u};
+	std::string date_distribution_{"unique"};
+
+	// Порты для bridge_server и delay_server.
+	std::uint16_t bridge_port_{18080};
+	std::uint16_t delay_port_{18090};
+};
+
+// Разбиение строки на части, разделенные запятыми.
+std::vector<std::string> split_list(const std::string & what) {
+	std::vector<std::string> result;
+	std::istringstream in{what};
+	std::string item;
+	while(std::getline(in, item, ','))
+		if(!item.empty())
+			result.push_back(item);
+	return result;
+}
+
+// Разбор аргументов командной строки.
+// В случае неудачи порождается исключение.
+auto parse_cmd_line_args(int argc, char ** argv) {
+	struct result_t {
+		bool help_requested_{false};
+		config_t config_;
+	};
+	result_t result;
+	std::string variants{"direct,bridge_server_1,bridge_server_1_pipe,"
+			"bridge_server_1_poll,bridge_server_2"};
+	std::string concurrency{"16,64,256"};
+	std::string delays{"1-5,50-100"};
+	long duration{result.config_.duration_.count()};
+
+	// По умолчанию исполняемые файлы ищутся там же, где лежит сам bridge_bench.
+	{
+		const std::string self{argv[0]};
+		const auto slash = self.rfind('/');
+		result.config_.bin_dir_ = std::string::npos == slash ?
+				std::string{"."} : self.substr(0u, slash);
+	}
+
+	// Подготавливаем парсер аргументов командной строки.
+	using namespace clara;
+
+	auto cli = Opt(result.config_.bin_dir_, "dir")["-b"]["--bin-dir"]
+				("directory with delay_server, bridge servers and load_generator "
+				"(default: directory of bridge_bench)")
+		| Opt(variants, "list")["-V"]["--variants"]
+				(fmt::format("comma separated variants to compare (default: {})",
+						variants))
+		| Opt(concurrency, "list")["-c"]["--concurrency"]
+				(fmt::format("comma separated numbers of concurrent requests "
+						"(default: {})", concurrency))
+		| Opt(delays, "list")["-D"]["--delays"]
+				(fmt::format("comma separated min-max pauses of delay_server "
+						"in milliseconds (default: {})", delays))
+		| Opt(duration, "seconds")["-d"]["--duration"]
+				(fmt::format("duration of one measurement (default: {})", duration))
+		| Opt(result.config_.generator_threads_, "threads")["--generator-threads"]
+				(fmt::format("number of load_generator threads (default: {})",
+						result.config_.generator_threads_))
+		| Opt(result.config_.delay_threads_, "threads")["--delay-threads"]
+				(fmt::format("number of delay_server threads (default: {})",
+						result.config_.delay_threads_))
+		| Opt(result.config_.bridge_threads_, "threads")["--bridge-threads"]
+				(fmt::format("number of curl_multi threads of bridge_server_1 "
+						"and worker threads of bridge_server_2 (default: {})",
+						result.config_.bridge_threads_))
+		| Opt(result.config_.bridge_cache_size_, "bytes")["--bridge-cache-size"]
+				(fmt::format("response cache size of bridge_server_2, "
+						"0 disables the cache (default: {})",
+						result.config_.bridge_cache_size_))
+		| Opt(result.config_.dates_, "dates")["--dates"]
+				(fmt::format("number of different dates in requests (default: {})",
+						result.config_.dates_))
+		| Opt(result.config_.date_distribution_, "distribution")["--date-distribution"]
+				(fmt::format("distribution of dates (default: {})",
+						result.config_.date_distribution_))
+		| Opt(result.config_.bridge_port_, "port")["--bridge-port"]
+				(fmt::format("port for bridge servers (default: {})",
+						result.config_.bridge_port_))
+		| Opt(result.config_.delay_port_, "port")["--delay-port"]
+				(fmt::format("port for delay_server (default: {})",
+						result.config_.delay_port_))
+		| Help(result.help_requested_);
+
+	// Выполняем парсинг...
+	auto parse_result = cli.parse(Args(argc, argv));
+	// ...и бросаем исключение если столкнулись с ошибкой.
+	if(!parse_result)
+		throw std::runtime_error("Invalid command line: "
+				+ parse_result.errorMessage());
+
+	if(result.help_requested_)
+		std::cout << cli << std::endl;
+	else {
+		result.config_.variants_ = split_list(variants);
+		if(result.config_.variants_.empty())
+			throw std::runtime_error("no variants to compare");
+
+		result.config_.concurrency_.clear();
+		for(const auto & c : split_list(concurrency)) {
+			const auto value = std::stoul(c);
+			if(0u == value)
+				throw std::runtime_error("concurrency can't be 0");
+			result.config_.concurrency_.push_back(value);
+		}
+		if(result.config_.concurrency_.empty())
+			throw std::runtime_error("no concurrency levels");
+
+		result.config_.delays_.clear();
+		for(const auto & d : split_list(delays)) {
+			const auto dash = d.find('-');
+			if(std::string::npos == dash)
+				throw std::runtime_error("invalid delay range, min-max expected: " + d);
+			const delay_range_t range{
+					std::stol(d.substr(0u, dash)), std::stol(d.substr(dash + 1u))};
+			if(range.min_ <= 0 || range.max_ < range.min_)
+				throw std::runtime_error("invalid delay range: " + d);
+			result.config_.delays_.push_back(range);
+		}
+		if(result.config_.delays_.empty())
+			throw std::runtime_error("no delay ranges");
+
+		if(duration <= 0)
+			throw std::runtime_error("invalid duration");
+		result.config_.duration_ = std::chrono::seconds{duration};
+		if(0u == result.config_.generator_threads_ ||
+				0u == result.config_.delay_threads_ ||
+				0u == result.config_.bridge_threads_)
+			throw std::runtime_error("number of threads can't be 0");
+	}
+
+	return result;
+}
+
+// Дочерний процесс. Завершается при уничтожении объекта.
+class child_process_t {
+public:
+	// Если capture_output равен true, то стандартный вывод процесса
+	// перехватывается и может быть получен через read_output().
+	child_process_t(
+			const std::string & path,
+			const std::vector<std::string> & args,
+			bool capture_output = false) {
+		int pipe_fds[2] = {-1, -1};
+		if(capture_output && 0 != ::pipe2(pipe_fds, O_CLOEXEC))
+			throw std::runtime_error("unable to create pipe");
+
+		std::vector<char *> argv;
+		argv.push_back(const_cast<char *>(path.c_str()));
+		for(const auto & a : args)
+			argv.push_back(const_cast<char *>(a.c_str()));
+		argv.push_back(nullptr);
+
+		pid_ = ::fork();
+		if(-1 == pid_)
+			throw std::runtime_error("fork failed");
+
+		if(0 == pid_) {
+			// Дочерний процесс.
+			if(capture_output) {
+				::dup2(pipe_fds[1], STDOUT_FILENO);
+				::close(pipe_fds[0]);
+				::close(pipe_fds[1]);
+			}
+			else {
+				// Вывод серверов только мешал бы таблице результатов.
+				const int null_fd = ::open("/dev/null", O_WRONLY);
+				if(-1 != null_fd)
+					::dup2(null_fd, STDOUT_FILENO);
+			}
+			::execv(path.c_str(), argv.data());
+			std::cerr << "unable to start " << path << ": "
+					<< std::strerror(errno) << std::endl;
+			::_exit(127);
+		}
+
+		if(capture_output) {
+			::close(pipe_fds[1]);
+			output_fd_ = pipe_fds[0];
+		}
+	}
+
+	~child_process_t() {
+		stop();
+		if(-1 != output_fd_)
+			::close(output_fd_);
+	}
+
+	// Это не Copyable и не Moveable класс.
+	child_process_t(const child_process_t &) = delete;
+	child_process_t(child_process_t &&) = delete;
+
+	pid_t pid() const noexcept { return pid_; }
+
+	// Чтение всего вывода процесса до его завершения.
+	std::string read_output() {
+		std::string result;
+		char buffer[4096];
+		while(true) {
+			const auto n = ::read(output_fd_, buffer, sizeof(buffer));
+			if(n < 0 && EINTR == errno)
+				continue;
+			if(n <= 0)
+				break;
+			result.append(buffer, static_cast<std::size_t>(n));
+		}
+		return result;
+	}
+
+	// Ожидание завершения процесса. Возвращается код завершения.
+	int wait() {
+		int status{0};
+		while(-1 == ::waitpid(pid_, &status, 0) && EINTR == errno) {}
+		pid_ = -1;
+		return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	}
+
+	// Завершение процесса. Сначала процессу дается возможность завершиться
+	// самостоятельно, а если он не успевает, то он убивается.
+	void stop() {
+		if(-1 == pid_)
+			return;
+
+		::kill(pid_, SIGINT);
+		for(int i = 0; i != 50; ++i) {
+			if(pid_ == ::waitpid(pid_, nullptr, WNOHANG)) {
+				pid_ = -1;
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds{100});
+		}
+		::kill(pid_, SIGKILL);
+		::waitpid(pid_, nullptr, 0);
+		pid_ = -1;
+	}
+
+private:
+	pid_t pid_{-1};
+	int output_fd_{-1};
+};
+
+// Ожидание, пока на порту port начнут принимать подключения.
+void wait_for_port(std::uint16_t port) {
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for(int i = 0; i != 100; ++i) {
+		const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+		const bool connected = 0 == ::connect(
+				fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+		::close(fd);
+		if(connected)
+			return;
+		std::this_thread::sleep_for(std::chrono::milliseconds{100});
+	}
+
+	throw std::runtime_error(fmt::format("nobody listens on port {}", port));
+}
+
+// Использование ресурсов процессом.
+struct process_usage_t {
+	// Процессорное время (user + system), секунд.
+	double cpu_seconds_{0.0};
+	// Текущий и пиковый размер резидентной памяти, КиБ.
+	std::uint64_t rss_kb_{0u};
+	std::uint64_t peak_rss_kb_{0u};
+};
+
+process_usage_t read_process_usage(pid_t pid) {
+	process_usage_t result;
+
+	// В /proc/PID/stat имя процесса в скобках может содержать пробелы,
+	// поэтому поля отсчитываются от последней закрывающей скобки.
+	// utime и stime -- 14-е и 15-е поля.
+	{
+		std::ifstream stat{fmt::format("/proc/{}/stat", pid)};
+		std::string content{std::istreambuf_iterator<char>{stat}, {}};
+		const auto paren = content.rfind(')');
+		if(std::string::npos == paren)
+			throw std::runtime_error(fmt::format("unable to read /proc/{}/stat", pid));
+		std::istringstream fields{content.substr(paren + 2u)};
+		std::string skip;
+		// Поля с 3-го по 13-й.
+		for(int i = 3; i != 14; ++i)
+			fields >> skip;
+		unsigned long long utime{0u}, stime{0u};
+		fields >> utime >> stime;
+		result.cpu_seconds_ = static_cast<double>(utime + stime) /
+				static_cast<double>(::sysconf(_SC_CLK_TCK));
+	}
+
+	std::ifstream status{fmt::format("/proc/{}/status", pid)};
+	std::string line;
+	while(std::getline(status, line)) {
+		if(0 == line.compare(0u, 6u, "VmRSS:"))
+			result.rss_kb_ = std::stoull(line.substr(6u));
+		else if(0 == line.compare(0u, 6u, "VmHWM:"))
+			result.peak_rss_kb_ = std::stoull(line.substr(6u));
+	}
+
+	return result;
+}
+
+// Разбор вывода load_generator, который состоит из строк вида key: value.
+std::map<std::string, std::string> parse_generator_output(const std::string & output) {
+	std::map<std::string, std::string> result;
+	std::istringstream in{output};
+	std::string line;
+	while(std::getline(in, line)) {
+		const auto colon = line.find(": ");
+		if(std::string::npos != colon)
+			result[line.substr(0u, colon)] = line.substr(colon + 2u);
+	}
+	return result;
+}
+
+// Результат одного замера в виде строки CSV.
+std::string run_measurement(
+		const config_t & config,
+		const std::string & variant,
+		const delay_range_t & delay,
+		std::size_t concurrency,
+		const child_process_t & delay_server) {
+	const bool direct = "direct" == variant;
+
+	// bridge_server запускается заново для каждого замера.
+	std::unique_ptr<child_process_t> bridge;
+	if(!direct) {
+		std::vector<std::string> args{
+				"-a", "127.0.0.1",
+				"-p", std::to_string(config.bridge_port_),
+				"-T", "127.0.0.1",
+				"-P", std::to_string(config.delay_port_)};
+		if("bridge_server_1" == variant)
+			args.insert(args.end(), {
+					"-c", std::to_string(config.bridge_threads_)});
+		else if("bridge_server_2" == variant)
+			args.insert(args.end(), {
+					"-n", std::to_string(config.bridge_threads_),
+					"--cache-size", std::to_string(config.bridge_cache_size_)});
+
+		bridge = std::make_unique<child_process_t>(
+				config.bin_dir_ + "/" + variant, args);
+		wait_for_port(config.bridge_port_);
+	}
+	const auto measured_pid = direct ? delay_server.pid() : bridge->pid();
+
+	const auto usage_before = read_process_usage(measured_pid);
+
+	child_process_t generator{
+			config.bin_dir_ + "/load_generator",
+			std::vector<std::string>{
+					"-a", "127.0.0.1",
+					"-p", std::to_string(direct ? config.delay_port_ : config.bridge_port_),
+					"-c", std::to_string(concurrency),
+					"-n", std::to_string(std::min(config.generator_threads_, concurrency)),
+					"-d", std::to_string(config.duration_.count()),
+					"--dates", std::to_string(config.dates_),
+					"--date-distribution", config.date_distribution_},
+			true};
+	const auto output = generator.read_output();
+	if(0 != generator.wait())
+		throw std::runtime_error("load_generator failed for " + variant);
+
+	const auto usage_after = read_process_usage(measured_pid);
+
+	auto values = parse_generator_output(output);
+	const auto requests = std::stoull(values["requests"]);
+	const auto cpu_us_per_request = requests ?
+			(usage_after.cpu_seconds_ - usage_before.cpu_seconds_) * 1e6 / requests :
+			0.0;
+
+	// Ошибками считаются все неуспешные ответы.
+	const auto errors = requests - std::stoull(values["ok"]);
+
+	return fmt::format("{},{},{},{},{},{},{},{},{},{},{:.1f},{},{}",
+			variant, delay.min_, delay.max_, concurrency,
+			requests, values["throughput_rps"], errors,
+			values["latency_p50_ms"], values["latency_p99_ms"],
+			values["latency_p999_ms"],
+			cpu_us_per_request, usage_after.rss_kb_, usage_after.peak_rss_kb_);
+}
+
+int main(int argc, char ** argv) {
+	try {
+		const auto cfg = parse_cmd_line_args(argc, argv);
+		if(cfg.help_requested_)
+			return 1;
+		const auto & config = cfg.config_;
+
+		std::cout << "variant,delay_min_ms,delay_max_ms,concurrency,requests,rps,"
+				"errors,p50_ms,p99_ms,p999_ms,cpu_us_per_req,rss_kb,peak_rss_kb"
+				<< std::endl;
+
+		for(const auto & delay : config.delays_) {
+			child_process_t delay_server{
+					config.bin_dir_ + "/delay_server",
+					std::vector<std::string>{
+							"-a", "127.0.0.1",
+							"-p", std::to_string(config.delay_port_),
+							"-m", std::to_string(delay.min_),
+							"-M", std::to_string(delay.max_),
+							"-n", std::to_string(config.delay_threads_)}};
+			wait_for_port(config.delay_port_);
+
+			for(const auto & variant : config.variants_)
+				for(const auto concurrency : config.concurrency_)
+					// Каждая строка выводится сразу, чтобы результаты
+					// не пропали, если какой-то из замеров не удастся.
+					std::cout << run_measurement(
+							config, variant, delay, concurrency, delay_server)
+							<< std::endl;
+		}
+	}
+	catch( const std::exception & ex ) {
+		std::cerr << "Error: " << ex.what() << std::endl;
+		return 2;
+	}
+
+	return 0;
+}
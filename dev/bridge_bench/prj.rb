@@ -0,0 +1,10 @@
+require 'mxx_ru/cpp'
+
+MxxRu::Cpp::exe_target {
+
+  target 'bridge_bench'
+
+  required_prj 'fmt_mxxru/prj.rb'
+
+  cpp_source 'main.cpp'
+}
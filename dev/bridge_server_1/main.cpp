@@ -1,5 +1,10 @@
 #include <iostream>
-#include <queue>
+#include <atomic>
+#include <limits>
+#include <vector>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include <restinio/all.hpp>
 
@@ -11,6 +16,35 @@
 
 #include <curl/curl.h>
 
+#include <common/response_headers.hpp>
+#include <common/admission_control.hpp>
+#include <common/curl_easy_pool.hpp>
+#include <common/inflight_registry.hpp>
+#include <common/reply_buffer.hpp>
+#include <common/request_deadline.hpp>
+#include <common/stage_metrics.hpp>
+
+// Способ распределения запросов между нитями с curl_multi.
+enum class dispatch_policy_t {
+	// Нити выбираются по очереди.
+	round_robin,
+	// Выбирается нить, у которой меньше всего незавершенных запросов.
+	least_outstanding,
+	// Нить выбирается по хэшу URL. Поэтому все запросы к одному URL
+	// попадают на одну нить и могут быть объединены.
+	url_hash
+};
+
+// Получение способа распределения запросов по его имени.
+// Если имя неизвестно, то порождается исключение.
+dispatch_policy_t parse_dispatch_policy(const std::string & name) {
+	if("round-robin" == name) return dispatch_policy_t::round_robin;
+	if("least-outstanding" == name) return dispatch_policy_t::least_outstanding;
+	if("url-hash" == name) return dispatch_policy_t::url_hash;
+
+	throw std::runtime_error("unknown dispatch policy: " + name);
+}
+
 // Конфигурация, которая потребуется серверу.
 struct config_t {
 	// Адрес, на котором нужно слушать новые входящие запросы.
@@ -23,6 +57,24 @@ struct config_t {
 	// Порт, на который нужно адресовать собственные запросы.
 	std::uint16_t target_port_{8090};
 
+	// Количество рабочих нитей с curl_multi.
+	std::size_t curl_threads_{1};
+	// Способ распределения запросов между этими нитями.
+	dispatch_policy_t dispatch_{dispatch_policy_t::round_robin};
+
+	// Максимальное количество исходящих запросов, которые находятся
+	// в обработке или ждут своей очереди. 0 означает отсутствие ограничения.
+	std::size_t max_in_flight_{0u};
+	// Значение заголовка Retry-After для отвергнутых запросов.
+	std::chrono::seconds retry_after_{1};
+
+	// Сколько времени отводится на обработку одного запроса.
+	// 0 означает отсутствие ограничения.
+	std::chrono::milliseconds deadline_{30000};
+
+	// Параметры сброса больших ответов во временный файл.
+	reply_spill_params_t spill_;
+
 	// Нужно ли включать трассировку?
 	bool tracing_{false};
 };
@@ -35,6 +87,9 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 		config_t config_;
 	};
 	result_t result;
+	long retry_after{result.config_.retry_after_.count()};
+	long deadline{result.config_.deadline_.count()};
+	std::string dispatch{"round-robin"};
 
 	// Подготавливаем парсер аргументов командной строки.
 	using namespace clara;
@@ -47,6 +102,28 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 				(fmt::format("target address (default: {})", result.config_.target_address_))
 		| Opt(result.config_.target_port_, "target port")["-P"]["--target-port"]
 				(fmt::format("target port (default: {})", result.config_.target_port_))
+		| Opt(result.config_.curl_threads_, "curl threads")["-c"]["--curl-threads"]
+				(fmt::format("number of threads with curl_multi (default: {})",
+						result.config_.curl_threads_))
+		| Opt(dispatch, "policy")["-D"]["--dispatch"]
+				("how to dispatch requests to curl threads: "
+				"round-robin, least-outstanding, url-hash (default: round-robin)")
+		| Opt(result.config_.max_in_flight_, "requests")["-L"]["--max-in-flight"]
+				("max number of outgoing requests in progress and in queue, "
+				"0 means no limit (default: 0)")
+		| Opt(retry_after, "seconds")["-R"]["--retry-after"]
+				(fmt::format("value of Retry-After for rejected requests (default: {})",
+						retry_after))
+		| Opt(deadline, "ms")["--deadline"]
+				(fmt::format("time for processing of a request in milliseconds, "
+						"0 means no limit (default: {})", deadline))
+		| Opt(result.config_.spill_.threshold_, "bytes")["--spill-threshold"]
+				(fmt::format("replies larger than this are kept in a temp file "
+						"and sent via sendfile, 0 means never (default: {})",
+						result.config_.spill_.threshold_))
+		| Opt(result.config_.spill_.directory_, "dir")["--spill-dir"]
+				(fmt::format("directory for temp files (default: {})",
+						result.config_.spill_.directory_))
 		| Opt(result.config_.tracing_)["-t"]["--tracing"]
 				("turn server tracing ON (default: OFF)")
 		| Help(result.help_requested_);
@@ -60,6 +137,18 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 
 	if(result.help_requested_)
 		std::cout << cli << std::endl;
+	else {
+		if(0u == result.config_.curl_threads_)
+			throw std::runtime_error("number of curl threads can't be 0");
+
+		result.config_.dispatch_ = parse_dispatch_policy(dispatch);
+		if(retry_after < 0)
+			throw std::runtime_error("invalid Retry-After value");
+		result.config_.retry_after_ = std::chrono::seconds{retry_after};
+		if(deadline < 0)
+			throw std::runtime_error("invalid deadline value");
+		result.config_.deadline_ = std::chrono::milliseconds{deadline};
+	}
 
 	return result;
 }
@@ -67,21 +156,56 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 //
 // ПРИМЕЧАНИЕ: ДЛЯ ПРОСТОТЫ И КОМПАКТНОСТИ РЕАЛИЗАЦИИ КОДЫ ВОЗВРАТА
 // ВЫЗЫВАЕМЫХ ИЗ libcurl ФУНКЦИЙ НЕ ПРОВЕРЯЮТСЯ.
+// ТАК ЖЕ НЕ ПРОВЕРЯЮТСЯ КОДЫ ВОЗВРАТА СИСТЕМНЫХ ФУНКЦИЙ ВРОДЕ
+// read, write И Т.Д.
 //
 
-// Примитивная реализация thread-safe контейнера для обмена информацией
-// между разными рабочими нитями.
-// Позволяет только поместить новый элемент в контейнер и попробовать взять
-// элемент из контейнера. Никакого ожидания на попытке извлечения элемента
-// из пустого контейнера нет.
+// Вспомогательная штука, чтобы подавить предупреждения об игнорировании
+// возвращаемого значения.
+namespace {
+	struct just_ignore_t {
+		template<typename T> void operator=(T) {}
+	} _;
+}
+
+// Lock-free очередь для передачи информации от нескольких нитей-писателей
+// к одной нити-читателю.
+//
+// Элементы очереди связываются в интрузивный список посредством поля next_,
+// которое должно быть у типа T. Писатели добавляют элементы в голову списка
+// посредством compare_exchange, а читатель забирает весь список целиком
+// посредством exchange и затем разворачивает его, чтобы элементы
+// обрабатывались в порядке их поступления.
+//
+// Для того, чтобы читатель мог спать, пока очередь пуста, используется
+// eventfd. Писатель выполняет запись в eventfd только когда он помещает
+// элемент в пустую очередь, т.е. на один системный вызов приходится
+// целая пачка элементов. Читатель ждет готовности eventfd к чтению
+// (например, внутри curl_multi_wait) и только после этого вызывает pop().
+// Получить дескриптор eventfd можно посредством метода notify_fd().
 template<typename T>
-class thread_safe_queue_t {
+class mpsc_queue_t {
 	using unique_ptr_t = std::unique_ptr<T>;
 
-	std::mutex lock_;
-	std::queue<unique_ptr_t> content_;
+	// Голова интрузивного списка. Последний помещенный элемент
+	// находится в голове.
+	std::atomic<T *> head_{nullptr};
+
+	std::atomic<bool> closed_{false};
+
+	// Нотификационный дескриптор.
+	const int eventfd_;
+
+	void notify() {
+		const std::uint64_t value{1u};
+		_ = ::write(eventfd_, &value, sizeof(value));
+	}
+
+	void reset_notification() {
+		std::uint64_t value{0u};
+		_ = ::read(eventfd_, &value, sizeof(value));
+	}
 
-	bool closed_{false};
 public:
 	enum class status_t {
 		extracted,
@@ -89,37 +213,81 @@ public:
 		closed
 	};
 
+	mpsc_queue_t()
+		:	eventfd_{::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)} {
+		if(-1 == eventfd_)
+			throw std::runtime_error("unable to create eventfd");
+	}
+	~mpsc_queue_t() {
+		// Элементы, которые так и не были извлечены, нужно удалить вручную.
+		for(T * item = head_.load(); item; ) {
+			unique_ptr_t victim{item};
+			item = item->next_;
+		}
+
+		::close(eventfd_);
+	}
+
+	// Это не Copyable и не Moveable класс.
+	mpsc_queue_t(const mpsc_queue_t &) = delete;
+	mpsc_queue_t(mpsc_queue_t &&) = delete;
+
+	auto notify_fd() const noexcept { return eventfd_; }
+
 	void push(unique_ptr_t what) {
-		std::lock_guard<std::mutex> l{lock_};
-		content_.emplace(std::move(what));
+		T * item = what.release();
+		T * old_head = head_.load(std::memory_order_relaxed);
+		do {
+			item->next_ = old_head;
+		} while(!head_.compare_exchange_weak(old_head, item,
+				std::memory_order_release,
+				std::memory_order_relaxed));
+
+		// Если очередь была пуста, то читатель мог уже заснуть.
+		if(!old_head)
+			notify();
 	}
 
 	// Метод pop получает лямбда-функцию, в которую будут поочередно
 	// переданы все элементы из контейнера, если контейнер не пуст.
-	// Передача будет осуществляться при захваченном mutex-е, что означает,
-	// что новые элементы не могут быть помещенны в очередь, пока pop()
-	// не завершит свою работу.
+	// Писатели в это время не блокируются.
 	template<typename Acceptor>
 	status_t pop(Acceptor && acceptor) {
-		std::lock_guard<std::mutex> l{lock_};
-		if(closed_) {
+		if(closed_.load(std::memory_order_acquire))
 			return status_t::closed;
-		}
-		else if(content_.empty()) {
+
+		// Нотификация должна быть сброшена до того, как будет забрано
+		// содержимое списка. Иначе можно потерять нотификацию от писателя,
+		// который поместит элемент в опустевший список между
+		// exchange и сбросом нотификации.
+		reset_notification();
+
+		T * items = head_.exchange(nullptr, std::memory_order_acquire);
+		if(!items)
 			return status_t::empty_queue;
+
+		// Восстанавливаем порядок поступления элементов.
+		T * reversed{nullptr};
+		while(items) {
+			T * next = items->next_;
+			items->next_ = reversed;
+			reversed = items;
+			items = next;
 		}
-		else {
-			while(!content_.empty()) {
-				acceptor(std::move(content_.front()));
-				content_.pop();
-			}
-			return status_t::extracted;
+
+		while(reversed) {
+			T * next = reversed->next_;
+			reversed->next_ = nullptr;
+			acceptor(unique_ptr_t{reversed});
+			reversed = next;
 		}
+
+		return status_t::extracted;
 	}
 
 	void close() {
-		std::lock_guard<std::mutex> l{lock_};
-		closed_ = true;
+		closed_.store(true, std::memory_order_release);
+		notify();
 	}
 };
 
@@ -132,6 +300,9 @@ struct request_info_t {
 	// Запрос, в рамках которого нужно сделать обращение к удаленному серверу.
 	restinio::request_handle_t original_req_;
 
+	// Момент, до которого на запрос должен быть дан ответ.
+	const request_deadline_t deadline_;
+
 	// Код ошибки от самого curl-а.
 	CURLcode curl_code_{CURLE_OK};
 
@@ -140,15 +311,127 @@ struct request_info_t {
 	long response_code_{0};
 
 	// Ответные данные, которые будут получены от удаленного сервера.
-	std::string reply_data_;
-
-	request_info_t(std::string url, restinio::request_handle_t req)
-		:	url_{std::move(url)}, original_req_{std::move(req)}
+	reply_buffer_t reply_data_;
+
+	// Разрешение на обработку запроса. Возвращается автоматически
+	// при уничтожении объекта.
+	admission_ticket_t ticket_;
+
+	// Запросы к тому же URL, которые присоединились к этому запросу
+	// и ждут его завершения.
+	std::vector<std::unique_ptr<request_info_t>> waiters_;
+
+	// Связь со следующим элементом в очереди заявок.
+	request_info_t * next_{nullptr};
+
+	// Моменты прохождения запросом стадий обработки.
+	stage_timestamps_t timestamps_;
+
+	request_info_t(
+			std::string url,
+			restinio::request_handle_t req,
+			admission_ticket_t ticket,
+			request_deadline_t deadline,
+			const reply_spill_params_t & spill)
+		:	url_{std::move(url)}
+		,	original_req_{std::move(req)}
+		,	deadline_{deadline}
+		,	reply_data_{spill}
+		,	ticket_{std::move(ticket)}
 		{}
 };
 
+// Тип реестра выполняющихся исходящих запросов.
+using request_registry_t = inflight_registry_t<request_info_t>;
+
 // Тип контейнера для обмена информацией между рабочими нитями.
-using request_info_queue_t = thread_safe_queue_t<request_info_t>;
+using request_info_queue_t = mpsc_queue_t<request_info_t>;
+
+// Одна рабочая нить с curl_multi и все, что к ней относится.
+//
+// Экземпляр curl_multi создается на самой рабочей нити и используется
+// только ею. Поэтому у каждой нити собственный кэш соединений.
+struct curl_shard_t {
+	// Очередь заявок для этой нити.
+	request_info_queue_t queue_;
+
+	// Количество запросов, которые были переданы этой нити, но
+	// еще не завершились.
+	std::atomic<std::size_t> outstanding_{0u};
+
+	// Время, которое запросы этой нити провели на стадиях обработки.
+	stage_metrics_t metrics_;
+};
+
+// Набор рабочих нитей с curl_multi и распределение запросов между ними.
+//
+// Метод push() вызывается только на нити RESTinio-сервера, которая
+// всего одна. Поэтому счетчик для round-robin не нуждается в защите.
+class curl_shards_t {
+	std::vector<std::unique_ptr<curl_shard_t>> shards_;
+
+	const dispatch_policy_t policy_;
+
+	// Номер нити, которая будет выбрана следующей при round-robin.
+	std::size_t next_{0u};
+
+	curl_shard_t & select(const request_info_t & info) {
+		if(dispatch_policy_t::url_hash == policy_)
+			return *shards_[std::hash<std::string>{}(info.url_) % shards_.size()];
+
+		if(dispatch_policy_t::least_outstanding == policy_) {
+			curl_shard_t * result{nullptr};
+			std::size_t min_outstanding{std::numeric_limits<std::size_t>::max()};
+			for(auto & shard : shards_) {
+				const auto outstanding =
+						shard->outstanding_.load(std::memory_order_relaxed);
+				if(outstanding < min_outstanding) {
+					min_outstanding = outstanding;
+					result = shard.get();
+				}
+			}
+			return *result;
+		}
+
+		auto & shard = *shards_[next_];
+		next_ = (next_ + 1u) % shards_.size();
+		return shard;
+	}
+
+public:
+	curl_shards_t(std::size_t count, dispatch_policy_t policy)
+		:	policy_{policy} {
+		shards_.reserve(count);
+		for(std::size_t i = 0u; i != count; ++i)
+			shards_.emplace_back(std::make_unique<curl_shard_t>());
+	}
+
+	auto size() const noexcept { return shards_.size(); }
+
+	curl_shard_t & at(std::size_t index) { return *shards_.at(index); }
+
+	// Передача запроса одной из нитей.
+	void push(std::unique_ptr<request_info_t> info) {
+		auto & shard = select(*info);
+		shard.outstanding_.fetch_add(1u, std::memory_order_relaxed);
+		info->timestamps_.mark_enqueued();
+		shard.queue_.push(std::move(info));
+	}
+
+	// Метрики стадий обработки суммарно по всем нитям.
+	stage_metrics_t::snapshot_t metrics() const {
+		stage_metrics_t::snapshot_t result;
+		for(const auto & shard : shards_)
+			shard->metrics_.add_to(result);
+		return result;
+	}
+
+	// Все нити должны завершить свою работу.
+	void close() {
+		for(auto & shard : shards_)
+			shard->queue_.close();
+	}
+};
 
 // Эту функцию будет вызывать curl когда начнут приходить данные
 // от удаленного сервера. Указатель на нее будет задан через
@@ -157,25 +440,63 @@ std::size_t write_callback(
 		char *ptr, size_t size, size_t nmemb, void *userdata) {
 	auto info = reinterpret_cast<request_info_t *>(userdata);
 	const auto total_size = size * nmemb;
-	info->reply_data_.append(ptr, total_size);
+	// Если данные сохранить не удалось, то запрос прерывается.
+	if(!info->reply_data_.append(ptr, total_size))
+		return 0u;
 
 	return total_size;
 }
 
-// Создать curl_easy для нового исходящего запроса, заполнить все нужные
-// для него значения и передать этот новый curl_easy в curl_multi.
+// Эту функцию будет вызывать curl для каждой строки заголовка ответа
+// удаленного сервера. Если сервер сообщил размер ответа, то память
+// под ответ выделяется сразу и целиком.
+std::size_t header_callback(
+		char *ptr, size_t size, size_t nitems, void *userdata) {
+	auto info = reinterpret_cast<request_info_t *>(userdata);
+	const auto total_size = size * nitems;
+
+	std::size_t content_length;
+	if(parse_content_length(ptr, total_size, content_length))
+		info->reply_data_.expect(content_length);
+
+	return total_size;
+}
+
+// Создание пула curl_easy для рабочей нити. Общие для всех запросов
+// опции устанавливаются один раз при создании очередного curl_easy.
+auto make_curl_easy_pool(CURLSH * share) {
+	return std::make_unique<curl_easy_pool_t>(share, [](CURL * h) {
+			curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, write_callback);
+			curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, header_callback);
+		});
+}
+
+// Взять curl_easy для нового исходящего запроса из пула, заполнить все
+// нужные для него значения и передать этот curl_easy в curl_multi.
 void introduce_new_request_to_curl_multi(
 		CURLM * curlm,
+		curl_easy_pool_t & pool,
+		request_registry_t & registry,
 		std::unique_ptr<request_info_t> info) {
-	// Создаем и подготавливаем curl_easy экземпляр для нового запроса.
-	CURL * h = curl_easy_init();
+	// Если запрос к этому URL уже выполняется, то новый запрос просто
+	// присоединяется к нему и обращения к удаленному серверу не требуется.
+	if(auto leader = registry.find_or_register(info->url_, info.get())) {
+		leader->waiters_.push_back(std::move(info));
+		return;
+	}
+
+	// Берем и подготавливаем curl_easy экземпляр для нового запроса.
+	CURL * h = pool.acquire();
 	curl_easy_setopt(h, CURLOPT_URL, info->url_.c_str());
 	curl_easy_setopt(h, CURLOPT_PRIVATE, info.get());
-
-	curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, write_callback);
 	curl_easy_setopt(h, CURLOPT_WRITEDATA, info.get());
+	curl_easy_setopt(h, CURLOPT_HEADERDATA, info.get());
+	// Исходящий запрос может длиться не дольше, чем осталось
+	// времени на обработку входящего запроса.
+	info->deadline_.apply_to(h);
 
 	// Новый curl_easy подготовлен, можно отдать его в curl_multi.
+	info->timestamps_.mark_dispatched();
 	curl_multi_add_handle(curlm, h);
 
 	// unique_ptr не должен больше нести ответственность за объект.
@@ -186,38 +507,63 @@ void introduce_new_request_to_curl_multi(
 // Попытка извлечения всех запросов, которые ждут в очереди.
 // Если возвращается status_t::closed, значит работа должна быть
 // остановлена.
-auto try_extract_new_requests(request_info_queue_t & queue, CURLM * curlm) {
-	return queue.pop([curlm](auto info) {
-			introduce_new_request_to_curl_multi(curlm, std::move(info));
+auto try_extract_new_requests(
+		curl_shard_t & shard,
+		CURLM * curlm,
+		curl_easy_pool_t & pool,
+		request_registry_t & registry) {
+	return shard.queue_.pop([&shard, curlm, &pool, &registry](auto info) {
+			// Если время на обработку запроса истекло, пока запрос ждал
+			// в очереди, то обращаться к удаленному серверу уже поздно.
+			if(info->deadline_.expired()) {
+				reply_gateway_timeout(info->original_req_);
+				shard.outstanding_.fetch_sub(1u, std::memory_order_relaxed);
+				return;
+			}
+
+			introduce_new_request_to_curl_multi(
+					curlm, pool, registry, std::move(info));
 		});
 }
 
 // Финальная стадия обработки запроса к удаленному серверу.
 // curl_multi свою часть работы сделал. Осталось создать http-response,
 // который будет отослан в ответ на входящий http-request.
-void complete_request_processing(request_info_t & info) {
-	auto response = info.original_req_->create_response();
+//
+// Результат исходящего запроса берется из info, а сам ответ формируется
+// для req. Это может быть как запрос, инициировавший обращение к удаленному
+// серверу, так и любой из присоединившихся к нему запросов.
+void complete_request_processing(
+		const request_info_t & info,
+		const restinio::request_handle_t & req) {
+	// Удаленный сервер не успел ответить за отведенное время.
+	if(CURLE_OPERATION_TIMEDOUT == info.curl_code_) {
+		reply_gateway_timeout(req);
+		return;
+	}
+
+	auto response = req->create_response();
 
-	response.append_header(restinio::http_field::server,
-			"RESTinio hello world server");
-	response.append_header_date_field();
-	response.append_header(restinio::http_field::content_type,
-			"text/plain; charset=utf-8");
+	append_common_headers(response);
 
 	if(CURLE_OK == info.curl_code_) {
-		if(200 == info.response_code_)
+		if(200 == info.response_code_) {
+			// Ответ удаленного сервера не копируется, а передается
+			// в RESTinio в виде списка блоков.
 			response.set_body(
 				fmt::format("Request processed.\nPath: {}\nQuery: {}\n"
-						"Response:\n===\n{}\n===\n",
-					info.original_req_->header().path(),
-					info.original_req_->header().query(),
-					info.reply_data_));
+						"Response:\n===\n",
+					req->header().path(),
+					req->header().query()));
+			info.reply_data_.append_to(response);
+			response.append_body(restinio::const_buffer("\n===\n", 5u));
+		}
 		else
 			response.set_body(
 				fmt::format("Request failed.\nPath: {}\nQuery: {}\n"
 						"Response code: {}\n",
-					info.original_req_->header().path(),
-					info.original_req_->header().query(),
+					req->header().path(),
+					req->header().query(),
 					info.response_code_));
 	}
 	else
@@ -226,9 +572,21 @@ void complete_request_processing(request_info_t & info) {
 	response.done();
 }
 
+// Формирование ответов на запрос, который обращался к удаленному серверу,
+// и на все присоединившиеся к нему запросы.
+void complete_request_and_waiters(const request_info_t & info) {
+	complete_request_processing(info, info.original_req_);
+	for(const auto & waiter : info.waiters_)
+		complete_request_processing(info, waiter->original_req_);
+}
+
 // Попытка обработать все сообщения, которые на данный момент существуют
 // в curl_multi.
-void check_curl_op_completion(CURLM * curlm) {
+void check_curl_op_completion(
+		curl_shard_t & shard,
+		CURLM * curlm,
+		curl_easy_pool_t & pool,
+		request_registry_t & registry) {
 	CURLMsg * msg;
 	int messages_left{0};
 
@@ -237,19 +595,18 @@ void check_curl_op_completion(CURLM * curlm) {
 	while(nullptr != (msg = curl_multi_info_read(curlm, &messages_left))) {
 		if(CURLMSG_DONE == msg->msg) {
 			// Нашли операцию, которая реально завершилась.
-			// Сразу забераем ее под unique_ptr, дабы не забыть вызвать
-			// curl_easy_cleanup.
-			std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> easy_handle{
-					msg->easy_handle,
-					&curl_easy_cleanup};
+			// Сразу же обеспечиваем возврат ее curl_easy в пул.
+			CURL * easy_handle = msg->easy_handle;
+			auto easy_handle_releaser = cpp_util_3::at_scope_exit(
+					[&pool, easy_handle]{ pool.release(easy_handle); });
 
 			// Эта операция в curl_multi больше участвовать не должна.
-			curl_multi_remove_handle(curlm, easy_handle.get());
+			curl_multi_remove_handle(curlm, easy_handle);
 
 			// Разбираемся с оригинальным запросом, с которым эта операция
 			// была связана.
 			request_info_t * info_raw_ptr{nullptr};
-			curl_easy_getinfo(easy_handle.get(), CURLINFO_PRIVATE, &info_raw_ptr);
+			curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &info_raw_ptr);
 			// Сразу оборачиваем в unique_ptr, чтобы удалить объект.
 			std::unique_ptr<request_info_t> info{info_raw_ptr};
 
@@ -257,93 +614,127 @@ void check_curl_op_completion(CURLM * curlm) {
 			if(CURLE_OK == info->curl_code_) {
 				// Нужно достать код, с которым нам ответил сервер.
 				curl_easy_getinfo(
-						easy_handle.get(),
+						easy_handle,
 						CURLINFO_RESPONSE_CODE,
 						&info->response_code_);
 			}
 
+			info->timestamps_.mark_completed(easy_handle);
+			shard.metrics_.record(info->timestamps_);
+
+			// Запрос к этому URL больше не выполняется, новые запросы
+			// к нему должны приводить к новому обращению.
+			registry.remove(info->url_);
+
 			// Теперь уже можно завершить обработку.
-			complete_request_processing(*info);
+			complete_request_and_waiters(*info);
+			shard.outstanding_.fetch_sub(
+					1u + info->waiters_.size(), std::memory_order_relaxed);
 		}
 	}
 }
 
 // Реализация рабочей нити, на которой будут выполняться операции
 // curl_multi_perform.
-void curl_multi_work_thread(request_info_queue_t & queue) {
+void curl_multi_work_thread(curl_shard_t & shard, CURLSH * share) {
 	using namespace cpp_util_3;
 
-	// Инциализируем сам curl.
-	curl_global_init(CURL_GLOBAL_ALL);
-	auto curl_global_deinitializer =
-			at_scope_exit([]{ curl_global_cleanup(); });
+	auto & queue = shard.queue_;
 
 	// Создаем экземпляр curl_multi, который нам потребуется для выполнения
 	// запросов к удаленному серверу.
 	auto curlm = curl_multi_init();
 	auto curlm_destroyer = at_scope_exit([&]{ curl_multi_cleanup(curlm); });
 
+	// Пул curl_easy для запросов этой нити.
+	auto pool = make_curl_easy_pool(share);
+	// Реестр выполняющихся на этой нити исходящих запросов.
+	request_registry_t registry;
+
 	// Количество активных операций.
 	int still_running{ 0 };
 
 	while(true) {
-		// Сперва пытаемся взять новые заявки. Делаем это до тех пор,
-		// пока очередь не будет опустошена.
-		auto status = try_extract_new_requests(queue, curlm);
-		if(request_info_queue_t::status_t::closed == status)
-			// Работу нужно завершать.
-			// Запросы, которые остались необработанными оставляем как есть.
-			return;
-
-		// Если удалось что-то извлечь или если есть незавершенные операции,
-		// то вызываем curl_multi_perform.
-		if(0 != still_running ||
-				request_info_queue_t::status_t::extracted == status) {
-			curl_multi_perform(curlm, &still_running);
-			// Пытаемся проверить, закончились ли какие-нибудь операции.
-			check_curl_op_completion(curlm);
+		// Ждем либо событий ввода-вывода для активных операций, либо
+		// появления новых заявок в очереди. Таймаут здесь лишь страховка,
+		// т.к. curl_multi_wait сам сокращает время ожидания, если этого
+		// требуют активные операции.
+		curl_waitfd notify_fd;
+		notify_fd.fd = queue.notify_fd();
+		notify_fd.events = CURL_WAIT_POLLIN;
+		notify_fd.revents = 0;
+
+		curl_multi_wait(curlm, &notify_fd, 1, 1000 /*ms*/, nullptr);
+
+		if(0 != notify_fd.revents) {
+			// Нужно забирать новые заявки.
+			auto status = try_extract_new_requests(shard, curlm, *pool, registry);
+			if(request_info_queue_t::status_t::closed == status)
+				// Работу нужно завершать.
+				// Запросы, которые остались необработанными оставляем как есть.
+				return;
 		}
 
-		// Если есть незаврешенные операции, то вызываем curl_multi_wait,
-		// чтобы подождать событий ввода-вывода.
-		if(0 != still_running) {
-			curl_multi_wait(curlm, nullptr, 0, 50 /*ms*/, nullptr);
-		}
-		else {
-			// Никаких активностей нет, поэтому просто заснем, чтобы чуть позже
-			// проверить, не появились ли новые запросы.
-			std::this_thread::sleep_for(std::chrono::milliseconds(50));
-		}
+		curl_multi_perform(curlm, &still_running);
+		// Пытаемся проверить, закончились ли какие-нибудь операции.
+		check_curl_op_completion(shard, curlm, *pool, registry);
 	}
 }
 
 // Реализация обработчика запросов.
 restinio::request_handling_status_t handler(
 		const config_t & config,
-		request_info_queue_t & queue,
+		curl_shards_t & shards,
+		admission_controller_t & admission,
 		restinio::request_handle_t req) {
 	if(restinio::http_method_get() == req->header().method()
 			&& "/data" == req->header().path()) {
+		const auto timestamps = stage_timestamps_t::accepted_now();
+
+		// Если исходящих запросов уже слишком много, то лучше сразу
+		// ответить отказом, чем заставлять клиента долго ждать.
+		auto ticket = admission.try_admit();
+		if(!ticket)
+			return reject_overloaded(req, config.retry_after_);
+
 		// Разберем дополнительные параметры запроса.
 		const auto qp = restinio::parse_query(req->header().query());
 
 		// Нужно оформить объект с информацией о запросе и передать
-		// его на обработку в нить curl_multi.
+		// его на обработку в одну из нитей curl_multi.
 		auto url = fmt::format("http://{}:{}/{}/{}/{}",
 				config.target_address_,
 				config.target_port_,
 				qp["year"], qp["month"], qp["day"]);
 
 		auto info = std::make_unique<request_info_t>(
-				std::move(url), std::move(req));
+				std::move(url), std::move(req), std::move(ticket),
+				request_deadline_t::after(config.deadline_),
+				config.spill_);
+		info->timestamps_ = timestamps;
 
-		queue.push(std::move(info));
+		shards.push(std::move(info));
 
 		// Подтверждаем, что мы приняли запрос к обработке и что когда-то
 		// мы ответ сгенерируем.
 		return restinio::request_accepted();
 	}
 
+	if(restinio::http_method_get() == req->header().method()
+			&& "/stats" == req->header().path())
+		// Текущие значения счетчиков принятых и отвергнутых запросов.
+		return reply_admission_stats(req,
+				admission.limit(),
+				admission.in_flight(),
+				admission.accepted(),
+				admission.shed());
+
+	if(restinio::http_method_get() == req->header().method()
+			&& "/metrics" == req->header().path())
+		// Время, которое запросы проводят на стадиях обработки,
+		// в формате Prometheus.
+		return reply_prometheus_metrics(req, shards.metrics());
+
 	// Все остальные запросы нашим демонстрационным сервером отвергаются.
 	return restinio::request_rejected();
 }
@@ -366,24 +757,43 @@ int main(int argc, char ** argv) {
 		if(cfg.help_requested_)
 			return 1;
 
-		// Нам потребуется контейнер для передачи информации между
+		// Инциализируем сам curl. Это нужно сделать до запуска рабочих
+		// нитей, т.к. curl_global_init не является thread-safe.
+		curl_global_init(CURL_GLOBAL_ALL);
+		auto curl_global_deinitializer =
+				cpp_util_3::at_scope_exit([]{ curl_global_cleanup(); });
+
+		// Кэш DNS разделяется между всеми рабочими нитями.
+		curl_share_t curl_share;
+
+		// Счетчик исходящих запросов. Должен пережить все объекты
+		// с информацией о запросах, т.к. они возвращают ему разрешения.
+		admission_controller_t admission{cfg.config_.max_in_flight_};
+
+		// Нам потребуются контейнеры для передачи информации между
 		// рабочими нитями.
-		request_info_queue_t queue;
+		curl_shards_t shards{cfg.config_.curl_threads_, cfg.config_.dispatch_};
 
 		// Актуальный обработчик входящих HTTP-запросов.
-		auto actual_handler = [&cfg, &queue](auto req) {
-				return handler(cfg.config_, queue, std::move(req));
+		auto actual_handler = [&cfg, &shards, &admission](auto req) {
+				return handler(cfg.config_, shards, admission, std::move(req));
 			};
 
-		// Запускаем отдельную рабочую нить, на которой будут выполняться
+		// Запускаем отдельные рабочие нити, на которых будут выполняться
 		// запросы к удаленному серверу посредством curl_multi_perform.
-		std::thread curl_thread{[&queue]{ curl_multi_work_thread(queue); }};
+		std::vector<std::thread> curl_threads;
+		curl_threads.reserve(shards.size());
 		// Защищаемся от выхода из скоупа без предварительного останова
-		// этой отдельной рабочей нити.
-		auto curl_thread_stopper = cpp_util_3::at_scope_exit([&] {
-				queue.close();
-				curl_thread.join();
+		// этих отдельных рабочих нитей.
+		auto curl_threads_stopper = cpp_util_3::at_scope_exit([&] {
+				shards.close();
+				for(auto & t : curl_threads)
+					t.join();
 			});
+		for(std::size_t i = 0u; i != shards.size(); ++i)
+			curl_threads.emplace_back([&shards, &curl_share, i]{
+					curl_multi_work_thread(shards.at(i), curl_share.handle());
+				});
 
 		// Теперь можно запустить основной HTTP-сервер.
 
@@ -11,6 +11,14 @@
 
 #include <curl/curl.h>
 
+#include <common/response_headers.hpp>
+#include <common/admission_control.hpp>
+#include <common/curl_easy_pool.hpp>
+#include <common/inflight_registry.hpp>
+#include <common/reply_buffer.hpp>
+#include <common/request_deadline.hpp>
+#include <common/stage_metrics.hpp>
+
 // Конфигурация, которая потребуется серверу.
 struct config_t {
 	// Адрес, на котором нужно слушать новые входящие запросы.
@@ -23,6 +31,19 @@ struct config_t {
 	// Порт, на который нужно адресовать собственные запросы.
 	std::uint16_t target_port_{8090};
 
+	// Максимальное количество исходящих запросов, которые находятся
+	// в обработке или ждут своей очереди. 0 означает отсутствие ограничения.
+	std::size_t max_in_flight_{0u};
+	// Значение заголовка Retry-After для отвергнутых запросов.
+	std::chrono::seconds retry_after_{1};
+
+	// Сколько времени отводится на обработку одного запроса.
+	// 0 означает отсутствие ограничения.
+	std::chrono::milliseconds deadline_{30000};
+
+	// Параметры сброса больших ответов во временный файл.
+	reply_spill_params_t spill_;
+
 	// Нужно ли включать трассировку?
 	bool tracing_{false};
 };
@@ -35,6 +56,8 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 		config_t config_;
 	};
 	result_t result;
+	long retry_after{result.config_.retry_after_.count()};
+	long deadline{result.config_.deadline_.count()};
 
 	// Подготавливаем парсер аргументов командной строки.
 	using namespace clara;
@@ -47,6 +70,22 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 				(fmt::format("target address (default: {})", result.config_.target_address_))
 		| Opt(result.config_.target_port_, "target port")["-P"]["--target-port"]
 				(fmt::format("target port (default: {})", result.config_.target_port_))
+		| Opt(result.config_.max_in_flight_, "requests")["-L"]["--max-in-flight"]
+				("max number of outgoing requests in progress and in queue, "
+				"0 means no limit (default: 0)")
+		| Opt(retry_after, "seconds")["-R"]["--retry-after"]
+				(fmt::format("value of Retry-After for rejected requests (default: {})",
+						retry_after))
+		| Opt(deadline, "ms")["--deadline"]
+				(fmt::format("time for processing of a request in milliseconds, "
+						"0 means no limit (default: {})", deadline))
+		| Opt(result.config_.spill_.threshold_, "bytes")["--spill-threshold"]
+				(fmt::format("replies larger than this are kept in a temp file "
+						"and sent via sendfile, 0 means never (default: {})",
+						result.config_.spill_.threshold_))
+		| Opt(result.config_.spill_.directory_, "dir")["--spill-dir"]
+				(fmt::format("directory for temp files (default: {})",
+						result.config_.spill_.directory_))
 		| Opt(result.config_.tracing_)["-t"]["--tracing"]
 				("turn server tracing ON (default: OFF)")
 		| Help(result.help_requested_);
@@ -60,6 +99,14 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 
 	if(result.help_requested_)
 		std::cout << cli << std::endl;
+	else {
+		if(retry_after < 0)
+			throw std::runtime_error("invalid Retry-After value");
+		result.config_.retry_after_ = std::chrono::seconds{retry_after};
+		if(deadline < 0)
+			throw std::runtime_error("invalid deadline value");
+		result.config_.deadline_ = std::chrono::milliseconds{deadline};
+	}
 
 	return result;
 }
@@ -195,6 +242,9 @@ struct request_info_t {
 	// Запрос, в рамках которого нужно сделать обращение к удаленному серверу.
 	restinio::request_handle_t original_req_;
 
+	// Момент, до которого на запрос должен быть дан ответ.
+	const request_deadline_t deadline_;
+
 	// Код ошибки от самого curl-а.
 	CURLcode curl_code_{CURLE_OK};
 
@@ -203,13 +253,36 @@ struct request_info_t {
 	long response_code_{0};
 
 	// Ответные данные, которые будут получены от удаленного сервера.
-	std::string reply_data_;
-
-	request_info_t(std::string url, restinio::request_handle_t req)
-		:	url_{std::move(url)}, original_req_{std::move(req)}
+	reply_buffer_t reply_data_;
+
+	// Разрешение на обработку запроса. Возвращается автоматически
+	// при уничтожении объекта.
+	admission_ticket_t ticket_;
+
+	// Запросы к тому же URL, которые присоединились к этому запросу
+	// и ждут его завершения.
+	std::vector<std::unique_ptr<request_info_t>> waiters_;
+
+	// Моменты прохождения запросом стадий обработки.
+	stage_timestamps_t timestamps_;
+
+	request_info_t(
+			std::string url,
+			restinio::request_handle_t req,
+			admission_ticket_t ticket,
+			request_deadline_t deadline,
+			const reply_spill_params_t & spill)
+		:	url_{std::move(url)}
+		,	original_req_{std::move(req)}
+		,	deadline_{deadline}
+		,	reply_data_{spill}
+		,	ticket_{std::move(ticket)}
 		{}
 };
 
+// Тип реестра выполняющихся исходящих запросов.
+using request_registry_t = inflight_registry_t<request_info_t>;
+
 // Тип контейнера для обмена информацией между рабочими нитями.
 using request_info_queue_t = thread_safe_queue_t<request_info_t>;
 
@@ -223,25 +296,63 @@ std::size_t write_callback(
 		void *userdata) {
 	auto info = reinterpret_cast<request_info_t *>(userdata);
 	const auto total_size = size * nmemb;
-	info->reply_data_.append(ptr, total_size);
+	// Если данные сохранить не удалось, то запрос прерывается.
+	if(!info->reply_data_.append(ptr, total_size))
+		return 0u;
 
 	return total_size;
 }
 
-// Создать curl_easy для нового исходящего запроса, заполнить все нужные
-// для него значения и передать этот новый curl_easy в curl_multi.
+// Эту функцию будет вызывать curl для каждой строки заголовка ответа
+// удаленного сервера. Если сервер сообщил размер ответа, то память
+// под ответ выделяется сразу и целиком.
+std::size_t header_callback(
+		char *ptr, size_t size, size_t nitems, void *userdata) {
+	auto info = reinterpret_cast<request_info_t *>(userdata);
+	const auto total_size = size * nitems;
+
+	std::size_t content_length;
+	if(parse_content_length(ptr, total_size, content_length))
+		info->reply_data_.expect(content_length);
+
+	return total_size;
+}
+
+// Создание пула curl_easy для рабочей нити. Общие для всех запросов
+// опции устанавливаются один раз при создании очередного curl_easy.
+auto make_curl_easy_pool(CURLSH * share) {
+	return std::make_unique<curl_easy_pool_t>(share, [](CURL * h) {
+			curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, write_callback);
+			curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, header_callback);
+		});
+}
+
+// Взять curl_easy для нового исходящего запроса из пула, заполнить все
+// нужные для него значения и передать этот curl_easy в curl_multi.
 void introduce_new_request_to_curl_multi(
 		CURLM * curlm,
+		curl_easy_pool_t & pool,
+		request_registry_t & registry,
 		std::unique_ptr<request_info_t> info) {
-	// Создаем и подготавливаем curl_easy экземпляр для нового запроса.
-	CURL * h = curl_easy_init();
+	// Если запрос к этому URL уже выполняется, то новый запрос просто
+	// присоединяется к нему и обращения к удаленному серверу не требуется.
+	if(auto leader = registry.find_or_register(info->url_, info.get())) {
+		leader->waiters_.push_back(std::move(info));
+		return;
+	}
+
+	// Берем и подготавливаем curl_easy экземпляр для нового запроса.
+	CURL * h = pool.acquire();
 	curl_easy_setopt(h, CURLOPT_URL, info->url_.c_str());
 	curl_easy_setopt(h, CURLOPT_PRIVATE, info.get());
-
-	curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, write_callback);
 	curl_easy_setopt(h, CURLOPT_WRITEDATA, info.get());
+	curl_easy_setopt(h, CURLOPT_HEADERDATA, info.get());
+	// Исходящий запрос может длиться не дольше, чем осталось
+	// времени на обработку входящего запроса.
+	info->deadline_.apply_to(h);
 
 	// Новый curl_easy подготовлен, можно отдать его в curl_multi.
+	info->timestamps_.mark_dispatched();
 	curl_multi_add_handle(curlm, h);
 
 	// unique_ptr не должен больше нести ответственность за объект.
@@ -252,38 +363,62 @@ void introduce_new_request_to_curl_multi(
 // Попытка извлечения всех запросов, которые ждут в очереди.
 // Если возвращается status_t::closed, значит работа должна быть
 // остановлена.
-auto try_extract_new_requests(request_info_queue_t & queue, CURLM * curlm) {
-	return queue.pop([curlm](auto info) {
-			introduce_new_request_to_curl_multi(curlm, std::move(info));
+auto try_extract_new_requests(
+		request_info_queue_t & queue,
+		CURLM * curlm,
+		curl_easy_pool_t & pool,
+		request_registry_t & registry) {
+	return queue.pop([curlm, &pool, &registry](auto info) {
+			// Если время на обработку запроса истекло, пока запрос ждал
+			// в очереди, то обращаться к удаленному серверу уже поздно.
+			if(info->deadline_.expired()) {
+				reply_gateway_timeout(info->original_req_);
+				return;
+			}
+
+			introduce_new_request_to_curl_multi(
+					curlm, pool, registry, std::move(info));
 		});
 }
 
 // Финальная стадия обработки запроса к удаленному серверу.
 // curl_multi свою часть работы сделал. Осталось создать http-response,
 // который будет отослан в ответ на входящий http-request.
-void complete_request_processing(request_info_t & info) {
-	auto response = info.original_req_->create_response();
+//
+// Результат исходящего запроса берется из info, а сам ответ формируется
+// для req. Это может быть как запрос, инициировавший обращение к удаленному
+// серверу, так и любой из присоединившихся к нему запросов.
+void complete_request_processing(
+		const request_info_t & info,
+		const restinio::request_handle_t & req) {
+	// Удаленный сервер не успел ответить за отведенное время.
+	if(CURLE_OPERATION_TIMEDOUT == info.curl_code_) {
+		reply_gateway_timeout(req);
+		return;
+	}
+
+	auto response = req->create_response();
 
-	response.append_header(restinio::http_field::server,
-			"RESTinio hello world server");
-	response.append_header_date_field();
-	response.append_header(restinio::http_field::content_type,
-			"text/plain; charset=utf-8");
+	append_common_headers(response);
 
 	if(CURLE_OK == info.curl_code_) {
-		if(200 == info.response_code_)
+		if(200 == info.response_code_) {
+			// Ответ удаленного сервера не копируется, а передается
+			// в RESTinio в виде списка блоков.
 			response.set_body(
 				fmt::format("Request processed.\nPath: {}\nQuery: {}\n"
-						"Response:\n===\n{}\n===\n",
-					info.original_req_->header().path(),
-					info.original_req_->header().query(),
-					info.reply_data_));
+						"Response:\n===\n",
+					req->header().path(),
+					req->header().query()));
+			info.reply_data_.append_to(response);
+			response.append_body(restinio::const_buffer("\n===\n", 5u));
+		}
 		else
 			response.set_body(
 				fmt::format("Request failed.\nPath: {}\nQuery: {}\n"
 						"Response code: {}\n",
-					info.original_req_->header().path(),
-					info.original_req_->header().query(),
+					req->header().path(),
+					req->header().query(),
 					info.response_code_));
 	}
 	else
@@ -292,9 +427,21 @@ void complete_request_processing(request_info_t & info) {
 	response.done();
 }
 
+// Формирование ответов на запрос, который обращался к удаленному серверу,
+// и на все присоединившиеся к нему запросы.
+void complete_request_and_waiters(const request_info_t & info) {
+	complete_request_processing(info, info.original_req_);
+	for(const auto & waiter : info.waiters_)
+		complete_request_processing(info, waiter->original_req_);
+}
+
 // Попытка обработать все сообщения, которые на данный момент существуют
 // в curl_multi.
-void check_curl_op_completion(CURLM * curlm) {
+void check_curl_op_completion(
+		CURLM * curlm,
+		curl_easy_pool_t & pool,
+		request_registry_t & registry,
+		stage_metrics_t & metrics) {
 	CURLMsg * msg;
 	int messages_left{0};
 
@@ -303,19 +450,18 @@ void check_curl_op_completion(CURLM * curlm) {
 	while(nullptr != (msg = curl_multi_info_read(curlm, &messages_left))) {
 		if(CURLMSG_DONE == msg->msg) {
 			// Нашли операцию, которая реально завершилась.
-			// Сразу забераем ее под unique_ptr, дабы не забыть вызвать
-			// curl_easy_cleanup.
-			std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> easy_handle{
-					msg->easy_handle,
-					&curl_easy_cleanup};
+			// Сразу же обеспечиваем возврат ее curl_easy в пул.
+			CURL * easy_handle = msg->easy_handle;
+			auto easy_handle_releaser = cpp_util_3::at_scope_exit(
+					[&pool, easy_handle]{ pool.release(easy_handle); });
 
 			// Эта операция в curl_multi больше участвовать не должна.
-			curl_multi_remove_handle(curlm, easy_handle.get());
+			curl_multi_remove_handle(curlm, easy_handle);
 
 			// Разбираемся с оригинальным запросом, с которым эта операция
 			// была связана.
 			request_info_t * info_raw_ptr{nullptr};
-			curl_easy_getinfo(easy_handle.get(), CURLINFO_PRIVATE, &info_raw_ptr);
+			curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &info_raw_ptr);
 			// Сразу оборачиваем в unique_ptr, чтобы удалить объект.
 			std::unique_ptr<request_info_t> info{info_raw_ptr};
 
@@ -323,20 +469,29 @@ void check_curl_op_completion(CURLM * curlm) {
 			if(CURLE_OK == info->curl_code_) {
 				// Нужно достать код, с которым нам ответил сервер.
 				curl_easy_getinfo(
-						easy_handle.get(),
+						easy_handle,
 						CURLINFO_RESPONSE_CODE,
 						&info->response_code_);
 			}
 
+			info->timestamps_.mark_completed(easy_handle);
+			metrics.record(info->timestamps_);
+
+			// Запрос к этому URL больше не выполняется, новые запросы
+			// к нему должны приводить к новому обращению.
+			registry.remove(info->url_);
+
 			// Теперь уже можно завершить обработку.
-			complete_request_processing(*info);
+			complete_request_and_waiters(*info);
 		}
 	}
 }
 
 // Реализация рабочей нити, на которой будут выполняться операции
 // curl_multi_perform.
-void curl_multi_work_thread(request_info_queue_t & queue) {
+void curl_multi_work_thread(
+		request_info_queue_t & queue,
+		stage_metrics_t & metrics) {
 	using namespace cpp_util_3;
 
 	// Инциализируем сам curl.
@@ -349,6 +504,14 @@ void curl_multi_work_thread(request_info_queue_t & queue) {
 	auto curlm = curl_multi_init();
 	auto curlm_destroyer = at_scope_exit([&]{ curl_multi_cleanup(curlm); });
 
+	// Объект для разделения кэша DNS между всеми curl_easy.
+	curl_share_t curl_share;
+
+	// Пул curl_easy для запросов этой нити.
+	auto pool = make_curl_easy_pool(curl_share.handle());
+	// Реестр выполняющихся на этой нити исходящих запросов.
+	request_registry_t registry;
+
 	// Сколько сейчас запросов находится в обработке.
 	int still_running{0};
 
@@ -363,7 +526,7 @@ void curl_multi_work_thread(request_info_queue_t & queue) {
 
 		if(numfds && 0 != notify_fd.revents) {
 			// Нужно забирать новые заявки.
-			auto status = try_extract_new_requests(queue, curlm);
+			auto status = try_extract_new_requests(queue, curlm, *pool, registry);
 			if(request_info_queue_t::status_t::closed == status)
 				// Работу нужно завершать.
 				// Запросы, которые остались необработанными оставляем как есть.
@@ -375,7 +538,7 @@ void curl_multi_work_thread(request_info_queue_t & queue) {
 		if(still_running || numfds) {
 			curl_multi_perform(curlm, &still_running);
 			// Пытаемся проверить, закончились ли какие-нибудь операции.
-			check_curl_op_completion(curlm);
+			check_curl_op_completion(curlm, *pool, registry, metrics);
 		}
 	}
 }
@@ -384,9 +547,19 @@ void curl_multi_work_thread(request_info_queue_t & queue) {
 restinio::request_handling_status_t handler(
 		const config_t & config,
 		request_info_queue_t & queue,
+		admission_controller_t & admission,
+		const stage_metrics_t & metrics,
 		restinio::request_handle_t req) {
 	if(restinio::http_method_get() == req->header().method()
 			&& "/data" == req->header().path()) {
+		const auto timestamps = stage_timestamps_t::accepted_now();
+
+		// Если исходящих запросов уже слишком много, то лучше сразу
+		// ответить отказом, чем заставлять клиента долго ждать.
+		auto ticket = admission.try_admit();
+		if(!ticket)
+			return reject_overloaded(req, config.retry_after_);
+
 		// Разберем дополнительные параметры запроса.
 		const auto qp = restinio::parse_query(req->header().query());
 
@@ -398,7 +571,11 @@ restinio::request_handling_status_t handler(
 				qp["year"], qp["month"], qp["day"]);
 
 		auto info = std::make_unique<request_info_t>(
-				std::move(url), std::move(req));
+				std::move(url), std::move(req), std::move(ticket),
+				request_deadline_t::after(config.deadline_),
+				config.spill_);
+		info->timestamps_ = timestamps;
+		info->timestamps_.mark_enqueued();
 
 		queue.push(std::move(info));
 
@@ -407,6 +584,24 @@ restinio::request_handling_status_t handler(
 		return restinio::request_accepted();
 	}
 
+	if(restinio::http_method_get() == req->header().method()
+			&& "/stats" == req->header().path())
+		// Текущие значения счетчиков принятых и отвергнутых запросов.
+		return reply_admission_stats(req,
+				admission.limit(),
+				admission.in_flight(),
+				admission.accepted(),
+				admission.shed());
+
+	if(restinio::http_method_get() == req->header().method()
+			&& "/metrics" == req->header().path()) {
+		// Время, которое запросы проводят на стадиях обработки,
+		// в формате Prometheus.
+		stage_metrics_t::snapshot_t snapshot;
+		metrics.add_to(snapshot);
+		return reply_prometheus_metrics(req, snapshot);
+	}
+
 	// Все остальные запросы нашим демонстрационным сервером отвергаются.
 	return restinio::request_rejected();
 }
@@ -429,18 +624,28 @@ int main(int argc, char ** argv) {
 		if(cfg.help_requested_)
 			return 1;
 
+		// Счетчик исходящих запросов. Должен пережить все объекты
+		// с информацией о запросах, т.к. они возвращают ему разрешения.
+		admission_controller_t admission{cfg.config_.max_in_flight_};
+
 		// Нам потребуется контейнер для передачи информации между
 		// рабочими нитями.
 		request_info_queue_t queue;
 
+		// Время, которое запросы проводят на стадиях обработки.
+		// Пишет в него только нить curl_multi.
+		stage_metrics_t metrics;
+
 		// Актуальный обработчик входящих HTTP-запросов.
-		auto actual_handler = [&cfg, &queue](auto req) {
-				return handler(cfg.config_, queue, std::move(req));
+		auto actual_handler = [&cfg, &queue, &admission, &metrics](auto req) {
+				return handler(cfg.config_, queue, admission, metrics, std::move(req));
 			};
 
 		// Запускаем отдельную рабочую нить, на которой будут выполняться
 		// запросы к удаленному серверу посредством curl_multi_perform.
-		std::thread curl_thread{[&queue]{ curl_multi_work_thread(queue); }};
+		std::thread curl_thread{[&queue, &metrics]{
+				curl_multi_work_thread(queue, metrics);
+			}};
 		// Защищаемся от выхода из скоупа без предварительного останова
 		// этой отдельной рабочей нити.
 		auto curl_thread_stopper = cpp_util_3::at_scope_exit([&] {
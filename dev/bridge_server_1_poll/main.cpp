@@ -0,0 +1,745 @@
+#include <iostream>
+#include <queue>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <restinio/all.hpp>
+
+#include <clara.hpp>
+
+#include <fmt/format.h>
+
+#include <cpp_util_3/at_scope_exit.hpp>
+
+#include <curl/curl.h>
+
+// curl_multi_poll появилась в libcurl 7.66.0, а curl_multi_wakeup --
+// в 7.68.0. Если libcurl более старая, то для пробуждения рабочей нити
+// используется нотификационный пайп, как в bridge_server_1_pipe.
+#if LIBCURL_VERSION_NUM >= 0x074400
+	#define BRIDGE_SERVER_USE_CURL_MULTI_WAKEUP
+#endif
+
+#include <common/response_headers.hpp>
+#include <common/admission_control.hpp>
+#include <common/curl_easy_pool.hpp>
+#include <common/inflight_registry.hpp>
+#include <common/reply_buffer.hpp>
+#include <common/request_deadline.hpp>
+#include <common/stage_metrics.hpp>
+
+// Конфигурация, которая потребуется серверу.
+struct config_t {
+	// Адрес, на котором нужно слушать новые входящие запросы.
+	std::string address_{"localhost"};
+	// Порт, на котором нужно слушать.
+	std::uint16_t port_{8080};
+
+	// Адрес, на который нужно адресовать собственные запросы.
+	std::string target_address_{"localhost"};
+	// Порт, на который нужно адресовать собственные запросы.
+	std::uint16_t target_port_{8090};
+
+	// Максимальное количество исходящих запросов, которые находятся
+	// в обработке или ждут своей очереди. 0 означает отсутствие ограничения.
+	std::size_t max_in_flight_{0u};
+	// Значение заголовка Retry-After для отвергнутых запросов.
+	std::chrono::seconds retry_after_{1};
+
+	// Сколько времени отводится на обработку одного запроса.
+	// 0 означает отсутствие ограничения.
+	std::chrono::milliseconds deadline_{30000};
+
+	// Параметры сброса больших ответов во временный файл.
+	reply_spill_params_t spill_;
+
+	// Нужно ли включать трассировку?
+	bool tracing_{false};
+};
+
+// Разбор аргументов командной строки.
+// В случае неудачи порождается исключение.
+auto parse_cmd_line_args(int argc, char ** argv) {
+	struct result_t {
+		bool help_requested_{false};
+		config_t config_;
+	};
+	result_t result;
+	long retry_after{result.config_.retry_after_.count()};
+	long deadline{result.config_.deadline_.count()};
+
+	// Подготавливаем парсер аргументов командной строки.
+	using namespace clara;
+
+	auto cli = Opt(result.config_.address_, "address")["-a"]["--address"]
+				("address to listen (default: localhost)")
+		| Opt(result.config_.port_, "port")["-p"]["--port"]
+				(fmt::format("port to listen (default: {})", result.config_.port_))
+		| Opt(result.config_.target_address_, "target address")["-T"]["--target-address"]
+				(fmt::format("target address (default: {})", result.config_.target_address_))
+		| Opt(result.config_.target_port_, "target port")["-P"]["--target-port"]
+				(fmt::format("target port (default: {})", result.config_.target_port_))
+		| Opt(result.config_.max_in_flight_, "requests")["-L"]["--max-in-flight"]
+				("max number of outgoing requests in progress and in queue, "
+				"0 means no limit (default: 0)")
+		| Opt(retry_after, "seconds")["-R"]["--retry-after"]
+				(fmt::format("value of Retry-After for rejected requests (default: {})",
+						retry_after))
+		| Opt(deadline, "ms")["--deadline"]
+				(fmt::format("time for processing of a request in milliseconds, "
+						"0 means no limit (default: {})", deadline))
+		| Opt(result.config_.spill_.threshold_, "bytes")["--spill-threshold"]
+				(fmt::format("replies larger than this are kept in a temp file "
+						"and sent via sendfile, 0 means never (default: {})",
+						result.config_.spill_.threshold_))
+		| Opt(result.config_.spill_.directory_, "dir")["--spill-dir"]
+				(fmt::format("directory for temp files (default: {})",
+						result.config_.spill_.directory_))
+		| Opt(result.config_.tracing_)["-t"]["--tracing"]
+				("turn server tracing ON (default: OFF)")
+		| Help(result.help_requested_);
+
+	// Выполняем парсинг...
+	auto parse_result = cli.parse(Args(argc, argv));
+	// ...и бросаем исключение если столкнулись с ошибкой.
+	if(!parse_result)
+		throw std::runtime_error("Invalid command line: "
+				+ parse_result.errorMessage());
+
+	if(result.help_requested_)
+		std::cout << cli << std::endl;
+	else {
+		if(retry_after < 0)
+			throw std::runtime_error("invalid Retry-After value");
+		result.config_.retry_after_ = std::chrono::seconds{retry_after};
+		if(deadline < 0)
+			throw std::runtime_error("invalid deadline value");
+		result.config_.deadline_ = std::chrono::milliseconds{deadline};
+	}
+
+	return result;
+}
+
+//
+// ПРИМЕЧАНИЕ: ДЛЯ ПРОСТОТЫ И КОМПАКТНОСТИ РЕАЛИЗАЦИИ КОДЫ ВОЗВРАТА
+// ВЫЗЫВАЕМЫХ ИЗ libcurl ФУНКЦИЙ НЕ ПРОВЕРЯЮТСЯ.
+// ТАК ЖЕ НЕ ПРОВЕРЯЮТСЯ КОДЫ ВОЗВРАТА СИСТЕМНЫХ ФУНКЦИЙ ВРОДЕ
+// pipe, read, write И Т.Д.
+//
+
+// Вспомогательная штука, чтобы подавить предупреждения об игнорировании
+// возвращаемого значения.
+namespace {
+	struct just_ignore_t {
+		template<typename T> void operator=(T) {}
+	} _;
+}
+
+#if defined(BRIDGE_SERVER_USE_CURL_MULTI_WAKEUP)
+
+// Механизм пробуждения рабочей нити на базе curl_multi_poll и
+// curl_multi_wakeup. Нить спит внутри curl_multi_poll, а писатель будит
+// ее посредством curl_multi_wakeup, которую можно вызывать из любой нити.
+// Никаких дополнительных дескрипторов при этом не требуется.
+class notifier_t {
+	CURLM * curlm_;
+public:
+	explicit notifier_t(CURLM * curlm) : curlm_{curlm} {}
+
+	void notify() { curl_multi_wakeup(curlm_); }
+
+	// Ожидание событий ввода-вывода в curl_multi или пробуждения.
+	// Возвращает true, если в очереди могли появиться новые элементы.
+	//
+	// curl_multi_poll не сообщает о том, была ли она прервана вызовом
+	// curl_multi_wakeup, поэтому очередь нужно проверять после каждого
+	// ожидания. Но это не требует системных вызовов.
+	bool wait(int timeout_ms) {
+		curl_multi_poll(curlm_, nullptr, 0, timeout_ms, nullptr);
+		return true;
+	}
+};
+
+#else
+
+// Механизм пробуждения рабочей нити на базе нотификационного пайпа.
+// Используется, если в libcurl нет curl_multi_wakeup.
+class notifier_t {
+	CURLM * curlm_;
+	int pipefd_[2];
+
+	auto read_pipefd() const noexcept { return pipefd_[0]; }
+	auto write_pipefd() const noexcept { return pipefd_[1]; }
+
+public:
+	explicit notifier_t(CURLM * curlm) : curlm_{curlm} {
+		// Создаем нотификационный пайп.
+		_ = ::pipe(pipefd_);
+
+		// Переводим пайп в неблокирующий режим.
+		_ = ::fcntl(write_pipefd(), F_SETFL, O_NONBLOCK);
+		_ = ::fcntl(read_pipefd(), F_SETFL, O_NONBLOCK);
+	}
+	~notifier_t() {
+		// Нотификационный пайп должен быть закрыт вручную.
+		::close(pipefd_[0]);
+		::close(pipefd_[1]);
+	}
+
+	void notify() {
+		char dummy{0};
+		_ = ::write(write_pipefd(), &dummy, sizeof(dummy));
+	}
+
+	// Ожидание событий ввода-вывода в curl_multi или пробуждения.
+	// Возвращает true, если в очереди могли появиться новые элементы.
+	bool wait(int timeout_ms) {
+		curl_waitfd notify_fd;
+		notify_fd.fd = read_pipefd();
+		notify_fd.events = CURL_WAIT_POLLIN;
+		notify_fd.revents = 0;
+
+		curl_multi_wait(curlm_, &notify_fd, 1, timeout_ms, nullptr);
+		if(0 == notify_fd.revents)
+			return false;
+
+		// Вычитываем сразу все накопившиеся нотификации. Это нужно сделать
+		// до того, как будет проверено содержимое очереди, иначе можно
+		// потерять нотификацию о новом элементе.
+		char dummy[64];
+		_ = ::read(read_pipefd(), dummy, sizeof(dummy));
+		return true;
+	}
+};
+
+#endif
+
+// Простая реализация thread-safe контейнера для обмена информацией
+// между разными рабочими нитями.
+// Позволяет только поместить новый элемент в контейнер и попробовать взять
+// элемент из контейнера.
+//
+// Когда в пустой контейнер помещается новое значение, рабочая нить
+// curl_multi пробуждается посредством notifier_t. Поэтому ждущая сторона
+// вызывает метод wait() вместо прямого обращения к curl_multi_wait,
+// а после пробуждения -- метод pop() для извлечения содержимого контейнера.
+//
+template<typename T>
+class thread_safe_queue_t {
+	using unique_ptr_t = std::unique_ptr<T>;
+
+	std::mutex lock_;
+	std::queue<unique_ptr_t> content_;
+
+	bool closed_{false};
+
+	notifier_t notifier_;
+
+public:
+	enum class status_t {
+		extracted,
+		empty_queue,
+		closed
+	};
+
+	explicit thread_safe_queue_t(CURLM * curlm) : notifier_{curlm} {}
+
+	void push(unique_ptr_t what) {
+		bool was_empty{false};
+		{
+			std::lock_guard<std::mutex> l{lock_};
+			was_empty = content_.empty();
+			content_.emplace(std::move(what));
+		}
+
+		// Будить рабочую нить нужно только если она могла заснуть
+		// на пустом контейнере.
+		if(was_empty)
+			notifier_.notify();
+	}
+
+	// Ожидание событий ввода-вывода в curl_multi или появления новых
+	// элементов в контейнере.
+	// Возвращает true, если нужно вызвать pop().
+	bool wait(int timeout_ms) { return notifier_.wait(timeout_ms); }
+
+	// Метод pop получает лямбда-функцию, в которую будут поочередно
+	// переданы все элементы из контейнера, если контейнер не пуст.
+	// Содержимое контейнера забирается целиком при захваченном mutex-е,
+	// а передача элементов в лямбда-функцию осуществляется уже без него.
+	template<typename Acceptor>
+	status_t pop(Acceptor && acceptor) {
+		std::queue<unique_ptr_t> extracted;
+		{
+			std::lock_guard<std::mutex> l{lock_};
+			if(closed_)
+				return status_t::closed;
+			if(content_.empty())
+				return status_t::empty_queue;
+
+			extracted.swap(content_);
+		}
+
+		while(!extracted.empty()) {
+			acceptor(std::move(extracted.front()));
+			extracted.pop();
+		}
+		return status_t::extracted;
+	}
+
+	void close() {
+		{
+			std::lock_guard<std::mutex> l{lock_};
+			closed_ = true;
+		}
+
+		notifier_.notify();
+	}
+};
+
+// Сообщение, которое будет передаваться на рабочую нить с curl_multi_perform
+// для того, чтобы выполнить запрос к удаленному серверу.
+struct request_info_t {
+	// URL, на который нужно выполнить обращение.
+	const std::string url_;
+
+	// Запрос, в рамках которого нужно сделать обращение к удаленному серверу.
+	restinio::request_handle_t original_req_;
+
+	// Момент, до которого на запрос должен быть дан ответ.
+	const request_deadline_t deadline_;
+
+	// Код ошибки от самого curl-а.
+	CURLcode curl_code_{CURLE_OK};
+
+	// Код ответа удаленного сервера.
+	// Имеет актуальное значение только если сервер ответил.
+	long response_code_{0};
+
+	// Ответные данные, которые будут получены от удаленного сервера.
+	reply_buffer_t reply_data_;
+
+	// Разрешение на обработку запроса. Возвращается автоматически
+	// при уничтожении объекта.
+	admission_ticket_t ticket_;
+
+	// Запросы к тому же URL, которые присоединились к этому запросу
+	// и ждут его завершения.
+	std::vector<std::unique_ptr<request_info_t>> waiters_;
+
+	// Моменты прохождения запросом стадий обработки.
+	stage_timestamps_t timestamps_;
+
+	request_info_t(
+			std::string url,
+			restinio::request_handle_t req,
+			admission_ticket_t ticket,
+			request_deadline_t deadline,
+			const reply_spill_params_t & spill)
+		:	url_{std::move(url)}
+		,	original_req_{std::move(req)}
+		,	deadline_{deadline}
+		,	reply_data_{spill}
+		,	ticket_{std::move(ticket)}
+		{}
+};
+
+// Тип реестра выполняющихся исходящих запросов.
+using request_registry_t = inflight_registry_t<request_info_t>;
+
+// Тип контейнера для обмена информацией между рабочими нитями.
+using request_info_queue_t = thread_safe_queue_t<request_info_t>;
+
+// Эту функцию будет вызывать curl когда начнут приходить данные
+// от удаленного сервера. Указатель на нее будет задан через
+// CURLOPT_WRITEFUNCTION.
+std::size_t write_callback(
+		char *ptr,
+		size_t size,
+		size_t nmemb,
+		void *userdata) {
+	auto info = reinterpret_cast<request_info_t *>(userdata);
+	const auto total_size = size * nmemb;
+	// Если данные сохранить не удалось, то запрос прерывается.
+	if(!info->reply_data_.append(ptr, total_size))
+		return 0u;
+
+	return total_size;
+}
+
+// Эту функцию будет вызывать curl для каждой строки заголовка ответа
+// удаленного сервера. Если сервер сообщил размер ответа, то память
+// под ответ выделяется сразу и целиком.
+std::size_t header_callback(
+		char *ptr, size_t size, size_t nitems, void *userdata) {
+	auto info = reinterpret_cast<request_info_t *>(userdata);
+	const auto total_size = size * nitems;
+
+	std::size_t content_length;
+	if(parse_content_length(ptr, total_size, content_length))
+		info->reply_data_.expect(content_length);
+
+	return total_size;
+}
+
+// Создание пула curl_easy для рабочей нити. Общие для всех запросов
+// опции устанавливаются один раз при создании очередного curl_easy.
+auto make_curl_easy_pool(CURLSH * share) {
+	return std::make_unique<curl_easy_pool_t>(share, [](CURL * h) {
+			curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, write_callback);
+			curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, header_callback);
+		});
+}
+
+// Взять curl_easy для нового исходящего запроса из пула, заполнить все
+// нужные для него значения и передать этот curl_easy в curl_multi.
+void introduce_new_request_to_curl_multi(
+		CURLM * curlm,
+		curl_easy_pool_t & pool,
+		request_registry_t & registry,
+		std::unique_ptr<request_info_t> info) {
+	// Если запрос к этому URL уже выполняется, то новый запрос просто
+	// присоединяется к нему и обращения к удаленному серверу не требуется.
+	if(auto leader = registry.find_or_register(info->url_, info.get())) {
+		leader->waiters_.push_back(std::move(info));
+		return;
+	}
+
+	// Берем и подготавливаем curl_easy экземпляр для нового запроса.
+	CURL * h = pool.acquire();
+	curl_easy_setopt(h, CURLOPT_URL, info->url_.c_str());
+	curl_easy_setopt(h, CURLOPT_PRIVATE, info.get());
+	curl_easy_setopt(h, CURLOPT_WRITEDATA, info.get());
+	curl_easy_setopt(h, CURLOPT_HEADERDATA, info.get());
+	// Исходящий запрос может длиться не дольше, чем осталось
+	// времени на обработку входящего запроса.
+	info->deadline_.apply_to(h);
+
+	// Новый curl_easy подготовлен, можно отдать его в curl_multi.
+	info->timestamps_.mark_dispatched();
+	curl_multi_add_handle(curlm, h);
+
+	// unique_ptr не должен больше нести ответственность за объект.
+	// Мы его сами удалим когда обработка запроса завершится.
+	info.release();
+}
+
+// Попытка извлечения всех запросов, которые ждут в очереди.
+// Если возвращается status_t::closed, значит работа должна быть
+// остановлена.
+auto try_extract_new_requests(
+		request_info_queue_t & queue,
+		CURLM * curlm,
+		curl_easy_pool_t & pool,
+		request_registry_t & registry) {
+	return queue.pop([curlm, &pool, &registry](auto info) {
+			// Если время на обработку запроса истекло, пока запрос ждал
+			// в очереди, то обращаться к удаленному серверу уже поздно.
+			if(info->deadline_.expired()) {
+				reply_gateway_timeout(info->original_req_);
+				return;
+			}
+
+			introduce_new_request_to_curl_multi(
+					curlm, pool, registry, std::move(info));
+		});
+}
+
+// Финальная стадия обработки запроса к удаленному серверу.
+// curl_multi свою часть работы сделал. Осталось создать http-response,
+// который будет отослан в ответ на входящий http-request.
+//
+// Результат исходящего запроса берется из info, а сам ответ формируется
+// для req. Это может быть как запрос, инициировавший обращение к удаленному
+// серверу, так и любой из присоединившихся к нему запросов.
+void complete_request_processing(
+		const request_info_t & info,
+		const restinio::request_handle_t & req) {
+	// Удаленный сервер не успел ответить за отведенное время.
+	if(CURLE_OPERATION_TIMEDOUT == info.curl_code_) {
+		reply_gateway_timeout(req);
+		return;
+	}
+
+	auto response = req->create_response();
+
+	append_common_headers(response);
+
+	if(CURLE_OK == info.curl_code_) {
+		if(200 == info.response_code_) {
+			// Ответ удаленного сервера не копируется, а передается
+			// в RESTinio в виде списка блоков.
+			response.set_body(
+				fmt::format("Request processed.\nPath: {}\nQuery: {}\n"
+						"Response:\n===\n",
+					req->header().path(),
+					req->header().query()));
+			info.reply_data_.append_to(response);
+			response.append_body(restinio::const_buffer("\n===\n", 5u));
+		}
+		else
+			response.set_body(
+				fmt::format("Request failed.\nPath: {}\nQuery: {}\n"
+						"Response code: {}\n",
+					req->header().path(),
+					req->header().query(),
+					info.response_code_));
+	}
+	else
+		response.set_body("Target service unavailable\n");
+
+	response.done();
+}
+
+// Формирование ответов на запрос, который обращался к удаленному серверу,
+// и на все присоединившиеся к нему запросы.
+void complete_request_and_waiters(const request_info_t & info) {
+	complete_request_processing(info, info.original_req_);
+	for(const auto & waiter : info.waiters_)
+		complete_request_processing(info, waiter->original_req_);
+}
+
+// Попытка обработать все сообщения, которые на данный момент существуют
+// в curl_multi.
+void check_curl_op_completion(
+		CURLM * curlm,
+		curl_easy_pool_t & pool,
+		request_registry_t & registry,
+		stage_metrics_t & metrics) {
+	CURLMsg * msg;
+	int messages_left{0};
+
+	// В цикле извлекаем все сообщения от curl_multi и обрабатываем
+	// только сообщения CURLMSG_DONE.
+	while(nullptr != (msg = curl_multi_info_read(curlm, &messages_left))) {
+		if(CURLMSG_DONE == msg->msg) {
+			// Нашли операцию, которая реально завершилась.
+			// Сразу же обеспечиваем возврат ее curl_easy в пул.
+			CURL * easy_handle = msg->easy_handle;
+			auto easy_handle_releaser = cpp_util_3::at_scope_exit(
+					[&pool, easy_handle]{ pool.release(easy_handle); });
+
+			// Эта операция в curl_multi больше участвовать не должна.
+			curl_multi_remove_handle(curlm, easy_handle);
+
+			// Разбираемся с оригинальным запросом, с которым эта операция
+			// была связана.
+			request_info_t * info_raw_ptr{nullptr};
+			curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &info_raw_ptr);
+			// Сразу оборачиваем в unique_ptr, чтобы удалить объект.
+			std::unique_ptr<request_info_t> info{info_raw_ptr};
+
+			info->curl_code_ = msg->data.result;
+			if(CURLE_OK == info->curl_code_) {
+				// Нужно достать код, с которым нам ответил сервер.
+				curl_easy_getinfo(
+						easy_handle,
+						CURLINFO_RESPONSE_CODE,
+						&info->response_code_);
+			}
+
+			info->timestamps_.mark_completed(easy_handle);
+			metrics.record(info->timestamps_);
+
+			// Запрос к этому URL больше не выполняется, новые запросы
+			// к нему должны приводить к новому обращению.
+			registry.remove(info->url_);
+
+			// Теперь уже можно завершить обработку.
+			complete_request_and_waiters(*info);
+		}
+	}
+}
+
+// Реализация рабочей нити, на которой будут выполняться операции
+// curl_multi_perform.
+//
+// Экземпляр curl_multi создается заранее, т.к. он нужен и для пробуждения
+// этой нити при появлении новых заявок.
+void curl_multi_work_thread(
+		CURLM * curlm,
+		CURLSH * share,
+		request_info_queue_t & queue,
+		stage_metrics_t & metrics) {
+	// Пул curl_easy для запросов этой нити.
+	auto pool = make_curl_easy_pool(share);
+	// Реестр выполняющихся на этой нити исходящих запросов.
+	request_registry_t registry;
+
+	// Сколько сейчас запросов находится в обработке.
+	int still_running{0};
+
+	while(true) {
+		// Таймаут здесь лишь страховка, т.к. curl сам сокращает время
+		// ожидания, если этого требуют активные операции.
+		if(queue.wait(5000)) {
+			// Нужно забирать новые заявки.
+			auto status = try_extract_new_requests(queue, curlm, *pool, registry);
+			if(request_info_queue_t::status_t::closed == status)
+				// Работу нужно завершать.
+				// Запросы, которые остались необработанными оставляем как есть.
+				return;
+		}
+
+		curl_multi_perform(curlm, &still_running);
+		// Пытаемся проверить, закончились ли какие-нибудь операции.
+		check_curl_op_completion(curlm, *pool, registry, metrics);
+	}
+}
+
+// Реализация обработчика запросов.
+restinio::request_handling_status_t handler(
+		const config_t & config,
+		request_info_queue_t & queue,
+		admission_controller_t & admission,
+		const stage_metrics_t & metrics,
+		restinio::request_handle_t req) {
+	if(restinio::http_method_get() == req->header().method()
+			&& "/data" == req->header().path()) {
+		const auto timestamps = stage_timestamps_t::accepted_now();
+
+		// Если исходящих запросов уже слишком много, то лучше сразу
+		// ответить отказом, чем заставлять клиента долго ждать.
+		auto ticket = admission.try_admit();
+		if(!ticket)
+			return reject_overloaded(req, config.retry_after_);
+
+		// Разберем дополнительные параметры запроса.
+		const auto qp = restinio::parse_query(req->header().query());
+
+		// Нужно оформить объект с информацией о запросе и передать
+		// его на обработку в нить curl_multi.
+		auto url = fmt::format("http://{}:{}/{}/{}/{}",
+				config.target_address_,
+				config.target_port_,
+				qp["year"], qp["month"], qp["day"]);
+
+		auto info = std::make_unique<request_info_t>(
+				std::move(url), std::move(req), std::move(ticket),
+				request_deadline_t::after(config.deadline_),
+				config.spill_);
+		info->timestamps_ = timestamps;
+		info->timestamps_.mark_enqueued();
+
+		queue.push(std::move(info));
+
+		// Подтверждаем, что мы приняли запрос к обработке и что когда-то
+		// мы ответ сгенерируем.
+		return restinio::request_accepted();
+	}
+
+	if(restinio::http_method_get() == req->header().method()
+			&& "/stats" == req->header().path())
+		// Текущие значения счетчиков принятых и отвергнутых запросов.
+		return reply_admission_stats(req,
+				admission.limit(),
+				admission.in_flight(),
+				admission.accepted(),
+				admission.shed());
+
+	if(restinio::http_method_get() == req->header().method()
+			&& "/metrics" == req->header().path()) {
+		// Время, которое запросы проводят на стадиях обработки,
+		// в формате Prometheus.
+		stage_metrics_t::snapshot_t snapshot;
+		metrics.add_to(snapshot);
+		return reply_prometheus_metrics(req, snapshot);
+	}
+
+	// Все остальные запросы нашим демонстрационным сервером отвергаются.
+	return restinio::request_rejected();
+}
+
+// Вспомогательная функция, которая отвечает за запуск сервера нужного типа.
+template<typename Server_Traits, typename Handler>
+void run_server(
+		const config_t & config,
+		Handler && handler) {
+	restinio::run(
+			restinio::on_this_thread<Server_Traits>()
+				.address(config.address_)
+				.port(config.port_)
+				.request_handler(std::forward<Handler>(handler)));
+}
+
+int main(int argc, char ** argv) {
+	try {
+		const auto cfg = parse_cmd_line_args(argc, argv);
+		if(cfg.help_requested_)
+			return 1;
+
+		// Инциализируем сам curl.
+		curl_global_init(CURL_GLOBAL_ALL);
+		auto curl_global_deinitializer =
+				cpp_util_3::at_scope_exit([]{ curl_global_cleanup(); });
+
+		// Объект для разделения кэша DNS между всеми curl_easy.
+		curl_share_t curl_share;
+
+		// Создаем экземпляр curl_multi, который нам потребуется для выполнения
+		// запросов к удаленному серверу.
+		auto curlm = curl_multi_init();
+		auto curlm_destroyer =
+				cpp_util_3::at_scope_exit([&]{ curl_multi_cleanup(curlm); });
+
+		// Счетчик исходящих запросов. Должен пережить все объекты
+		// с информацией о запросах, т.к. они возвращают ему разрешения.
+		admission_controller_t admission{cfg.config_.max_in_flight_};
+
+		// Нам потребуется контейнер для передачи информации между
+		// рабочими нитями.
+		request_info_queue_t queue{curlm};
+
+		// Время, которое запросы проводят на стадиях обработки.
+		// Пишет в него только нить curl_multi.
+		stage_metrics_t metrics;
+
+		// Актуальный обработчик входящих HTTP-запросов.
+		auto actual_handler = [&cfg, &queue, &admission, &metrics](auto req) {
+				return handler(cfg.config_, queue, admission, metrics, std::move(req));
+			};
+
+		// Запускаем отдельную рабочую нить, на которой будут выполняться
+		// запросы к удаленному серверу посредством curl_multi_perform.
+		std::thread curl_thread{[curlm, &curl_share, &queue, &metrics]{
+				curl_multi_work_thread(curlm, curl_share.handle(), queue, metrics);
+			}};
+		// Защищаемся от выхода из скоупа без предварительного останова
+		// этой отдельной рабочей нити.
+		auto curl_thread_stopper = cpp_util_3::at_scope_exit([&] {
+				queue.close();
+				curl_thread.join();
+			});
+
+		// Теперь можно запустить основной HTTP-сервер.
+
+		// Если должна использоваться трассировка запросов, то должен
+		// запускаться один тип сервера.
+		if(cfg.config_.tracing_) {
+			// Для того, чтобы сервер трассировал запросы, нужно определить
+			// свой класс свойств для сервера.
+			struct traceable_server_traits_t : public restinio::default_single_thread_traits_t {
+				// Определяем нужный нам тип логгера.
+				using logger_t = restinio::single_threaded_ostream_logger_t;
+			};
+			// Теперь используем этот новый класс свойств для запуска сервера.
+			run_server<traceable_server_traits_t>(
+					cfg.config_, std::move(actual_handler));
+		}
+		else {
+			// Трассировка не нужна, поэтому запускаем обычный штатный сервер.
+			run_server<restinio::default_single_thread_traits_t>(
+					cfg.config_, std::move(actual_handler));
+		}
+
+		// Все, теперь ждем завершения работы сервера.
+	}
+	catch( const std::exception & ex ) {
+		std::cerr << "Error: " << ex.what() << std::endl;
+		return 2;
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// Снимок кэша ответов в файле.
+//
+// Содержимое кэша периодически сохраняется в файл, а после перезапуска
+// этот файл отображается в память посредством mmap. При старте читаются
+// только заголовки записей, сами ответы остаются в отображенном файле и
+// копируются в кэш лишь при первом обращении к ним. Поэтому после
+// перезапуска ответы из кэша начинают выдаваться практически сразу.
+//
+// Формат файла:
+//
+//   file_header_t
+//   record_header_t, URL, ответ, выравнивание до 8 байт
+//   record_header_t, URL, ответ, выравнивание до 8 байт
+//   ...
+//
+// Новые записи могут просто дописываться в конец файла. Если URL
+// встречается несколько раз, то используется последняя запись. Чтение
+// останавливается на первой некорректной записи, поэтому недописанный
+// хвост файла не мешает использовать все предшествующие записи.
+//
+// Моменты устаревания ответов хранятся как астрономическое время
+// (миллисекунды от начала эпохи), т.к. steady_clock после перезапуска
+// процесса не имеет смысла.
+//
+
+namespace cache_snapshot_details {
+
+constexpr char file_magic[8] = {'B', 'S', '2', 'C', 'A', 'C', 'H', 'E'};
+// Версия 2: ключом записи стал путь запроса, а не полный URL, т.к.
+// один и тот же путь может запрашиваться у разных экземпляров удаленного
+// сервера. Снимки версии 1 не используются.
+constexpr std::uint32_t file_version = 2u;
+constexpr std::uint32_t record_magic = 0x52434242u; // "BBCR"
+
+struct file_header_t {
+	char magic_[8];
+	std::uint32_t version_;
+	std::uint32_t reserved_;
+};
+
+struct record_header_t {
+	std::uint32_t magic_;
+	std::uint32_t url_size_;
+	std::uint64_t reply_size_;
+	// До какого момента ответ свежий.
+	std::int64_t fresh_until_ms_;
+	// До какого момента ответ еще может использоваться как устаревший.
+	std::int64_t stale_until_ms_;
+};
+
+constexpr std::size_t alignment = 8u;
+
+inline std::size_t aligned(std::size_t size) {
+	return (size + alignment - 1u) & ~(alignment - 1u);
+}
+
+inline std::int64_t to_ms(std::chrono::system_clock::time_point tp) {
+	using namespace std::chrono;
+	return duration_cast<milliseconds>(tp.time_since_epoch()).count();
+}
+
+inline std::chrono::system_clock::time_point from_ms(std::int64_t ms) {
+	return std::chrono::system_clock::time_point{std::chrono::milliseconds{ms}};
+}
+
+} /* namespace cache_snapshot_details */
+
+// Снимок кэша, отображенный в память.
+class cache_snapshot_t {
+public:
+	using time_point = std::chrono::system_clock::time_point;
+
+	// Запись о сохраненном ответе. Данные ответа находятся
+	// в отображенном файле.
+	struct record_t {
+		const char * reply_;
+		std::size_t reply_size_;
+		time_point fresh_until_;
+		time_point stale_until_;
+	};
+
+	~cache_snapshot_t() {
+		if(data_)
+			::munmap(const_cast<char *>(data_), size_);
+	}
+
+	// Это не Copyable и не Moveable класс.
+	cache_snapshot_t(const cache_snapshot_t &) = delete;
+	cache_snapshot_t(cache_snapshot_t &&) = delete;
+
+	// Отображение файла со снимком в память.
+	// Если файла нет или он имеет неподходящий формат, то возвращается
+	// пустой указатель.
+	static std::unique_ptr<cache_snapshot_t> open(const std::string & file_name) {
+		using namespace cache_snapshot_details;
+
+		const int fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+		if(-1 == fd)
+			return {};
+
+		struct stat st;
+		const bool suitable = 0 == ::fstat(fd, &st) &&
+				static_cast<std::size_t>(st.st_size) >= sizeof(file_header_t);
+
+		void * data = suitable ?
+				::mmap(nullptr, static_cast<std::size_t>(st.st_size),
+						PROT_READ, MAP_PRIVATE, fd, 0) :
+				MAP_FAILED;
+		// Отображение остается действительным и после закрытия файла.
+		::close(fd);
+		if(MAP_FAILED == data)
+			return {};
+
+		std::unique_ptr<cache_snapshot_t> result{new cache_snapshot_t{
+				static_cast<const char *>(data),
+				static_cast<std::size_t>(st.st_size)}};
+		if(!result->build_index())
+			return {};
+
+		return result;
+	}
+
+	// Поиск записи для URL.
+	const record_t * find(const std::string & url) const {
+		const auto it = index_.find(url);
+		return it != index_.end() ? &(it->second) : nullptr;
+	}
+
+	std::size_t size() const noexcept { return index_.size(); }
+
+private:
+	const char * data_;
+	const std::size_t size_;
+
+	// Индекс строится при открытии снимка и дальше только читается,
+	// поэтому обращаться к нему можно из любых нитей без синхронизации.
+	std::unordered_map<std::string, record_t> index_;
+
+	cache_snapshot_t(const char * data, std::size_t size)
+		:	data_{data}, size_{size}
+		{}
+
+	bool build_index() {
+		using namespace cache_snapshot_details;
+
+		file_header_t file_header;
+		std::memcpy(&file_header, data_, sizeof(file_header));
+		if(0 != std::memcmp(file_header.magic_, file_magic, sizeof(file_magic)) ||
+				file_version != file_header.version_)
+			return false;
+
+		std::size_t offset = sizeof(file_header_t);
+		while(size_ - offset >= sizeof(record_header_t)) {
+			record_header_t header;
+			std::memcpy(&header, data_ + offset, sizeof(header));
+			if(record_magic != header.magic_)
+				break;
+
+			const auto payload_offset = offset + sizeof(record_header_t);
+			const auto available = size_ - payload_offset;
+			if(header.url_size_ > available ||
+					header.reply_size_ > available - header.url_size_)
+				break;
+
+			const char * url = data_ + payload_offset;
+			index_[std::string(url, header.url_size_)] = record_t{
+					url + header.url_size_,
+					static_cast<std::size_t>(header.reply_size_),
+					from_ms(header.fresh_until_ms_),
+					from_ms(header.stale_until_ms_)};
+
+			offset = payload_offset + aligned(
+					header.url_size_ + static_cast<std::size_t>(header.reply_size_));
+			if(offset > size_)
+				break;
+		}
+
+		return true;
+	}
+};
+
+// Запись снимка кэша в файл.
+//
+// Сначала снимок пишется во временный файл, который затем переименовывается.
+// Поэтому процесс, который в это время отображает в память предыдущий
+// снимок, продолжает работать со старым содержимым.
+//
+// Функтор for_each должен вызвать переданный ему обработчик для каждого
+// сохраняемого ответа:
+//
+//   handler(url, reply, fresh_until, stale_until)
+//
+template<typename For_Each>
+void write_cache_snapshot(const std::string & file_name, For_Each && for_each) {
+	using namespace cache_snapshot_details;
+
+	const auto tmp_file_name = file_name + ".tmp";
+	{
+		std::ofstream file{tmp_file_name, std::ios::binary | std::ios::trunc};
+		if(!file)
+			throw std::runtime_error("unable to create file: " + tmp_file_name);
+
+		file_header_t file_header{};
+		std::memcpy(file_header.magic_, file_magic, sizeof(file_magic));
+		file_header.version_ = file_version;
+		file.write(reinterpret_cast<const char *>(&file_header), sizeof(file_header));
+
+		static const char padding[alignment] = {};
+		for_each([&file](
+				const std::string & url,
+				const std::string & reply,
+				std::chrono::system_clock::time_point fresh_until,
+				std::chrono::system_clock::time_point stale_until) {
+			record_header_t header{
+					record_magic,
+					static_cast<std::uint32_t>(url.size()),
+					reply.size(),
+					to_ms(fresh_until),
+					to_ms(stale_until)};
+			file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			file.write(url.data(), static_cast<std::streamsize>(url.size()));
+			file.write(reply.data(), static_cast<std::streamsize>(reply.size()));
+
+			const auto payload_size = url.size() + reply.size();
+			file.write(padding, static_cast<std::streamsize>(
+					aligned(payload_size) - payload_size));
+		});
+
+		if(!file.flush())
+			throw std::runtime_error("unable to write file: " + tmp_file_name);
+	}
+
+	if(0 != std::rename(tmp_file_name.c_str(), file_name.c_str()))
+		throw std::runtime_error("unable to rename file: " + tmp_file_name);
+}
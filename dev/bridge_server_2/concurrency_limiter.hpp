@@ -0,0 +1,216 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+//
+// Адаптивное ограничение количества одновременно выполняющихся
+// исходящих запросов.
+//
+// Лимит подбирается по алгоритму в духе TCP Vegas. Минимальное
+// наблюдаемое время ответа считается временем ответа ненагруженного
+// удаленного сервера. Если текущее время ответа больше него, то разница
+// объясняется очередью запросов на стороне удаленного сервера, размер
+// которой оценивается как
+//
+//   queue = limit * (1 - rtt_noload / rtt)
+//
+// Пока оценка очереди мала, лимит увеличивается, а когда она становится
+// слишком большой -- уменьшается. Поэтому время ответа удерживается около
+// времени ответа ненагруженного сервера и без ручного подбора лимита.
+//
+// Чтобы rtt_noload мог вырасти, если удаленный сервер стал медленнее
+// (например, изменились данные), минимум ищется по двум последним
+// окнам замеров, а не за все время работы. Но при постоянной нагрузке
+// в окне может не оказаться ни одного замера без очереди, и тогда
+// rtt_noload вместе с лимитом будут расти бесконечно. Поэтому в начале
+// каждого окна лимит ненадолго уменьшается вдвое, чтобы очередь на
+// стороне удаленного сервера рассосалась (аналогично ProbeRTT из BBR).
+//
+// И в оценке очереди, и при поиске минимума вместо отдельных замеров
+// используется сглаженное время ответа (экспоненциальное скользящее
+// среднее). Иначе при сильном разбросе времени ответа, не связанном
+// с очередью (например, у delay_server равномерно от 4 до 6 секунд),
+// минимум отдельных замеров оказывается на нижней границе разброса,
+// а среднее -- посередине, и разница воспринимается как очередь.
+// Лимит при этом сползает до alpha/(1 - 4/5) .. beta/(1 - 4/5), т.е.
+// примерно до 25, даже если удаленный сервер не нагружен. Минимум
+// сглаженного значения отстоит от среднего гораздо меньше, чем минимум
+// отдельных замеров, поэтому при разбросе лимит занижается значительно
+// слабее, но не исчезает совсем: чем больше разброс относительно
+// среднего времени ответа, тем ниже установившийся лимит. Так, при
+// равномерном разбросе от 4 до 6 и ненагруженном удаленном сервере лимит
+// устанавливается около 85 вместо 23, а если сервер может одновременно
+// обрабатывать только 40 запросов -- около 40 вместо 23. Платой за
+// сглаживание является то, что на рост очереди лимит реагирует
+// с задержкой примерно в rtt_smoothing замеров.
+//
+
+// Параметры ограничения.
+struct concurrency_limit_params_t {
+	// Используется ли адаптивное ограничение.
+	bool enabled_{false};
+	// Начальное значение лимита.
+	std::size_t initial_limit_{20u};
+	// Максимальное значение лимита.
+	std::size_t max_limit_{1000u};
+	// Сколько запрос может ждать в очереди, если лимит исчерпан.
+	std::chrono::milliseconds queue_timeout_{50};
+};
+
+namespace concurrency_limiter_details {
+
+// Если оценка очереди меньше этого значения, то лимит увеличивается.
+constexpr double alpha = 3.0;
+// Если оценка очереди больше этого значения, то лимит уменьшается.
+constexpr double beta = 6.0;
+// Во сколько раз уменьшается лимит, если удаленный сервер не успел
+// ответить или ответил, что перегружен.
+constexpr double backoff_ratio = 0.9;
+// Размер окна, по которому ищется минимальное время ответа.
+constexpr std::size_t rtt_window = 500u;
+// Сколько замеров в начале окна лимит остается уменьшенным.
+constexpr std::size_t probe_samples = 50u;
+// Вес очередного замера в сглаженном времени ответа равен 1/rtt_smoothing.
+constexpr double rtt_smoothing = 32.0;
+
+} /* namespace concurrency_limiter_details */
+
+// Адаптивный лимит одной рабочей нити.
+//
+// Объект не является thread-safe, за исключением счетчиков статистики,
+// которые можно читать из любой нити.
+class concurrency_limiter_t {
+public:
+	using duration_t = std::chrono::microseconds;
+
+	struct stats_t {
+		std::size_t limit_;
+		// Время ответа ненагруженного сервера, мкс.
+		std::uint64_t rtt_noload_us_;
+		// Сколько запросов было отвергнуто из-за того, что лимит
+		// не освободился за отведенное время.
+		std::uint64_t shed_;
+	};
+
+	explicit concurrency_limiter_t(const concurrency_limit_params_t & params)
+		:	enabled_{params.enabled_}
+		,	max_limit_{static_cast<double>(std::max<std::size_t>(1u, params.max_limit_))}
+		,	limit_{std::min(max_limit_,
+				static_cast<double>(std::max<std::size_t>(1u, params.initial_limit_)))}
+		{
+			publish();
+		}
+
+	bool enabled() const noexcept { return enabled_; }
+
+	// Сколько исходящих запросов может выполняться одновременно.
+	std::size_t limit() const noexcept {
+		if(!enabled_)
+			return std::numeric_limits<std::size_t>::max();
+		return probing() ?
+				std::max<std::size_t>(1u, static_cast<std::size_t>(limit_ / 2.0)) :
+				static_cast<std::size_t>(limit_);
+	}
+
+	// Учет времени ответа на очередной успешный запрос. in_flight --
+	// сколько запросов выполнялось вместе с ним.
+	void on_sample(duration_t rtt, std::size_t in_flight) noexcept {
+		using namespace concurrency_limiter_details;
+
+		if(!enabled_ || rtt.count() <= 0)
+			return;
+
+		const double sample = static_cast<double>(rtt.count());
+		smoothed_rtt_ = smoothed_rtt_ > 0.0 ?
+				smoothed_rtt_ + (sample - smoothed_rtt_) / rtt_smoothing :
+				sample;
+		const duration_t smoothed{static_cast<duration_t::rep>(smoothed_rtt_)};
+
+		if(!current_min_.count() || smoothed < current_min_)
+			current_min_ = smoothed;
+		if(++window_samples_ >= rtt_window) {
+			previous_min_ = current_min_;
+			current_min_ = duration_t::zero();
+			window_samples_ = 0u;
+		}
+
+		const auto noload = rtt_noload();
+		// Если лимит далеко не исчерпан или специально уменьшен, то время
+		// ответа ничего не говорит о том, каким он должен быть.
+		if(!noload.count() || probing() ||
+				2u * in_flight < static_cast<std::size_t>(limit_))
+			return;
+
+		const double queue = limit_ *
+				(1.0 - static_cast<double>(noload.count()) / smoothed_rtt_);
+		if(queue < alpha)
+			limit_ = std::min(max_limit_, limit_ + 1.0);
+		else if(queue > beta)
+			limit_ = std::max(1.0, limit_ - 1.0);
+		publish();
+	}
+
+	// Удаленный сервер не успел ответить или сообщил о перегрузке.
+	void on_drop() noexcept {
+		if(!enabled_)
+			return;
+		limit_ = std::max(1.0, limit_ * concurrency_limiter_details::backoff_ratio);
+		publish();
+	}
+
+	// Запрос отвергнут, т.к. лимит не освободился вовремя.
+	void on_shed() noexcept {
+		shed_.fetch_add(1u, std::memory_order_relaxed);
+	}
+
+	stats_t stats() const noexcept {
+		return {
+			published_limit_.load(std::memory_order_relaxed),
+			published_rtt_noload_.load(std::memory_order_relaxed),
+			shed_.load(std::memory_order_relaxed)
+		};
+	}
+
+private:
+	const bool enabled_;
+	const double max_limit_;
+	double limit_;
+
+	// Сглаженное время ответа, мкс. 0 означает, что замеров еще не было.
+	double smoothed_rtt_{0.0};
+
+	// Минимальное сглаженное время ответа в текущем и в предыдущем окнах
+	// замеров. Нулевое значение означает, что замеров еще не было.
+	duration_t current_min_{duration_t::zero()};
+	duration_t previous_min_{duration_t::zero()};
+	std::size_t window_samples_{0u};
+
+	// Значения для статистики.
+	std::atomic<std::size_t> published_limit_{0u};
+	std::atomic<std::uint64_t> published_rtt_noload_{0u};
+	std::atomic<std::uint64_t> shed_{0u};
+
+	bool probing() const noexcept {
+		return window_samples_ < concurrency_limiter_details::probe_samples;
+	}
+
+	duration_t rtt_noload() const noexcept {
+		if(!previous_min_.count())
+			return current_min_;
+		if(!current_min_.count())
+			return previous_min_;
+		return std::min(current_min_, previous_min_);
+	}
+
+	void publish() noexcept {
+		published_limit_.store(static_cast<std::size_t>(limit_),
+				std::memory_order_relaxed);
+		published_rtt_noload_.store(
+				static_cast<std::uint64_t>(rtt_noload().count()),
+				std::memory_order_relaxed);
+	}
+};
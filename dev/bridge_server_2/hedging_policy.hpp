@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+//
+// Политика отправки дублирующих запросов (hedged requests).
+//
+// Если ответ на исходящий запрос не получен за время, которое
+// соответствует заданному перцентилю недавно наблюдавшихся задержек,
+// то к удаленному серверу отправляется второй такой же запрос.
+// Используется тот ответ, который придет первым.
+//
+// Чтобы дублирующие запросы не удваивали нагрузку на удаленный сервер при
+// его общей деградации, их количество ограничено бюджетом: каждый основной
+// запрос добавляет в бюджет budget_percent/100 разрешения, а каждый
+// дублирующий запрос забирает одно целое разрешение.
+//
+
+namespace hedging_details {
+
+// По скольким последним запросам вычисляется перцентиль.
+constexpr std::size_t window_size = 1024u;
+// Минимальное количество замеров, по которым можно вычислять перцентиль.
+constexpr std::size_t min_samples = 64u;
+// Как часто перцентиль пересчитывается.
+constexpr std::size_t recalc_every = 64u;
+// Больше этого бюджет не накапливается, чтобы после затишья
+// не последовал сразу большой всплеск дублирующих запросов.
+constexpr double max_tokens = 10.0;
+
+} /* namespace hedging_details */
+
+// Параметры политики.
+struct hedging_params_t {
+	// Перцентиль задержек, по истечении которого отправляется дублирующий
+	// запрос. 0 означает, что дублирующие запросы не используются.
+	double percentile_{0.0};
+	// Сколько процентов от основных запросов могут составлять дублирующие.
+	double budget_percent_{5.0};
+};
+
+// Политика отправки дублирующих запросов для одной рабочей нити.
+//
+// Объект не является thread-safe, за исключением счетчиков статистики,
+// которые можно читать из любой нити.
+class hedging_policy_t {
+public:
+	using duration_t = std::chrono::microseconds;
+
+	struct stats_t {
+		// Сколько дублирующих запросов было отправлено.
+		std::uint64_t sent_;
+		// Сколько раз дублирующий запрос завершился раньше основного.
+		std::uint64_t won_;
+		// Сколько дублирующих запросов не было отправлено из-за
+		// исчерпания бюджета.
+		std::uint64_t denied_;
+	};
+
+	explicit hedging_policy_t(const hedging_params_t & params)
+		:	percentile_{std::min(params.percentile_, 100.0)}
+		,	budget_ratio_{std::max(params.budget_percent_, 0.0) / 100.0}
+		{
+			samples_.reserve(hedging_details::window_size);
+		}
+
+	bool enabled() const noexcept { return percentile_ > 0.0; }
+
+	// Учет задержки очередного успешно завершившегося запроса.
+	void record_latency(duration_t latency) {
+		if(!enabled())
+			return;
+
+		if(samples_.size() < hedging_details::window_size)
+			samples_.push_back(latency.count());
+		else
+			samples_[next_sample_] = latency.count();
+		next_sample_ = (next_sample_ + 1u) % hedging_details::window_size;
+
+		// Пересчитывать перцентиль после каждого запроса слишком дорого.
+		if(++since_recalc_ >= hedging_details::recalc_every &&
+				samples_.size() >= hedging_details::min_samples) {
+			since_recalc_ = 0u;
+			recalc_threshold();
+		}
+	}
+
+	// Через сколько после начала основного запроса нужно отправлять
+	// дублирующий запрос. Если данных о задержках пока недостаточно,
+	// то возвращается false.
+	bool hedge_delay(duration_t & delay) const noexcept {
+		if(!threshold_ready_)
+			return false;
+		delay = threshold_;
+		return true;
+	}
+
+	// Учет очередного основного запроса.
+	void on_primary_request() noexcept {
+		if(enabled())
+			tokens_ = std::min(hedging_details::max_tokens, tokens_ + budget_ratio_);
+	}
+
+	// Попытка получить разрешение на дублирующий запрос.
+	bool try_spend() noexcept {
+		if(tokens_ < 1.0) {
+			denied_.fetch_add(1u, std::memory_order_relaxed);
+			return false;
+		}
+		tokens_ -= 1.0;
+		sent_.fetch_add(1u, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Дублирующий запрос завершился раньше основного.
+	void on_hedge_won() noexcept {
+		won_.fetch_add(1u, std::memory_order_relaxed);
+	}
+
+	stats_t stats() const noexcept {
+		return {
+			sent_.load(std::memory_order_relaxed),
+			won_.load(std::memory_order_relaxed),
+			denied_.load(std::memory_order_relaxed)
+		};
+	}
+
+private:
+	const double percentile_;
+	const double budget_ratio_;
+
+	// Кольцевой буфер с последними замерами задержек.
+	std::vector<duration_t::rep> samples_;
+	std::size_t next_sample_{0u};
+	std::size_t since_recalc_{0u};
+	// Место для вычисления перцентиля, чтобы не выделять память каждый раз.
+	std::vector<duration_t::rep> scratch_;
+
+	duration_t threshold_{0};
+	bool threshold_ready_{false};
+
+	double tokens_{0.0};
+
+	std::atomic<std::uint64_t> sent_{0u};
+	std::atomic<std::uint64_t> won_{0u};
+	std::atomic<std::uint64_t> denied_{0u};
+
+	void recalc_threshold() {
+		scratch_.assign(samples_.begin(), samples_.end());
+		const auto index = std::min(scratch_.size() - 1u,
+				static_cast<std::size_t>(percentile_ / 100.0 * scratch_.size()));
+		std::nth_element(scratch_.begin(), scratch_.begin() + index, scratch_.end());
+		threshold_ = duration_t{scratch_[index]};
+		threshold_ready_ = true;
+	}
+};
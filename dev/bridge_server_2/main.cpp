@@ -1,5 +1,10 @@
+#include <deque>
 #include <iostream>
+#include <map>
 #include <queue>
+#include <vector>
+
+#include <csignal>
 
 #include <restinio/all.hpp>
 
@@ -11,6 +16,19 @@
 
 #include <curl/curl.h>
 
+#include <common/response_headers.hpp>
+#include <common/admission_control.hpp>
+#include <common/curl_easy_pool.hpp>
+#include <common/inflight_registry.hpp>
+#include <common/reply_buffer.hpp>
+#include <common/request_deadline.hpp>
+#include <common/stage_metrics.hpp>
+
+#include <bridge_server_2/response_cache.hpp>
+#include <bridge_server_2/hedging_policy.hpp>
+#include <bridge_server_2/target_balancer.hpp>
+#include <bridge_server_2/concurrency_limiter.hpp>
+
 // Конфигурация, которая потребуется серверу.
 struct config_t {
 	// Адрес, на котором нужно слушать новые входящие запросы.
@@ -23,6 +41,62 @@ struct config_t {
 	// Порт, на который нужно адресовать собственные запросы.
 	std::uint16_t target_port_{8090};
 
+	// Экземпляры удаленного сервера, между которыми распределяются
+	// собственные запросы. Если они не заданы явно, то используется
+	// единственный экземпляр с target_address_ и target_port_.
+	std::vector<target_t> targets_;
+	// Способ выбора экземпляра для очередного запроса.
+	balancing_policy_t balancing_{balancing_policy_t::least_outstanding};
+
+	// Количество рабочих нитей. У каждой нити собственный io_context,
+	// собственный curl_multi и собственный слушающий сокет.
+	std::size_t threads_{std::max(1u, std::thread::hardware_concurrency())};
+
+	// Максимальное количество исходящих запросов, которые находятся
+	// в обработке или ждут своей очереди. 0 означает отсутствие ограничения.
+	std::size_t max_in_flight_{0u};
+	// Значение заголовка Retry-After для отвергнутых запросов.
+	std::chrono::seconds retry_after_{1};
+
+	// Параметры адаптивного ограничения количества одновременно
+	// выполняющихся исходящих запросов.
+	concurrency_limit_params_t limit_;
+
+	// Сколько времени отводится на обработку одного запроса.
+	// 0 означает отсутствие ограничения.
+	std::chrono::milliseconds deadline_{30000};
+
+	// Сколько памяти может занимать кэш ответов, байт.
+	// 0 означает, что кэш не используется.
+	std::size_t cache_size_{0u};
+	// Время жизни ответа в кэше, если удаленный сервер не прислал
+	// ни Cache-Control, ни Expires.
+	std::chrono::seconds cache_ttl_{60};
+	// Сколько времени устаревший ответ может отдаваться из кэша,
+	// пока за новой версией идет фоновый запрос.
+	std::chrono::seconds cache_stale_{30};
+
+	// Файл, в котором сохраняется снимок кэша. Пустое имя означает,
+	// что снимок не используется.
+	std::string cache_snapshot_;
+	// Как часто сохраняется снимок кэша.
+	std::chrono::seconds cache_snapshot_interval_{60};
+
+	// Нужно ли передавать ответ удаленного сервера клиенту по мере
+	// его получения, а не после получения всего ответа целиком.
+	// В этом режиме кэш ответов и объединение запросов не используются.
+	bool streaming_{false};
+	// Сколько данных может быть передано клиенту, но еще не записано
+	// в сокет, прежде чем получение ответа будет приостановлено.
+	std::size_t stream_buffer_{256u * 1024u};
+
+	// Параметры отправки дублирующих запросов. В режиме streaming
+	// дублирующие запросы не используются.
+	hedging_params_t hedging_;
+
+	// Параметры сброса больших ответов во временный файл.
+	reply_spill_params_t spill_;
+
 	// Нужно ли включать трассировку?
 	bool tracing_{false};
 };
@@ -35,6 +109,14 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 		config_t config_;
 	};
 	result_t result;
+	long retry_after{result.config_.retry_after_.count()};
+	long deadline{result.config_.deadline_.count()};
+	long limit_queue_timeout{result.config_.limit_.queue_timeout_.count()};
+	long cache_ttl{result.config_.cache_ttl_.count()};
+	long cache_stale{result.config_.cache_stale_.count()};
+	long cache_snapshot_interval{result.config_.cache_snapshot_interval_.count()};
+	std::vector<std::string> targets;
+	std::string balancing{"least-outstanding"};
 
 	// Подготавливаем парсер аргументов командной строки.
 	using namespace clara;
@@ -47,6 +129,70 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 				(fmt::format("target address (default: {})", result.config_.target_address_))
 		| Opt(result.config_.target_port_, "target port")["-P"]["--target-port"]
 				(fmt::format("target port (default: {})", result.config_.target_port_))
+		| Opt(targets, "host:port")["--target"]
+				("target instance, can be repeated to balance requests "
+				"between several instances (overrides -T and -P)")
+		| Opt(balancing, "policy")["--balance"]
+				("how to choose target instance: least-outstanding, p2c "
+				"(default: least-outstanding)")
+		| Opt(result.config_.threads_, "threads")["-n"]["--threads"]
+				(fmt::format("number of worker threads (default: {})",
+						result.config_.threads_))
+		| Opt(result.config_.max_in_flight_, "requests")["-L"]["--max-in-flight"]
+				("max number of outgoing requests in progress and in queue, "
+				"0 means no limit (default: 0)")
+		| Opt(retry_after, "seconds")["-R"]["--retry-after"]
+				(fmt::format("value of Retry-After for rejected requests (default: {})",
+						retry_after))
+		| Opt(result.config_.limit_.enabled_)["--adaptive-limit"]
+				("adjust the number of concurrent outgoing requests by observed "
+				"latency (default: OFF)")
+		| Opt(result.config_.limit_.initial_limit_, "requests")["--limit-initial"]
+				(fmt::format("initial adaptive limit per thread (default: {})",
+						result.config_.limit_.initial_limit_))
+		| Opt(result.config_.limit_.max_limit_, "requests")["--limit-max"]
+				(fmt::format("max adaptive limit per thread (default: {})",
+						result.config_.limit_.max_limit_))
+		| Opt(limit_queue_timeout, "ms")["--limit-queue-timeout"]
+				(fmt::format("how long a request can wait for the adaptive limit "
+						"before it is rejected (default: {})", limit_queue_timeout))
+		| Opt(result.config_.cache_size_, "bytes")["--cache-size"]
+				(fmt::format("size of response cache, 0 disables cache (default: {})",
+						result.config_.cache_size_))
+		| Opt(cache_ttl, "seconds")["--cache-ttl"]
+				(fmt::format("time to live for responses without Cache-Control "
+						"and Expires (default: {})", cache_ttl))
+		| Opt(cache_stale, "seconds")["--cache-stale"]
+				(fmt::format("how long stale responses can be served while "
+						"revalidating (default: {})", cache_stale))
+		| Opt(result.config_.cache_snapshot_, "file")["--cache-snapshot"]
+				("file to save cache snapshot to and to load it from at startup")
+		| Opt(cache_snapshot_interval, "seconds")["--cache-snapshot-interval"]
+				(fmt::format("how often cache snapshot is saved (default: {})",
+						cache_snapshot_interval))
+		| Opt(result.config_.streaming_)["-S"]["--streaming"]
+				("stream responses to clients as they are received, "
+				"disables cache and request coalescing (default: OFF)")
+		| Opt(result.config_.stream_buffer_, "bytes")["--stream-buffer"]
+				(fmt::format("max amount of data queued for a client in "
+						"streaming mode (default: {})",
+						result.config_.stream_buffer_))
+		| Opt(result.config_.hedging_.percentile_, "percentile")["--hedge-percentile"]
+				("send a second request if there is no reply after this percentile "
+				"of recent latencies, 0 disables hedging (default: 0)")
+		| Opt(result.config_.hedging_.budget_percent_, "percent")["--hedge-budget"]
+				(fmt::format("max share of hedged requests in percent (default: {})",
+						result.config_.hedging_.budget_percent_))
+		| Opt(deadline, "ms")["--deadline"]
+				(fmt::format("time for processing of a request in milliseconds, "
+						"0 means no limit (default: {})", deadline))
+		| Opt(result.config_.spill_.threshold_, "bytes")["--spill-threshold"]
+				(fmt::format("replies larger than this are kept in a temp file "
+						"and sent via sendfile, 0 means never (default: {})",
+						result.config_.spill_.threshold_))
+		| Opt(result.config_.spill_.directory_, "dir")["--spill-dir"]
+				(fmt::format("directory for temp files (default: {})",
+						result.config_.spill_.directory_))
 		| Opt(result.config_.tracing_)["-t"]["--tracing"]
 				("turn server tracing ON (default: OFF)")
 		| Help(result.help_requested_);
@@ -60,19 +206,111 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 
 	if(result.help_requested_)
 		std::cout << cli << std::endl;
+	else {
+		if(0u == result.config_.threads_)
+			throw std::runtime_error("number of threads can't be 0");
+		for(const auto & t : targets)
+			result.config_.targets_.push_back(parse_target(t));
+		if(result.config_.targets_.empty())
+			result.config_.targets_.push_back(target_t{
+					result.config_.target_address_, result.config_.target_port_});
+		result.config_.balancing_ = parse_balancing_policy(balancing);
+		if(retry_after < 0)
+			throw std::runtime_error("invalid Retry-After value");
+		result.config_.retry_after_ = std::chrono::seconds{retry_after};
+		if(0u == result.config_.limit_.initial_limit_ ||
+				result.config_.limit_.max_limit_ < result.config_.limit_.initial_limit_)
+			throw std::runtime_error("invalid adaptive limit values");
+		if(limit_queue_timeout < 0)
+			throw std::runtime_error("invalid limit queue timeout");
+		result.config_.limit_.queue_timeout_ =
+				std::chrono::milliseconds{limit_queue_timeout};
+		if(deadline < 0)
+			throw std::runtime_error("invalid deadline value");
+		result.config_.deadline_ = std::chrono::milliseconds{deadline};
+		if(cache_ttl < 0 || cache_stale < 0)
+			throw std::runtime_error("invalid cache time to live");
+		result.config_.cache_ttl_ = std::chrono::seconds{cache_ttl};
+		result.config_.cache_stale_ = std::chrono::seconds{cache_stale};
+		if(cache_snapshot_interval <= 0)
+			throw std::runtime_error("invalid cache snapshot interval");
+		result.config_.cache_snapshot_interval_ =
+				std::chrono::seconds{cache_snapshot_interval};
+		if(0u == result.config_.stream_buffer_)
+			throw std::runtime_error("stream buffer size can't be 0");
+		if(result.config_.hedging_.percentile_ < 0.0 ||
+				result.config_.hedging_.percentile_ >= 100.0)
+			throw std::runtime_error("hedge percentile must be in [0, 100)");
+		if(result.config_.hedging_.budget_percent_ < 0.0)
+			throw std::runtime_error("invalid hedge budget");
+	}
 
 	return result;
 }
 
+// Состояние передачи ответа клиенту в режиме streaming.
+//
+// Данные от удаленного сервера отдаются клиенту фрагментами по мере их
+// получения. Если клиент не успевает их забирать, то получение ответа
+// приостанавливается до тех пор, пока объем еще не записанных в сокет
+// данных не уменьшится вдвое.
+//
+// Объект разделяется между request_info_t и коллбэками RESTinio,
+// т.к. последние могут быть вызваны уже после завершения запроса.
+struct stream_state_t {
+	using response_t = restinio::response_builder_t<restinio::chunked_output_t>;
+
+	// Asio-шный контекст, на котором идет работа с curl_multi.
+	restinio::asio_ns::io_context & ioctx_;
+	// curl_easy, через который выполняется запрос.
+	CURL * handle_;
+	// Сколько данных может ждать записи в сокет клиента.
+	const std::size_t buffer_size_;
+
+	// Ответ клиенту. Создается при получении первого фрагмента данных.
+	std::unique_ptr<response_t> response_;
+	// Сколько данных передано RESTinio, но еще не записано в сокет.
+	std::size_t pending_bytes_{0u};
+	// Приостановлено ли получение ответа.
+	bool paused_{false};
+	// Запрос завершился и handle_ больше не может использоваться.
+	bool finished_{false};
+	// Запись в сокет клиента завершилась ошибкой.
+	bool client_failed_{false};
+	// Срок обработки запроса истек раньше, чем клиенту начал
+	// передаваться ответ.
+	bool deadline_exceeded_{false};
+
+	stream_state_t(
+			restinio::asio_ns::io_context & ioctx,
+			CURL * handle,
+			std::size_t buffer_size)
+		:	ioctx_{ioctx}, handle_{handle}, buffer_size_{buffer_size}
+		{}
+};
+
+struct request_info_t;
+
+// Основные запросы, для которых еще может потребоваться дублирующий
+// запрос, упорядоченные по моменту его отправки.
+using hedge_queue_t = std::multimap<
+		std::chrono::steady_clock::time_point, request_info_t *>;
+
 // Сообщение, которое будет передаваться на рабочую нить с curl_multi_perform
 // для того, чтобы выполнить запрос к удаленному серверу.
 struct request_info_t {
-	// URL, на который нужно выполнить обращение.
-	const std::string url_;
+	// Путь к ресурсу на удаленном сервере. Ответ не зависит от того,
+	// к какому из экземпляров удаленного сервера обращаться, поэтому
+	// по пути объединяются запросы и ищутся ответы в кэше.
+	const std::string path_;
 
 	// Запрос, в рамках которого нужно сделать обращение к удаленному серверу.
+	// Пуст, если это фоновый запрос за новой версией ответа из кэша.
 	restinio::request_handle_t original_req_;
 
+	// Момент, до которого на запрос должен быть дан ответ.
+	const request_deadline_t deadline_;
+
 	// Код ошибки от самого curl-а.
 	CURLcode curl_code_{CURLE_OK};
 
@@ -81,13 +319,61 @@ struct request_info_t {
 	long response_code_{0};
 
 	// Ответные данные, которые будут получены от удаленного сервера.
-	std::string reply_data_;
-
-	request_info_t(std::string url, restinio::request_handle_t req)
-		:	url_{std::move(url)}, original_req_{std::move(req)}
+	reply_buffer_t reply_data_;
+
+	// Значения заголовков Cache-Control и Expires из ответа
+	// удаленного сервера.
+	std::string cache_control_;
+	std::string expires_;
+
+	// Разрешение на обработку запроса. Возвращается автоматически
+	// при уничтожении объекта.
+	admission_ticket_t ticket_;
+
+	// Запросы к тому же URL, которые присоединились к этому запросу
+	// и ждут его завершения.
+	std::vector<std::unique_ptr<request_info_t>> waiters_;
+
+	// Состояние передачи ответа клиенту. Есть только в режиме streaming.
+	std::shared_ptr<stream_state_t> stream_;
+
+	// curl_easy, через который выполняется исходящий запрос.
+	CURL * handle_{nullptr};
+	// Экземпляр удаленного сервера, к которому выполняется запрос.
+	std::size_t target_{0u};
+	// Когда исходящий запрос был передан в curl_multi.
+	std::chrono::steady_clock::time_point started_at_;
+
+	// Для основного запроса это его дублирующий запрос, а для
+	// дублирующего -- основной. Пуст, если второго запроса нет.
+	request_info_t * hedge_partner_{nullptr};
+	// Является ли этот запрос дублирующим.
+	bool is_hedge_{false};
+	// Стоит ли запрос в очереди на отправку дублирующего запроса.
+	// Если стоит, то hedge_it_ указывает на его место в очереди.
+	bool hedge_scheduled_{false};
+	hedge_queue_t::iterator hedge_it_;
+
+	// Моменты прохождения запросом стадий обработки.
+	stage_timestamps_t timestamps_;
+
+	request_info_t(
+			std::string path,
+			restinio::request_handle_t req,
+			admission_ticket_t ticket,
+			request_deadline_t deadline,
+			const reply_spill_params_t & spill)
+		:	path_{std::move(path)}
+		,	original_req_{std::move(req)}
+		,	deadline_{deadline}
+		,	reply_data_{spill}
+		,	ticket_{std::move(ticket)}
 		{}
 };
 
+// Тип реестра выполняющихся исходящих запросов.
+using request_registry_t = inflight_registry_t<request_info_t>;
+
 //
 // ПРИМЕЧАНИЕ: ДЛЯ ПРОСТОТЫ И КОМПАКТНОСТИ РЕАЛИЗАЦИИ КОДЫ ВОЗВРАТА
 // ВЫЗЫВАЕМЫХ ИЗ libcurl ФУНКЦИЙ НЕ ПРОВЕРЯЮТСЯ.
@@ -100,37 +386,178 @@ std::size_t write_callback(
 		char *ptr, size_t size, size_t nmemb, void *userdata) {
 	auto info = reinterpret_cast<request_info_t *>(userdata);
 	const auto total_size = size * nmemb;
-	info->reply_data_.append(ptr, total_size);
+	// Если данные сохранить не удалось, то запрос прерывается.
+	if(!info->reply_data_.append(ptr, total_size))
+		return 0u;
+
+	return total_size;
+}
+
+// Начальная часть тела ответа для случая, когда удаленный сервер
+// успешно ответил.
+std::string make_processed_body_prefix(const restinio::request_handle_t & req) {
+	return fmt::format("Request processed.\nPath: {}\nQuery: {}\n"
+			"Response:\n===\n",
+		req->header().path(),
+		req->header().query());
+}
+
+// Реакция на запись очередного фрагмента ответа в сокет клиента.
+void on_stream_chunk_written(
+		const std::shared_ptr<stream_state_t> & stream,
+		std::size_t chunk_size,
+		const restinio::asio_ns::error_code & ec) {
+	stream->pending_bytes_ -= chunk_size;
+	if(ec)
+		stream->client_failed_ = true;
+
+	// Если клиент забрал достаточно данных (или уже никогда их не заберет),
+	// то получение ответа нужно возобновить. Делается это через Asio, чтобы
+	// libcurl не вызывалась изнутри коллбэка RESTinio.
+	if(stream->paused_ &&
+			(stream->client_failed_ ||
+				stream->pending_bytes_ <= stream->buffer_size_ / 2u)) {
+		stream->paused_ = false;
+		restinio::asio_ns::post(stream->ioctx_, [stream] {
+				if(!stream->finished_)
+					curl_easy_pause(stream->handle_, CURLPAUSE_CONT);
+			});
+	}
+}
+
+// Эту функцию будет вызывать curl когда начнут приходить данные
+// от удаленного сервера в режиме streaming. Указатель на нее будет
+// задан через CURLOPT_WRITEFUNCTION.
+std::size_t stream_write_callback(
+		char *ptr, size_t size, size_t nmemb, void *userdata) {
+	auto info = reinterpret_cast<request_info_t *>(userdata);
+	auto & stream = info->stream_;
+	const auto total_size = size * nmemb;
+
+	// Если клиент уже не может получить ответ, то запрос прерывается.
+	if(stream->client_failed_)
+		return 0u;
+
+	// Тело неуспешного ответа клиенту не передается, ответ для этого
+	// случая будет сформирован после завершения запроса.
+	long response_code{0};
+	curl_easy_getinfo(stream->handle_, CURLINFO_RESPONSE_CODE, &response_code);
+	if(200 != response_code)
+		return total_size;
+
+	// Если клиент не успевает забирать данные, то получение ответа
+	// приостанавливается. Этот фрагмент curl передаст повторно.
+	if(stream->pending_bytes_ >= stream->buffer_size_) {
+		stream->paused_ = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	if(!stream->response_) {
+		stream->response_ = std::make_unique<stream_state_t::response_t>(
+				info->original_req_->create_response<restinio::chunked_output_t>());
+		append_common_headers(*(stream->response_));
+		stream->response_->append_chunk(
+				make_processed_body_prefix(info->original_req_));
+	}
+
+	stream->response_->append_chunk(std::string{ptr, total_size});
+	stream->pending_bytes_ += total_size;
+	stream->response_->flush(
+			[stream, total_size](const restinio::asio_ns::error_code & ec) {
+				on_stream_chunk_written(stream, total_size, ec);
+			});
+
+	return total_size;
+}
+
+// Эту функцию будет периодически вызывать curl в режиме streaming.
+// Указатель на нее будет задан через CURLOPT_XFERINFOFUNCTION.
+//
+// Общий таймаут libcurl (CURLOPT_TIMEOUT_MS) учитывает и время, пока
+// получение ответа приостановлено из-за медленного клиента, поэтому
+// в режиме streaming он не используется. Срок обработки запроса
+// ограничивает только время до начала передачи ответа клиенту, а дальше
+// передача идет со скоростью клиента. curl вызывает эту функцию не реже
+// раза в секунду, поэтому срок соблюдается с такой точностью.
+int stream_progress_callback(
+		void * userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+	auto info = reinterpret_cast<request_info_t *>(userdata);
+	auto & stream = *(info->stream_);
+	if(!stream.response_ && info->deadline_.expired()) {
+		stream.deadline_exceeded_ = true;
+		// Ненулевое значение прерывает запрос.
+		return 1;
+	}
+	return 0;
+}
+
+// Эту функцию будет вызывать curl для каждого заголовка ответа
+// удаленного сервера. Указатель на нее будет задан через
+// CURLOPT_HEADERFUNCTION.
+std::size_t header_callback(
+		char *buffer, size_t size, size_t nitems, void *userdata) {
+	auto info = reinterpret_cast<request_info_t *>(userdata);
+	const auto total_size = size * nitems;
+	// Нас интересуют только размер ответа и заголовки, влияющие
+	// на кэширование. Если размер ответа известен, то память под
+	// него выделяется сразу и целиком. В режиме streaming ответ
+	// в памяти не накапливается.
+	std::size_t content_length;
+	if(parse_content_length(buffer, total_size, content_length)) {
+		if(!info->stream_)
+			info->reply_data_.expect(content_length);
+	}
+	else if(!extract_header_value(buffer, total_size, "cache-control", info->cache_control_))
+		extract_header_value(buffer, total_size, "expires", info->expires_);
 
 	return total_size;
 }
 
+// Тело ответа для случая, когда удаленный сервер успешно ответил.
+std::string make_processed_body(
+		const restinio::request_handle_t & req,
+		const std::string & reply_data) {
+	return fmt::format("Request processed.\nPath: {}\nQuery: {}\n"
+			"Response:\n===\n{}\n===\n",
+		req->header().path(),
+		req->header().query(),
+		reply_data);
+}
+
 // Финальная стадия обработки запроса к удаленному серверу.
 // curl_multi свою часть работы сделал. Осталось создать http-response,
 // который будет отослан в ответ на входящий http-request.
-void complete_request_processing(request_info_t & info) {
-	auto response = info.original_req_->create_response();
+//
+// Результат исходящего запроса берется из info, а сам ответ формируется
+// для req. Это может быть как запрос, инициировавший обращение к удаленному
+// серверу, так и любой из присоединившихся к нему запросов.
+void complete_request_processing(
+		const request_info_t & info,
+		const restinio::request_handle_t & req) {
+	// Удаленный сервер не успел ответить за отведенное время.
+	if(CURLE_OPERATION_TIMEDOUT == info.curl_code_) {
+		reply_gateway_timeout(req);
+		return;
+	}
+
+	auto response = req->create_response();
 
-	response.append_header(restinio::http_field::server,
-			"RESTinio hello world server");
-	response.append_header_date_field();
-	response.append_header(restinio::http_field::content_type,
-			"text/plain; charset=utf-8");
+	append_common_headers(response);
 
 	if(CURLE_OK == info.curl_code_) {
-		if(200 == info.response_code_)
-			response.set_body(
-				fmt::format("Request processed.\nPath: {}\nQuery: {}\n"
-						"Response:\n===\n{}\n===\n",
-					info.original_req_->header().path(),
-					info.original_req_->header().query(),
-					info.reply_data_));
+		if(200 == info.response_code_) {
+			// Ответ удаленного сервера не копируется, а передается
+			// в RESTinio в виде списка блоков.
+			response.set_body(make_processed_body_prefix(req));
+			info.reply_data_.append_to(response);
+			response.append_body(restinio::const_buffer("\n===\n", 5u));
+		}
 		else
 			response.set_body(
 				fmt::format("Request failed.\nPath: {}\nQuery: {}\n"
 						"Response code: {}\n",
-					info.original_req_->header().path(),
-					info.original_req_->header().query(),
+					req->header().path(),
+					req->header().query(),
 					info.response_code_));
 	}
 	else
@@ -139,46 +566,60 @@ void complete_request_processing(request_info_t & info) {
 	response.done();
 }
 
-// Попытка обработать все сообщения, которые на данный момент существуют
-// в curl_multi.
-void check_curl_op_completion(CURLM * curlm) {
-	CURLMsg * msg;
-	int messages_left{0};
+// Формирование ответов на запрос, который обращался к удаленному серверу,
+// и на все присоединившиеся к нему запросы.
+//
+// У фонового запроса за новой версией ответа из кэша нет исходного
+// запроса, поэтому ответ для него не формируется.
+void complete_request_and_waiters(const request_info_t & info) {
+	if(info.original_req_)
+		complete_request_processing(info, info.original_req_);
+	for(const auto & waiter : info.waiters_)
+		if(waiter->original_req_)
+			complete_request_processing(info, waiter->original_req_);
+}
 
-	// В цикле извлекаем все сообщения от curl_multi и обрабатываем
-	// только сообщения CURLMSG_DONE.
-	while(nullptr != (msg = curl_multi_info_read(curlm, &messages_left))) {
-		if(CURLMSG_DONE == msg->msg) {
-			// Нашли операцию, которая реально завершилась.
-			// Сразу забераем ее под unique_ptr, дабы не забыть вызвать
-			// curl_easy_cleanup.
-			std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> easy_handle{
-					msg->easy_handle,
-					&curl_easy_cleanup};
+// Завершение обработки запроса в режиме streaming.
+void complete_streaming_request(request_info_t & info) {
+	auto & stream = *info.stream_;
+	stream.finished_ = true;
+
+	// Если клиенту еще ничего не отправлялось (удаленный сервер недоступен,
+	// ответил неуспешно или прислал пустой ответ), то ответ формируется
+	// обычным образом.
+	if(!stream.response_) {
+		complete_request_processing(info, info.original_req_);
+		return;
+	}
 
-			// Эта операция в curl_multi больше участвовать не должна.
-			curl_multi_remove_handle(curlm, easy_handle.get());
+	// Статус ответа уже отослан клиенту, поэтому о прерванной передаче
+	// можно сообщить только в теле ответа.
+	stream.response_->append_chunk(CURLE_OK == info.curl_code_ ?
+			std::string{"\n===\n"} :
+			std::string{"\n=== Transfer from target service interrupted ===\n"});
+	stream.response_->done();
+}
 
-			// Разбираемся с оригинальным запросом, с которым эта операция
-			// была связана.
-			request_info_t * info_raw_ptr{nullptr};
-			curl_easy_getinfo(easy_handle.get(), CURLINFO_PRIVATE, &info_raw_ptr);
-			// Сразу оборачиваем в unique_ptr, чтобы удалить объект.
-			std::unique_ptr<request_info_t> info{info_raw_ptr};
+// Ответ на запрос с использованием данных из кэша.
+restinio::request_handling_status_t complete_from_cache(
+		const restinio::request_handle_t & req,
+		const std::string & reply_data) {
+	auto response = req->create_response();
 
-			info->curl_code_ = msg->data.result;
-			if(CURLE_OK == info->curl_code_) {
-				// Нужно достать код, с которым нам ответил сервер.
-				curl_easy_getinfo(
-						easy_handle.get(),
-						CURLINFO_RESPONSE_CODE,
-						&info->response_code_);
-			}
+	append_common_headers(response);
+	response.set_body(make_processed_body(req, reply_data));
 
-			// Теперь уже можно завершить обработку.
-			complete_request_processing(*info);
-		}
-	}
+	return response.done();
+}
+
+// Передача запросу to всего, что нужно для формирования ответов,
+// от запроса from. Используется, когда из пары основного и дублирующего
+// запросов остается только один.
+void take_over_request(request_info_t & from, request_info_t & to) {
+	to.original_req_ = std::move(from.original_req_);
+	to.ticket_ = std::move(from.ticket_);
+	to.waiters_ = std::move(from.waiters_);
+	to.is_hedge_ = false;
 }
 
 // Вспомогательный класс для работы с сокетом.
@@ -211,9 +652,19 @@ public:
 };
 
 // Реализация работы с curl_multi через curl_multi_socket_action.
+//
+// Экземпляр curl_multi_processor_t привязан к io_context, который
+// обслуживается одной-единственной нитью. Все обращения к нему, включая
+// вызов perform_request из обработчика HTTP-запросов, происходят на этой
+// же нити, поэтому никакой дополнительной синхронизации не требуется.
 class curl_multi_processor_t {
 public:
-	curl_multi_processor_t(restinio::asio_ns::io_context & ioctx);
+	// Объект config должен жить дольше процессора.
+	curl_multi_processor_t(
+			restinio::asio_ns::io_context & ioctx,
+			CURLSH * share,
+			response_cache_t & cache,
+			const config_t & config);
 	~curl_multi_processor_t();
 
 	// Это не Copyable и не Moveable класс.
@@ -224,14 +675,70 @@ public:
 	// того, чтобы выполнить очередной запрос к удаленному серверу.
 	void perform_request(std::unique_ptr<request_info_t> info);
 
+	const hedging_policy_t & hedging() const noexcept { return hedging_; }
+
+	const target_balancer_t & balancer() const noexcept { return balancer_; }
+
+	const concurrency_limiter_t & limiter() const noexcept { return limiter_; }
+
+	const stage_metrics_t & metrics() const noexcept { return metrics_; }
+
 private:
+	// Запрос, ждущий освобождения места под адаптивным лимитом.
+	struct waiting_request_t {
+		// Если к этому моменту место не освободится, то запрос отвергается.
+		std::chrono::steady_clock::time_point expires_at_;
+		std::unique_ptr<request_info_t> info_;
+	};
+
 	// Экземпляр curl_multi, который будет выполнять работу с исходящими запросами.
 	CURLM * curlm_;
 
 	// Asio-шный контекст, на котором будет идти работа.
 	restinio::asio_ns::io_context & ioctx_;
-	// Защита от одновременной диспетчеризации сразу на нескольких нитях.
-	restinio::asio_ns::strand<restinio::asio_ns::executor> strand_{ioctx_.get_executor()};
+
+	// Пул curl_easy для исходящих запросов.
+	curl_easy_pool_t pool_;
+
+	// Реестр выполняющихся исходящих запросов.
+	request_registry_t registry_;
+
+	// Кэш, в который сохраняются ответы удаленного сервера.
+	response_cache_t & cache_;
+
+	// Размер буфера для режима streaming. 0, если режим не используется.
+	const std::size_t stream_buffer_;
+
+	// Параметры сброса больших ответов во временный файл.
+	const reply_spill_params_t & spill_;
+
+	// Политика отправки дублирующих запросов.
+	hedging_policy_t hedging_;
+	// Запросы, ждущие момента отправки дублирующего запроса.
+	hedge_queue_t hedge_queue_;
+	// Таймер для самого раннего из этих моментов.
+	restinio::asio_ns::steady_timer hedge_timer_{ioctx_};
+
+	// Распределение запросов между экземплярами удаленного сервера.
+	target_balancer_t balancer_;
+
+	// Адаптивное ограничение количества одновременно выполняющихся
+	// исходящих запросов.
+	concurrency_limiter_t limiter_;
+	// Сколько исходящих запросов сейчас выполняется через curl_multi,
+	// включая дублирующие.
+	std::size_t transfers_{0u};
+	// Запросы, ждущие освобождения места под лимитом, в порядке поступления.
+	std::deque<waiting_request_t> waiting_;
+	// Таймер для отказа запросам, которые ждут слишком долго.
+	restinio::asio_ns::steady_timer waiting_timer_{ioctx_};
+	// Сколько запрос может ждать освобождения места.
+	const std::chrono::milliseconds queue_timeout_;
+	// Значение Retry-After для отвергнутых запросов.
+	const std::chrono::seconds retry_after_;
+
+	// Время, которое запросы этой нити проводят на стадиях обработки.
+	stage_metrics_t metrics_;
 
 	// Таймер, который будем использовать внутри timer_function-коллбэка.
 	restinio::asio_ns::steady_timer timer_{ioctx_};
@@ -245,6 +752,34 @@ private:
 		return reinterpret_cast<curl_multi_processor_t *>(ptr);
 	}
 
+	// Попытка обработать все сообщения, которые на данный момент существуют
+	// в curl_multi.
+	void check_curl_op_completion();
+
+	// Отправка нового запроса вместе с постановкой его в очередь
+	// на отправку дублирующего запроса.
+	void launch_request(std::unique_ptr<request_info_t> info);
+	// Отправка ждущих запросов, если под лимитом освободилось место,
+	// и отказ тем, которые ждут слишком долго.
+	void start_waiting_requests();
+	// Отказ запросу, который так и не дождался отправки.
+	void shed_request(request_info_t & info);
+	// Взвод таймера на момент отказа самому старому из ждущих запросов.
+	void arm_waiting_timer();
+
+	// Передача исходящего запроса в curl_multi. Экземпляр удаленного
+	// сервера avoid по возможности не используется.
+	void start_transfer(
+			request_info_t & info,
+			std::size_t avoid = std::numeric_limits<std::size_t>::max());
+
+	// Постановка основного запроса в очередь на отправку дублирующего.
+	void schedule_hedge(request_info_t & info);
+	// Взвод таймера на самый ранний момент отправки дублирующего запроса.
+	void arm_hedge_timer();
+	// Отправка дублирующих запросов, время для которых уже наступило.
+	void on_hedge_timer();
+
 	// Коллбэк для CURLMOPT_SOCKETFUNCTION.
 	static int socket_function(
 			CURL *,
@@ -280,9 +815,44 @@ private:
 };
 
 curl_multi_processor_t::curl_multi_processor_t(
-		restinio::asio_ns::io_context & ioctx)
+		restinio::asio_ns::io_context & ioctx,
+		CURLSH * share,
+		response_cache_t & cache,
+		const config_t & config)
 	:	curlm_{curl_multi_init()}
-	,	ioctx_{ioctx} {
+	,	ioctx_{ioctx}
+	,	pool_{share, [this](CURL * handle) {
+			// Общие для всех запросов настройки устанавливаются только
+			// один раз, при создании curl_easy.
+			curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION,
+					stream_buffer_ ? stream_write_callback : write_callback);
+			curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, header_callback);
+			if(stream_buffer_) {
+				curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION,
+						stream_progress_callback);
+				curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+			}
+
+			// Не совсем обычные настройки.
+			// Здесь мы определяем, как будет создаваться новый сокет для
+			// обработки запроса.
+			curl_easy_setopt(handle, CURLOPT_OPENSOCKETFUNCTION,
+				&curl_multi_processor_t::open_socket_function);
+			curl_easy_setopt(handle, CURLOPT_OPENSOCKETDATA, this);
+
+			// А здесь определяем, как ставший ненужным сокет будет закрываться.
+			curl_easy_setopt(handle, CURLOPT_CLOSESOCKETFUNCTION,
+				&curl_multi_processor_t::close_socket_function);
+			curl_easy_setopt(handle, CURLOPT_CLOSESOCKETDATA, this);
+		}}
+	,	cache_{cache}
+	,	stream_buffer_{config.streaming_ ? config.stream_buffer_ : 0u}
+	,	spill_{config.spill_}
+	,	hedging_{config.hedging_}
+	,	balancer_{config.targets_, config.balancing_}
+	,	limiter_{config.limit_}
+	,	queue_timeout_{config.limit_.queue_timeout_}
+	,	retry_after_{config.retry_after_} {
 
 	// Должным образом настраиваем curl_multi.
 	
@@ -303,38 +873,352 @@ curl_multi_processor_t::~curl_multi_processor_t() {
 
 void curl_multi_processor_t::perform_request(
 		std::unique_ptr<request_info_t> info) {
-	// Для того, чтобы передать новый запрос в curl_multi используем
-	// callback для Asio.
-	restinio::asio_ns::post(strand_,
+	info->timestamps_.mark_enqueued();
+
+	// Новый запрос передается в curl_multi через callback для Asio, чтобы
+	// вызовы коллбэков curl_multi не происходили внутри обработчика
+	// HTTP-запроса. Это не приводит к переходу на другую нить.
+	restinio::asio_ns::post(ioctx_,
 		[this, info = std::move(info)]() mutable {
-			// Для выполнения очередного запроса нужно создать curl_easy-объект и
-			// должным образом его настроить.
-			auto handle = curl_easy_init();
+			// Если запрос к этому URL уже выполняется, то новый запрос просто
+			// присоединяется к нему и обращения к удаленному серверу не требуется.
+			// В режиме streaming так делать нельзя, т.к. присоединившийся
+			// запрос не получил бы уже переданную часть ответа.
+			if(!stream_buffer_) {
+				if(auto leader = registry_.find_or_register(info->path_, info.get())) {
+					leader->waiters_.push_back(std::move(info));
+					return;
+				}
+			}
 
-			// Обычные для curl_easy настройки, вроде URL и writefunction.
-			curl_easy_setopt(handle, CURLOPT_URL, info->url_.c_str());
-			curl_easy_setopt(handle, CURLOPT_PRIVATE, info.get());
+			// Если выполняется уже столько запросов, сколько позволяет
+			// лимит, то запрос ненадолго откладывается в надежде, что
+			// какой-то из выполняющихся запросов вскоре завершится.
+			// Присоединяться к нему можно и пока он ждет.
+			if(transfers_ >= limiter_.limit() || !waiting_.empty()) {
+				waiting_.push_back(waiting_request_t{
+						std::chrono::steady_clock::now() + queue_timeout_,
+						std::move(info)});
+				if(1u == waiting_.size())
+					arm_waiting_timer();
+				return;
+			}
 
-			curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_callback);
-			curl_easy_setopt(handle, CURLOPT_WRITEDATA, info.get());
-			// Не совсем обычные настройки.
-			// Здесь мы определяем, как будет создаваться новый сокет для
-			// обработки запроса.
-			curl_easy_setopt(handle, CURLOPT_OPENSOCKETFUNCTION,
-				&curl_multi_processor_t::open_socket_function);
-			curl_easy_setopt(handle, CURLOPT_OPENSOCKETDATA, this);
+			launch_request(std::move(info));
+		});
+}
 
-			// А здесь определяем, как ставший ненужным сокет будет закрываться.
-			curl_easy_setopt(handle, CURLOPT_CLOSESOCKETFUNCTION,
-				&curl_multi_processor_t::close_socket_function);
-			curl_easy_setopt(handle, CURLOPT_CLOSESOCKETDATA, this);
+void curl_multi_processor_t::launch_request(
+		std::unique_ptr<request_info_t> info) {
+	start_transfer(*info);
+
+	// Если ответ задержится, то может потребоваться дублирующий
+	// запрос. Но не в режиме streaming и не для фоновых запросов
+	// за новой версией ответа из кэша.
+	if(!stream_buffer_ && info->original_req_)
+		schedule_hedge(*info);
+
+	// unique_ptr не должен больше нести ответственность за объект.
+	// Мы его сами удалим когда обработка запроса завершится.
+	info.release();
+}
+
+void curl_multi_processor_t::start_transfer(
+		request_info_t & info,
+		std::size_t avoid) {
+	// Сначала определяемся, к какому экземпляру удаленного сервера
+	// пойдет запрос.
+	info.target_ = balancer_.select(avoid);
+	balancer_.on_start(info.target_);
+	const auto & target = balancer_.target(info.target_);
+	const auto url = fmt::format("http://{}:{}{}",
+			target.address_, target.port_, info.path_);
+
+	// Для выполнения очередного запроса нужно взять curl_easy-объект
+	// из пула и установить для него настройки этого запроса.
+	auto handle = pool_.acquire();
+
+	if(stream_buffer_)
+		info.stream_ = std::make_shared<stream_state_t>(
+				ioctx_, handle, stream_buffer_);
+
+	// libcurl делает собственную копию URL.
+	curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(handle, CURLOPT_PRIVATE, &info);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &info);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, &info);
+	if(stream_buffer_) {
+		// Срок обработки запроса отслеживается stream_progress_callback.
+		curl_easy_setopt(handle, CURLOPT_XFERINFODATA, &info);
+		curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, 0L);
+	}
+	else
+		// Исходящий запрос может длиться не дольше, чем осталось
+		// времени на обработку входящего запроса.
+		info.deadline_.apply_to(handle);
+
+	info.handle_ = handle;
+	info.started_at_ = std::chrono::steady_clock::now();
+	info.timestamps_.dispatched_ = info.started_at_;
+	++transfers_;
+
+	// Новый curl_easy подготовлен, можно отдать его в curl_multi.
+	curl_multi_add_handle(curlm_, handle);
+}
+
+void curl_multi_processor_t::schedule_hedge(request_info_t & info) {
+	hedging_.on_primary_request();
+
+	hedging_policy_t::duration_t delay;
+	if(!hedging_.enabled() || !hedging_.hedge_delay(delay))
+		return;
+
+	// Если к этому моменту время на обработку запроса уже истечет,
+	// то дублирующий запрос не поможет.
+	if(!info.deadline_.unlimited() && info.deadline_.remaining() <= delay)
+		return;
 
-			// Новый curl_easy подготовлен, можно отдать его в curl_multi.
-			curl_multi_add_handle(curlm_, handle);
+	info.hedge_it_ = hedge_queue_.emplace(info.started_at_ + delay, &info);
+	info.hedge_scheduled_ = true;
 
-			// unique_ptr не должен больше нести ответственность за объект.
-			// Мы его сами удалим когда обработка запроса завершится.
-			info.release();
+	// Таймер перевзводится только если этот момент оказался самым ранним.
+	if(hedge_queue_.begin() == info.hedge_it_)
+		arm_hedge_timer();
+}
+
+void curl_multi_processor_t::arm_hedge_timer() {
+	hedge_timer_.expires_at(hedge_queue_.begin()->first);
+	hedge_timer_.async_wait([this](const auto & ec) {
+			if(!ec)
+				on_hedge_timer();
+		});
+}
+
+void curl_multi_processor_t::on_hedge_timer() {
+	const auto now = std::chrono::steady_clock::now();
+	while(!hedge_queue_.empty() && hedge_queue_.begin()->first <= now) {
+		auto & primary = *(hedge_queue_.begin()->second);
+		hedge_queue_.erase(hedge_queue_.begin());
+		primary.hedge_scheduled_ = false;
+
+		// Бюджет расходуется только если запрос еще имеет смысл.
+		// Дублирующий запрос не должен превышать лимит одновременно
+		// выполняющихся запросов, иначе он только добавит нагрузки
+		// перегруженному удаленному серверу.
+		if(primary.deadline_.expired() || transfers_ >= limiter_.limit() ||
+				!hedging_.try_spend())
+			continue;
+
+		// Дублирующий запрос ни за кем не закреплен: клиентам ответит тот
+		// из двух запросов, который завершится первым.
+		auto hedge = std::make_unique<request_info_t>(
+				primary.path_,
+				restinio::request_handle_t{},
+				admission_ticket_t{},
+				primary.deadline_,
+				spill_);
+		hedge->is_hedge_ = true;
+		hedge->hedge_partner_ = &primary;
+		// Если ответит дублирующий запрос, то для клиента все
+		// стадии до отправки включают и ожидание основного.
+		hedge->timestamps_.accepted_ = primary.timestamps_.accepted_;
+		hedge->timestamps_.enqueued_ = primary.timestamps_.enqueued_;
+		primary.hedge_partner_ = hedge.get();
+
+		// Дублирующий запрос лучше отправить другому экземпляру.
+		start_transfer(*hedge, primary.target_);
+		hedge.release();
+	}
+
+	if(!hedge_queue_.empty())
+		arm_hedge_timer();
+}
+
+void curl_multi_processor_t::check_curl_op_completion() {
+	CURLMsg * msg;
+	int messages_left{0};
+
+	// В цикле извлекаем все сообщения от curl_multi и обрабатываем
+	// только сообщения CURLMSG_DONE.
+	while(nullptr != (msg = curl_multi_info_read(curlm_, &messages_left))) {
+		if(CURLMSG_DONE == msg->msg) {
+			// Нашли операцию, которая реально завершилась.
+			// Сразу же обеспечиваем возврат ее curl_easy в пул.
+			CURL * easy_handle = msg->easy_handle;
+			auto easy_handle_releaser = cpp_util_3::at_scope_exit(
+					[this, easy_handle]{ pool_.release(easy_handle); });
+
+			// Эта операция в curl_multi больше участвовать не должна.
+			curl_multi_remove_handle(curlm_, easy_handle);
+			const auto transfers = transfers_--;
+
+			// Разбираемся с оригинальным запросом, с которым эта операция
+			// была связана.
+			request_info_t * info_raw_ptr{nullptr};
+			curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &info_raw_ptr);
+			// Сразу оборачиваем в unique_ptr, чтобы удалить объект.
+			std::unique_ptr<request_info_t> info{info_raw_ptr};
+
+			info->curl_code_ = msg->data.result;
+			if(CURLE_OK == info->curl_code_) {
+				// Нужно достать код, с которым нам ответил сервер.
+				curl_easy_getinfo(
+						easy_handle,
+						CURLINFO_RESPONSE_CODE,
+						&info->response_code_);
+			}
+			// Запрос, прерванный stream_progress_callback, для клиента
+			// ничем не отличается от не уложившегося в таймаут.
+			else if(info->stream_ && info->stream_->deadline_exceeded_)
+				info->curl_code_ = CURLE_OPERATION_TIMEDOUT;
+
+			info->timestamps_.mark_completed(easy_handle);
+			metrics_.record(info->timestamps_);
+
+			// Дублирующий запрос для этого запроса уже не потребуется.
+			if(info->hedge_scheduled_) {
+				hedge_queue_.erase(info->hedge_it_);
+				info->hedge_scheduled_ = false;
+			}
+
+			const auto latency = std::chrono::steady_clock::now() - info->started_at_;
+
+			// Ошибки записи полученных данных возникают на нашей стороне,
+			// поэтому экземпляр удаленного сервера за них не отвечает.
+			balancer_.on_complete(info->target_,
+					(CURLE_OK != info->curl_code_ && CURLE_WRITE_ERROR != info->curl_code_) ||
+						info->response_code_ >= 500,
+					latency);
+
+			const bool succeeded =
+					CURLE_OK == info->curl_code_ && 200 == info->response_code_;
+			if(succeeded) {
+				hedging_.record_latency(
+						std::chrono::duration_cast<hedging_policy_t::duration_t>(latency));
+				limiter_.on_sample(
+						std::chrono::duration_cast<concurrency_limiter_t::duration_t>(latency),
+						transfers);
+			}
+			else if(CURLE_OPERATION_TIMEDOUT == info->curl_code_ ||
+					503 == info->response_code_)
+				// Удаленный сервер не справляется с нагрузкой.
+				limiter_.on_drop();
+
+			// Если был отправлен дублирующий запрос, то используется
+			// результат того из двух запросов, который первым завершится
+			// успешно.
+			if(auto partner = info->hedge_partner_) {
+				partner->hedge_partner_ = nullptr;
+				if(!succeeded) {
+					// Неудачный запрос уступает место второму, который еще
+					// выполняется. Если неудачным был основной запрос, то
+					// ответы клиентам будет формировать дублирующий.
+					if(!info->is_hedge_) {
+						take_over_request(*info, *partner);
+						registry_.remove(info->path_);
+						registry_.find_or_register(partner->path_, partner);
+					}
+					continue;
+				}
+
+				// Второй запрос больше не нужен и должен быть прерван.
+				std::unique_ptr<request_info_t> loser{partner};
+				curl_multi_remove_handle(curlm_, loser->handle_);
+				pool_.release(loser->handle_);
+				balancer_.on_cancel(loser->target_);
+				--transfers_;
+
+				if(info->is_hedge_) {
+					hedging_.on_hedge_won();
+					take_over_request(*loser, *info);
+				}
+			}
+
+			// В режиме streaming ответ уже частично передан клиенту,
+			// а запросы не объединяются и не кэшируются.
+			if(info->stream_) {
+				complete_streaming_request(*info);
+				continue;
+			}
+
+			// Запрос к этому URL больше не выполняется, новые запросы
+			// к нему должны приводить к новому обращению.
+			registry_.remove(info->path_);
+
+			// Теперь уже можно завершить обработку.
+			complete_request_and_waiters(*info);
+
+			// Успешный ответ сохраняется в кэше, откуда его возьмут
+			// последующие запросы. В кэше ответ хранится одной строкой,
+			// поэтому копия делается только если кэш используется и ответ
+			// в нем поместится. Ответ, сброшенный во временный файл,
+			// в память не читается вовсе.
+			if(CURLE_OK == info->curl_code_ && 200 == info->response_code_) {
+				if(!info->reply_data_.spilled() &&
+						cache_.accepts(info->path_, info->reply_data_.size()))
+					cache_.store(info->path_,
+							std::make_shared<const std::string>(
+									info->reply_data_.to_string()),
+							cache_.policy_for(info->cache_control_, info->expires_));
+				else
+					cache_.remove(info->path_);
+			}
+			else
+				// Если это был фоновый запрос за новой версией, то
+				// устаревший ответ остается в кэше до следующей попытки.
+				cache_.revalidation_failed(info->path_);
+		}
+	}
+
+	// Завершившиеся запросы освободили место для ждущих.
+	start_waiting_requests();
+}
+
+void curl_multi_processor_t::start_waiting_requests() {
+	// Запросы, которые ждут слишком долго, отвергаются. Время ожидания
+	// у всех запросов одинаковое, поэтому дольше всех ждут запросы
+	// в начале очереди.
+	const auto now = std::chrono::steady_clock::now();
+	while(!waiting_.empty() && waiting_.front().expires_at_ <= now) {
+		auto info = std::move(waiting_.front().info_);
+		waiting_.pop_front();
+		shed_request(*info);
+	}
+
+	while(!waiting_.empty() && transfers_ < limiter_.limit()) {
+		auto info = std::move(waiting_.front().info_);
+		waiting_.pop_front();
+		launch_request(std::move(info));
+	}
+}
+
+void curl_multi_processor_t::shed_request(request_info_t & info) {
+	limiter_.on_shed();
+
+	// Запрос к этому URL так и не начался, новые запросы к нему
+	// должны приводить к новому обращению.
+	if(!stream_buffer_)
+		registry_.remove(info.path_);
+
+	if(info.original_req_)
+		reject_overloaded(info.original_req_, retry_after_);
+	for(const auto & waiter : info.waiters_)
+		if(waiter->original_req_)
+			reject_overloaded(waiter->original_req_, retry_after_);
+
+	// Если это был фоновый запрос за новой версией, то устаревший
+	// ответ остается в кэше до следующей попытки.
+	cache_.revalidation_failed(info.path_);
+}
+
+void curl_multi_processor_t::arm_waiting_timer() {
+	waiting_timer_.expires_at(waiting_.front().expires_at_);
+	waiting_timer_.async_wait([this](const auto & ec) {
+			if(ec)
+				return;
+			start_waiting_requests();
+			if(!waiting_.empty())
+				arm_waiting_timer();
 		});
 }
 
@@ -381,19 +1265,21 @@ int curl_multi_processor_t::timer_function(
 		self->timer_.cancel();
 	}
 	else if(0 == timeout_ms) {
-		// Сразу же проверяем истечение тайм-аутов для активных операций.
-		self->check_timeouts();
+		// Нужно сразу же проверить истечение тайм-аутов для активных
+		// операций. Но вызывать curl_multi_socket_action изнутри
+		// коллбэка нельзя, поэтому делаем это через Asio.
+		self->timer_.cancel();
+		restinio::asio_ns::post(self->ioctx_, [self]{ self->check_timeouts(); });
 	}
 	else {
 		// Нужно взводить новый таймер.
 		self->timer_.cancel();
 		self->timer_.expires_after(std::chrono::milliseconds{timeout_ms});
 		self->timer_.async_wait(
-				restinio::asio_ns::bind_executor(self->strand_,
-					[self](const auto & ec) {
-						if( !ec )
-							self->check_timeouts();
-					}));
+				[self](const auto & ec) {
+					if( !ec )
+						self->check_timeouts();
+				});
 	}
 
 	return 0;
@@ -404,7 +1290,7 @@ void curl_multi_processor_t::check_timeouts() {
 	// Заставляем curl проверить состояние активных операций.
 	curl_multi_socket_action(curlm_, CURL_SOCKET_TIMEOUT, 0, &running_handles_count);
 	// После чего проверяем завершилось ли что-нибудь.
-	check_curl_op_completion(curlm_);
+	check_curl_op_completion();
 }
 
 void curl_multi_processor_t::event_cb(
@@ -422,7 +1308,7 @@ void curl_multi_processor_t::event_cb(
 		// Заставляем curl проверить состояние этого сокета.
 		curl_multi_socket_action(curlm_, socket, what, &running_handles_count );
 		// После чего проверяем завершилось ли что-нибудь.
-		check_curl_op_completion(curlm_);
+		check_curl_op_completion();
 
 		if(running_handles_count <= 0)
 			// Больше нет активных операций. Таймер уже не нужен.
@@ -487,65 +1373,325 @@ void curl_multi_processor_t::schedule_wait_read_for(
 		active_socket_t & act_socket) {
 	act_socket.socket().async_wait(
 		restinio::asio_ns::ip::tcp::socket::wait_read,
-		restinio::asio_ns::bind_executor(strand_,
-			[this, s = act_socket.handle()]( const auto & ec ){
-				this->event_cb(s, CURL_POLL_IN, ec);
-			}));
+		[this, s = act_socket.handle()]( const auto & ec ){
+			this->event_cb(s, CURL_POLL_IN, ec);
+		});
 }
 
 void curl_multi_processor_t::schedule_wait_write_for(
 		active_socket_t & act_socket) {
 	act_socket.socket().async_wait(
 		restinio::asio_ns::ip::tcp::socket::wait_write,
-		restinio::asio_ns::bind_executor(strand_,
-			[this, s = act_socket.handle()]( const auto & ec ){
-				this->event_cb(s, CURL_POLL_OUT, ec);
-			}));
+		[this, s = act_socket.handle()]( const auto & ec ){
+			this->event_cb(s, CURL_POLL_OUT, ec);
+		});
 }
 
+// Рабочая нить вместе со всем, что она обслуживает.
+//
+// Входящее подключение принимается одним из слушающих сокетов и дальше
+// целиком обрабатывается на нити этого сокета: и разбор HTTP-запроса,
+// и исходящий запрос через curl_multi, и отсылка ответа.
+//
+// Счетчик исходящих запросов у каждой нити свой, чтобы нити не
+// конкурировали за одну и ту же кэш-линию. Общий лимит делится
+// между нитями поровну.
+struct io_worker_t {
+	// Счетчик исходящих запросов этой нити. Должен пережить все объекты
+	// с информацией о запросах, т.к. они возвращают ему разрешения.
+	admission_controller_t admission_;
+
+	// Asio-шный io_context, который будет использоваться
+	// и curl_multi_processor-ом, и HTTP-сервером этой нити.
+	restinio::asio_ns::io_context ioctx_;
+
+	// Обработчик запросов к удаленному серверу.
+	curl_multi_processor_t curl_multi_;
+
+	io_worker_t(
+			std::size_t max_in_flight,
+			CURLSH * share,
+			response_cache_t & cache,
+			const config_t & config)
+		:	admission_{max_in_flight}
+		,	curl_multi_{ioctx_, share, cache, config}
+		{}
+};
+
+using io_workers_t = std::vector<std::unique_ptr<io_worker_t>>;
+
 // Реализация обработчика запросов.
 restinio::request_handling_status_t handler(
 		const config_t & config,
-		curl_multi_processor_t & req_processor,
+		const io_workers_t & workers,
+		io_worker_t & worker,
+		response_cache_t & cache,
 		restinio::request_handle_t req) {
 	if(restinio::http_method_get() == req->header().method()
 			&& "/data" == req->header().path()) {
+		const auto timestamps = stage_timestamps_t::accepted_now();
+
 		// Разберем дополнительные параметры запроса.
 		const auto qp = restinio::parse_query(req->header().query());
 
+		// Экземпляр удаленного сервера будет выбран позже, при отправке
+		// исходящего запроса. Пока нужен только путь.
+		auto path = fmt::format("/{}/{}/{}",
+				qp["year"], qp["month"], qp["day"]);
+
+		// Если ответ есть в кэше, то обращаться к удаленному серверу не нужно.
+		const auto cached = cache.lookup(path);
+		if(cached.reply_) {
+			const auto status = complete_from_cache(req, *cached.reply_);
+
+			// Устаревший ответ нужно обновить фоновым запросом. Но только
+			// если это не приведет к превышению лимита исходящих запросов.
+			if(cached.revalidate_) {
+				auto ticket = worker.admission_.try_admit();
+				if(ticket) {
+					auto info = std::make_unique<request_info_t>(
+							std::move(path),
+							restinio::request_handle_t{},
+							std::move(ticket),
+							request_deadline_t::after(config.deadline_),
+							config.spill_);
+					info->timestamps_ = timestamps;
+					worker.curl_multi_.perform_request(std::move(info));
+				}
+				else
+					cache.revalidation_failed(path);
+			}
+
+			return status;
+		}
+
+		// Если исходящих запросов уже слишком много, то лучше сразу
+		// ответить отказом, чем заставлять клиента долго ждать.
+		auto ticket = worker.admission_.try_admit();
+		if(!ticket)
+			return reject_overloaded(req, config.retry_after_);
+
 		// Нужно оформить объект с информацией о запросе и передать
 		// его на обработку в нить curl_multi.
-		auto url = fmt::format("http://{}:{}/{}/{}/{}",
-				config.target_address_,
-				config.target_port_,
-				qp["year"], qp["month"], qp["day"]);
 
 		auto info = std::make_unique<request_info_t>(
-				std::move(url), std::move(req));
+				std::move(path), std::move(req), std::move(ticket),
+				request_deadline_t::after(config.deadline_),
+				config.spill_);
+		info->timestamps_ = timestamps;
 
-		req_processor.perform_request(std::move(info));
+		worker.curl_multi_.perform_request(std::move(info));
 
 		// Подтверждаем, что мы приняли запрос к обработке и что когда-то
 		// мы ответ сгенерируем.
 		return restinio::request_accepted();
 	}
 
+	if(restinio::http_method_get() == req->header().method()
+			&& "/stats" == req->header().path()) {
+		// Текущие значения счетчиков принятых и отвергнутых запросов
+		// суммарно по всем нитям.
+		std::size_t limit{0u}, in_flight{0u};
+		std::uint64_t accepted{0u}, shed{0u};
+		for(const auto & w : workers) {
+			limit += w->admission_.limit();
+			in_flight += w->admission_.in_flight();
+			accepted += w->admission_.accepted();
+			shed += w->admission_.shed();
+		}
+		return reply_admission_stats(req, limit, in_flight, accepted, shed);
+	}
+
+	if(restinio::http_method_get() == req->header().method()
+			&& "/cache/stats" == req->header().path()) {
+		// Текущая статистика кэша ответов.
+		const auto stats = cache.stats();
+
+		auto response = req->create_response();
+		append_common_headers(response);
+		response.set_body(fmt::format(
+				"entries: {}\nbytes: {}\nhits: {}\nstale_hits: {}\n"
+				"misses: {}\nstores: {}\nevictions: {}\nexpirations: {}\n"
+				"snapshot_loads: {}\n",
+				stats.entries_, stats.bytes_, stats.hits_, stats.stale_hits_,
+				stats.misses_, stats.stores_, stats.evictions_,
+				stats.expirations_, stats.snapshot_loads_));
+		return response.done();
+	}
+
+	if(restinio::http_method_get() == req->header().method()
+			&& "/hedge/stats" == req->header().path()) {
+		// Статистика дублирующих запросов суммарно по всем нитям.
+		std::uint64_t sent{0u}, won{0u}, denied{0u};
+		for(const auto & w : workers) {
+			const auto stats = w->curl_multi_.hedging().stats();
+			sent += stats.sent_;
+			won += stats.won_;
+			denied += stats.denied_;
+		}
+
+		auto response = req->create_response();
+		append_common_headers(response);
+		response.set_body(fmt::format(
+				"sent: {}\nwon: {}\ndenied: {}\n", sent, won, denied));
+		return response.done();
+	}
+
+	if(restinio::http_method_get() == req->header().method()
+			&& "/targets/stats" == req->header().path()) {
+		// Состояние экземпляров удаленного сервера суммарно по всем нитям.
+		// Экземпляр исключается на каждой нити независимо, поэтому
+		// ejected показывает, на скольких нитях он сейчас исключен.
+		std::string body;
+		for(std::size_t i = 0u; i != config.targets_.size(); ++i) {
+			std::size_t outstanding{0u}, ejected{0u};
+			std::uint64_t requests{0u}, failures{0u}, ejections{0u};
+			for(const auto & w : workers) {
+				const auto stats = w->curl_multi_.balancer().stats(i);
+				outstanding += stats.outstanding_;
+				requests += stats.requests_;
+				failures += stats.failures_;
+				ejections += stats.ejections_;
+				ejected += stats.ejected_ ? 1u : 0u;
+			}
+			body += fmt::format(
+					"{}:{} outstanding: {} requests: {} failures: {} "
+					"ejections: {} ejected: {}\n",
+					config.targets_[i].address_, config.targets_[i].port_,
+					outstanding, requests, failures, ejections, ejected);
+		}
+
+		auto response = req->create_response();
+		append_common_headers(response);
+		response.set_body(std::move(body));
+		return response.done();
+	}
+
+	if(restinio::http_method_get() == req->header().method()
+			&& "/limiter/stats" == req->header().path()) {
+		// Адаптивный лимит подбирается каждой нитью независимо, поэтому
+		// лимиты суммируются, а для времени ответа ненагруженного
+		// сервера показывается минимальное по всем нитям значение.
+		std::size_t limit{0u};
+		std::uint64_t rtt_noload_us{0u}, shed{0u};
+		for(const auto & w : workers) {
+			const auto stats = w->curl_multi_.limiter().stats();
+			limit += stats.limit_;
+			if(stats.rtt_noload_us_ &&
+					(!rtt_noload_us || stats.rtt_noload_us_ < rtt_noload_us))
+				rtt_noload_us = stats.rtt_noload_us_;
+			shed += stats.shed_;
+		}
+
+		auto response = req->create_response();
+		append_common_headers(response);
+		response.set_body(config.limit_.enabled_ ?
+				fmt::format("limit: {}\nrtt_noload_us: {}\nshed: {}\n",
+						limit, rtt_noload_us, shed) :
+				std::string{"adaptive limit is disabled\n"});
+		return response.done();
+	}
+
+	if(restinio::http_method_get() == req->header().method()
+			&& "/metrics" == req->header().path()) {
+		// Время, которое запросы проводят на стадиях обработки,
+		// суммарно по всем нитям в формате Prometheus.
+		stage_metrics_t::snapshot_t snapshot;
+		for(const auto & w : workers)
+			w->curl_multi_.metrics().add_to(snapshot);
+		return reply_prometheus_metrics(req, snapshot);
+	}
+
 	// Все остальные запросы нашим демонстрационным сервером отвергаются.
 	return restinio::request_rejected();
 }
 
-// Вспомогательная функция, которая отвечает за запуск сервера нужного типа.
-template<typename Server_Traits, typename Handler>
-void run_server(
+// Сохранение снимка кэша.
+// Ошибки записи не должны приводить к остановке сервера.
+void save_cache_snapshot(const config_t & config, const response_cache_t & cache) {
+	try {
+		write_cache_snapshot(config.cache_snapshot_,
+				[&cache](auto && handler) { cache.for_each_entry(handler); });
+	}
+	catch(const std::exception & ex) {
+		std::cerr << "Unable to save cache snapshot: " << ex.what() << std::endl;
+	}
+}
+
+// Вспомогательная функция, которая отвечает за запуск серверов нужного типа.
+//
+// На каждой рабочей нити запускается собственный HTTP-сервер. Все они
+// слушают один и тот же адрес благодаря SO_REUSEPORT, а ядро распределяет
+// входящие подключения между ними.
+template<typename Server_Traits>
+void run_servers(
 		const config_t & config,
-		restinio::asio_ns::io_context & ioctx,
-		Handler && handler) {
-	restinio::run(
-			ioctx,
-			restinio::on_thread_pool<Server_Traits>(std::thread::hardware_concurrency())
-				.address(config.address_)
-				.port(config.port_)
-				.request_handler(std::forward<Handler>(handler)));
+		io_workers_t & workers,
+		response_cache_t & cache) {
+	using server_t = restinio::http_server_t<Server_Traits>;
+	using reuse_port_t = restinio::asio_ns::detail::socket_option::boolean<
+			SOL_SOCKET, SO_REUSEPORT>;
+
+	std::vector<std::unique_ptr<server_t>> servers;
+	servers.reserve(workers.size());
+	for(auto & w : workers) {
+		auto & worker = *w;
+		servers.emplace_back(std::make_unique<server_t>(
+				restinio::external_io_context(worker.ioctx_),
+				restinio::server_settings_t<Server_Traits>{}
+					.address(config.address_)
+					.port(config.port_)
+					.acceptor_options_setter([](auto & options) {
+							options.set_option(reuse_port_t{true});
+						})
+					.request_handler([&config, &workers, &worker, &cache](auto req) {
+							return handler(config, workers, worker, cache, std::move(req));
+						})));
+	}
+
+	// Все слушающие сокеты открываются еще до запуска рабочих нитей,
+	// чтобы ошибки вроде занятого порта сразу приводили к исключению.
+	for(auto & server : servers)
+		server->open_sync();
+
+	std::vector<std::thread> threads;
+	threads.reserve(workers.size());
+	// Рабочие нити должны быть остановлены при любом выходе из скоупа.
+	auto threads_stopper = cpp_util_3::at_scope_exit([&] {
+			for(auto & w : workers)
+				w->ioctx_.stop();
+			for(auto & t : threads)
+				t.join();
+		});
+	for(auto & w : workers)
+		threads.emplace_back([&worker = *w]{ worker.ioctx_.run(); });
+
+	// Ждем сигнала о завершении работы.
+	restinio::asio_ns::io_context signals_ctx;
+	restinio::asio_ns::signal_set signals{signals_ctx, SIGINT, SIGTERM};
+
+	// Пока ждем, периодически сохраняем снимок кэша.
+	const bool snapshot_needed = !config.cache_snapshot_.empty() && cache.enabled();
+	restinio::asio_ns::steady_timer snapshot_timer{signals_ctx};
+	std::function<void()> schedule_snapshot = [&] {
+		snapshot_timer.expires_after(config.cache_snapshot_interval_);
+		snapshot_timer.async_wait([&](const auto & ec) {
+				if(!ec) {
+					save_cache_snapshot(config, cache);
+					schedule_snapshot();
+				}
+			});
+	};
+	if(snapshot_needed)
+		schedule_snapshot();
+
+	signals.async_wait([&](const auto &, int) { snapshot_timer.cancel(); });
+	signals_ctx.run();
+
+	// Последний снимок перед завершением работы, чтобы следующий
+	// экземпляр процесса стартовал с максимально полным кэшем.
+	if(snapshot_needed)
+		save_cache_snapshot(config, cache);
 }
 
 int main(int argc, char ** argv) {
@@ -559,37 +1705,63 @@ int main(int argc, char ** argv) {
 		auto curl_global_deinitializer =
 				cpp_util_3::at_scope_exit([]{ curl_global_cleanup(); });
 
-		// Сами создаем Asio-шный io_context, т.к. он будет использоваться
-		// и curl_multi_processor-ом, и нашим HTTP-сервером.
-		restinio::asio_ns::io_context ioctx;
-
-		// Обработчик запросов к удаленному серверу.
-		curl_multi_processor_t curl_multi{ioctx};
-
-		// Актуальный обработчик входящих HTTP-запросов.
-		auto actual_handler = [&cfg, &curl_multi](auto req) {
-				return handler(cfg.config_, curl_multi, std::move(req));
-			};
-
-		// Теперь можно запустить основной HTTP-сервер.
+		// Кэш DNS разделяется между всеми рабочими нитями.
+		curl_share_t curl_share;
+
+		// Кэш ответов удаленного сервера общий для всех нитей.
+		const cache_policy_t default_cache_policy{
+				cfg.config_.cache_ttl_.count() > 0 || cfg.config_.cache_stale_.count() > 0,
+				cfg.config_.cache_ttl_,
+				cfg.config_.cache_stale_};
+		// В режиме streaming ответы целиком не сохраняются, поэтому
+		// кэш не используется.
+		response_cache_t cache{
+				cfg.config_.streaming_ ? 0u : cfg.config_.cache_size_,
+				default_cache_policy};
+
+		// Если есть снимок кэша от предыдущего экземпляра процесса,
+		// то ответы из него будут использоваться сразу же.
+		if(!cfg.config_.cache_snapshot_.empty())
+			cache.attach_snapshot(cache_snapshot_t::open(cfg.config_.cache_snapshot_));
+
+		// Сами создаем Asio-шные io_context-ы, т.к. они будут использоваться
+		// и curl_multi_processor-ами, и нашими HTTP-серверами.
+		// Лимит исходящих запросов делится между нитями с округлением вверх.
+		const auto threads = cfg.config_.threads_;
+		const auto max_in_flight_per_worker =
+				(cfg.config_.max_in_flight_ + threads - 1u) / threads;
+
+		io_workers_t workers;
+		workers.reserve(threads);
+		for(std::size_t i = 0u; i != threads; ++i)
+			workers.emplace_back(
+					std::make_unique<io_worker_t>(
+							max_in_flight_per_worker,
+							curl_share.handle(),
+							cache,
+							cfg.config_));
+
+		// Теперь можно запустить основные HTTP-серверы.
+		// Каждый из них работает только на своей нити, поэтому используются
+		// свойства для однопоточного сервера.
 
 		// Если должна использоваться трассировка запросов, то должен
 		// запускаться один тип сервера.
 		if(cfg.config_.tracing_) {
 			// Для того, чтобы сервер трассировал запросы, нужно определить
-			// свой класс свойств для сервера.
-			struct traceable_server_traits_t : public restinio::default_traits_t {
+			// свой класс свойств для сервера. Логгер разделяется между
+			// всеми нитями, поэтому он должен быть thread-safe.
+			struct traceable_server_traits_t : public restinio::default_single_thread_traits_t {
 				// Определяем нужный нам тип логгера.
 				using logger_t = restinio::shared_ostream_logger_t;
 			};
 			// Теперь используем этот новый класс свойств для запуска сервера.
-			run_server<traceable_server_traits_t>(
-					cfg.config_, ioctx, std::move(actual_handler));
+			run_servers<traceable_server_traits_t>(cfg.config_, workers, cache);
 		}
 		else {
 			// Трассировка не нужна, поэтому запускаем обычный штатный сервер.
-			run_server<restinio::default_traits_t>(
-					cfg.config_, ioctx, std::move(actual_handler));
+			run_servers<restinio::default_single_thread_traits_t>(
+					cfg.config_, workers, cache);
 		}
 
 		// Все, теперь ждем завершения работы сервера.
@@ -601,4 +1773,3 @@ int main(int argc, char ** argv) {
 
 	return 0;
 }
-
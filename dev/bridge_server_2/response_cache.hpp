@@ -0,0 +1,553 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include <bridge_server_2/cache_snapshot.hpp>
+
+//
+// Кэш ответов удаленного сервера.
+//
+// Ответы хранятся по URL исходящего запроса. Время жизни ответа
+// определяется заголовками Cache-Control и Expires, которые прислал
+// удаленный сервер, а если их нет -- значением из конфигурации.
+//
+// После истечения времени жизни ответ еще какое-то время может
+// использоваться (stale-while-revalidate): клиент сразу получает
+// устаревший ответ, а к удаленному серверу уходит фоновый запрос
+// за новой версией. Такой фоновый запрос для каждого URL выполняется
+// только один.
+//
+// Кэш разбит на сегменты, у каждого из которых собственный mutex,
+// собственный LRU-список и собственная доля общего лимита памяти.
+// Сегмент выбирается по хэшу URL.
+//
+// К кэшу может быть подключен снимок, сохраненный предыдущим экземпляром
+// процесса. Если ответа нет в кэше, но он есть в снимке и еще не устарел,
+// то ответ копируется из снимка в кэш. Для каждого URL снимок используется
+// только до тех пор, пока этот процесс сам не загрузил, не сохранил или
+// не удалил ответ для него. Иначе после вытеснения из кэша, истечения
+// времени жизни или ответа с no-store из снимка вернулась бы старая версия.
+//
+
+// Правила кэширования конкретного ответа.
+struct cache_policy_t {
+	// Можно ли вообще сохранять ответ в кэше.
+	bool cacheable_{false};
+	// Сколько времени ответ считается свежим.
+	std::chrono::seconds ttl_{0};
+	// Сколько времени после этого ответ еще может отдаваться клиентам,
+	// пока за новой версией идет фоновый запрос.
+	std::chrono::seconds stale_{0};
+};
+
+namespace cache_details {
+
+inline bool equal_ignore_case(const char * a, std::size_t a_len, const char * b) {
+	std::size_t i = 0u;
+	for(; i != a_len && b[i]; ++i)
+		if(std::tolower(static_cast<unsigned char>(a[i])) != b[i])
+			return false;
+	return i == a_len && !b[i];
+}
+
+inline std::string trim(const char * from, const char * to) {
+	while(from != to && std::isspace(static_cast<unsigned char>(*from)))
+		++from;
+	while(from != to && std::isspace(static_cast<unsigned char>(*(to - 1))))
+		--to;
+	return std::string(from, to);
+}
+
+inline std::string to_lower(std::string what) {
+	std::transform(what.begin(), what.end(), what.begin(),
+			[](unsigned char ch) { return static_cast<char>(std::tolower(ch)); });
+	return what;
+}
+
+// Наибольшее значение интервала в секундах. Большие значения заменяются
+// им, как того требует RFC 9111 (раздел 1.2.2). Иначе время устаревания
+// ответа могло бы не поместиться в steady_clock::time_point.
+constexpr long max_delta_seconds = 2147483648L;
+
+// Значение директивы вида name=N. Если значение некорректно, то -1.
+// Слишком большие значения заменяются на max_delta_seconds.
+inline long directive_value(const std::string & directive) {
+	const auto pos = directive.find('=');
+	if(std::string::npos == pos)
+		return -1;
+
+	const auto value = trim(directive.data() + pos + 1u,
+			directive.data() + directive.size());
+	if(value.empty() ||
+			!std::all_of(value.begin(), value.end(),
+				[](unsigned char ch) { return std::isdigit(ch); }))
+		return -1;
+
+	long result = 0;
+	for(const auto ch : value) {
+		result = result * 10 + (ch - '0');
+		if(result >= max_delta_seconds)
+			return max_delta_seconds;
+	}
+	return result;
+}
+
+} /* namespace cache_details */
+
+// Попытка извлечь значение заголовка с именем name из строки заголовка,
+// которую libcurl передает в CURLOPT_HEADERFUNCTION.
+// Имя должно быть задано в нижнем регистре.
+inline bool extract_header_value(
+		const char * line, std::size_t size,
+		const char * name,
+		std::string & value) {
+	const auto * end = line + size;
+	const auto * colon = std::find(line, end, ':');
+	if(colon == end ||
+			!cache_details::equal_ignore_case(
+					line, static_cast<std::size_t>(colon - line), name))
+		return false;
+
+	value = cache_details::trim(colon + 1, end);
+	return true;
+}
+
+// Определение правил кэширования по заголовкам Cache-Control и Expires.
+// Если удаленный сервер ничего не сообщил о времени жизни ответа,
+// то используются значения по умолчанию. Если же сервер явно указал
+// время жизни, но не stale-while-revalidate, то устаревший ответ
+// не используется вовсе.
+inline cache_policy_t make_cache_policy(
+		const std::string & cache_control,
+		const std::string & expires,
+		const cache_policy_t & defaults) {
+	using std::chrono::seconds;
+
+	cache_policy_t result = defaults;
+	bool ttl_found = false;
+	bool stale_found = false;
+	long max_age = -1;
+	long s_maxage = -1;
+
+	// Директивы Cache-Control разделяются запятыми.
+	std::size_t from = 0u;
+	while(from < cache_control.size()) {
+		auto to = cache_control.find(',', from);
+		if(std::string::npos == to)
+			to = cache_control.size();
+
+		const auto directive = cache_details::to_lower(cache_details::trim(
+				cache_control.data() + from, cache_control.data() + to));
+		from = to + 1u;
+
+		if("no-store" == directive || "no-cache" == directive ||
+				"private" == directive)
+			return cache_policy_t{};
+		else if(0u == directive.compare(0u, 8u, "max-age="))
+			max_age = cache_details::directive_value(directive);
+		else if(0u == directive.compare(0u, 9u, "s-maxage="))
+			s_maxage = cache_details::directive_value(directive);
+		else if(0u == directive.compare(0u, 23u, "stale-while-revalidate=")) {
+			const auto stale = cache_details::directive_value(directive);
+			if(stale >= 0) {
+				result.stale_ = seconds{stale};
+				stale_found = true;
+			}
+		}
+	}
+
+	// s-maxage предназначен именно для разделяемых кэшей, поэтому
+	// он имеет приоритет над max-age. А max-age -- над Expires.
+	if(s_maxage >= 0) {
+		result.ttl_ = seconds{s_maxage};
+		ttl_found = true;
+	}
+	else if(max_age >= 0) {
+		result.ttl_ = seconds{max_age};
+		ttl_found = true;
+	}
+	else if(!expires.empty()) {
+		const auto expires_at = curl_getdate(expires.c_str(), nullptr);
+		const auto now = std::time(nullptr);
+		// Некорректное значение Expires означает, что ответ уже устарел.
+		result.ttl_ = seconds{expires_at > now ?
+				std::min<long>(expires_at - now, cache_details::max_delta_seconds) :
+				0};
+		ttl_found = true;
+	}
+
+	if(ttl_found) {
+		if(!stale_found)
+			result.stale_ = seconds{0};
+		result.cacheable_ = result.ttl_.count() > 0 || result.stale_.count() > 0;
+	}
+
+	return result;
+}
+
+// Сам кэш ответов.
+class response_cache_t {
+public:
+	// Тип сохраненного ответа.
+	using reply_t = std::shared_ptr<const std::string>;
+
+	// Результат поиска в кэше.
+	struct lookup_result_t {
+		// Найденный ответ. Если пусто, то ответа в кэше нет.
+		reply_t reply_;
+		// Ответ устарел и вызывающая сторона должна инициировать
+		// фоновый запрос за новой версией.
+		bool revalidate_{false};
+	};
+
+	// Статистика работы кэша.
+	struct stats_t {
+		std::uint64_t hits_{0u};
+		std::uint64_t stale_hits_{0u};
+		std::uint64_t misses_{0u};
+		std::uint64_t stores_{0u};
+		std::uint64_t evictions_{0u};
+		std::uint64_t expirations_{0u};
+		std::uint64_t snapshot_loads_{0u};
+		std::size_t entries_{0u};
+		std::size_t bytes_{0u};
+	};
+
+	// Если capacity равен 0, то кэш отключен.
+	// Правила defaults используются для ответов, в которых удаленный
+	// сервер ничего не сообщил о времени их жизни.
+	response_cache_t(
+			std::size_t capacity,
+			cache_policy_t defaults,
+			std::size_t segments_count = 16u)
+		:	segments_(capacity ? segments_count : 0u)
+		,	segment_capacity_{segments_count ? capacity / segments_count : 0u}
+		,	defaults_{defaults}
+		{}
+
+	// Это не Copyable и не Moveable класс.
+	response_cache_t(const response_cache_t &) = delete;
+	response_cache_t(response_cache_t &&) = delete;
+
+	bool enabled() const noexcept { return !segments_.empty(); }
+
+	// Правила кэширования для ответа с указанными значениями
+	// заголовков Cache-Control и Expires.
+	cache_policy_t policy_for(
+			const std::string & cache_control,
+			const std::string & expires) const {
+		return make_cache_policy(cache_control, expires, defaults_);
+	}
+
+	lookup_result_t lookup(const std::string & url) {
+		lookup_result_t result;
+		if(!enabled())
+			return result;
+
+		auto & segment = segment_for(url);
+		const auto now = clock_t::now();
+
+		std::lock_guard<std::mutex> l{segment.lock_};
+		auto it = segment.index_.find(url);
+		if(it == segment.index_.end()) {
+			it = load_from_snapshot(segment, url);
+			if(it == segment.index_.end()) {
+				++segment.stats_.misses_;
+				return result;
+			}
+		}
+
+		auto & entry = *(it->second);
+		if(now >= entry.stale_until_) {
+			// Ответ не может использоваться даже как устаревший.
+			++segment.stats_.expirations_;
+			++segment.stats_.misses_;
+			segment.erase(it->second);
+			return result;
+		}
+
+		// Найденный элемент становится самым свежим в LRU-списке.
+		segment.lru_.splice(segment.lru_.begin(), segment.lru_, it->second);
+
+		result.reply_ = entry.reply_;
+		if(now < entry.fresh_until_)
+			++segment.stats_.hits_;
+		else {
+			++segment.stats_.stale_hits_;
+			if(!entry.revalidating_) {
+				entry.revalidating_ = true;
+				result.revalidate_ = true;
+			}
+		}
+
+		return result;
+	}
+
+	// Может ли ответ размером reply_size вообще поместиться в кэш.
+	// Позволяет не делать копию ответа для store(), если store()
+	// все равно ее отбросит.
+	bool accepts(const std::string & url, std::size_t reply_size) const noexcept {
+		return enabled() && entry_size(url.size(), reply_size) <= segment_capacity_;
+	}
+
+	// Удаление предыдущей версии ответа, например, когда новая версия
+	// не может быть сохранена в кэше.
+	void remove(const std::string & url) {
+		if(!enabled())
+			return;
+
+		auto & segment = segment_for(url);
+
+		std::lock_guard<std::mutex> l{segment.lock_};
+		remove_locked(segment, url);
+	}
+
+	// Сохранение очередного ответа. Если ответ не может кэшироваться,
+	// то предыдущая версия, если она есть, удаляется из кэша.
+	void store(
+			const std::string & url,
+			reply_t reply,
+			const cache_policy_t & policy) {
+		if(!enabled())
+			return;
+
+		auto & segment = segment_for(url);
+
+		std::lock_guard<std::mutex> l{segment.lock_};
+		remove_locked(segment, url);
+
+		const auto size = entry_size(url.size(), reply->size());
+		if(!policy.cacheable_ || size > segment_capacity_)
+			return;
+
+		const auto now = clock_t::now();
+		insert(segment, url, std::move(reply), size,
+				now + policy.ttl_,
+				now + policy.ttl_ + policy.stale_);
+		++segment.stats_.stores_;
+	}
+
+	// Фоновый запрос за новой версией ответа завершился неудачно.
+	// Устаревший ответ остается в кэше, а новая попытка будет
+	// предпринята при следующем обращении.
+	void revalidation_failed(const std::string & url) {
+		if(!enabled())
+			return;
+
+		auto & segment = segment_for(url);
+
+		std::lock_guard<std::mutex> l{segment.lock_};
+		const auto it = segment.index_.find(url);
+		if(it != segment.index_.end())
+			it->second->revalidating_ = false;
+	}
+
+	// Подключение снимка, сохраненного предыдущим экземпляром процесса.
+	// Должно выполняться до начала работы с кэшем.
+	void attach_snapshot(std::shared_ptr<const cache_snapshot_t> snapshot) {
+		snapshot_ = std::move(snapshot);
+	}
+
+	// Перебор всех ответов для сохранения их в снимок.
+	// Обработчик вызывается без захвата mutex-ов:
+	//
+	//   handler(url, reply, fresh_until, stale_until)
+	//
+	template<typename Handler>
+	void for_each_entry(Handler && handler) const {
+		struct item_t {
+			std::string url_;
+			reply_t reply_;
+			clock_t::time_point fresh_until_;
+			clock_t::time_point stale_until_;
+		};
+		std::vector<item_t> items;
+
+		for(auto & segment : segments_) {
+			items.clear();
+			{
+				std::lock_guard<std::mutex> l{segment.lock_};
+				items.reserve(segment.lru_.size());
+				for(const auto & entry : segment.lru_)
+					items.push_back(item_t{entry.url_, entry.reply_,
+							entry.fresh_until_, entry.stale_until_});
+			}
+
+			for(const auto & item : items)
+				handler(item.url_, *item.reply_,
+						to_system_time(item.fresh_until_),
+						to_system_time(item.stale_until_));
+		}
+	}
+
+	stats_t stats() const {
+		stats_t result;
+		for(auto & segment : segments_) {
+			std::lock_guard<std::mutex> l{segment.lock_};
+			result.hits_ += segment.stats_.hits_;
+			result.stale_hits_ += segment.stats_.stale_hits_;
+			result.misses_ += segment.stats_.misses_;
+			result.stores_ += segment.stats_.stores_;
+			result.evictions_ += segment.stats_.evictions_;
+			result.expirations_ += segment.stats_.expirations_;
+			result.snapshot_loads_ += segment.stats_.snapshot_loads_;
+			result.entries_ += segment.index_.size();
+			result.bytes_ += segment.bytes_;
+		}
+		return result;
+	}
+
+private:
+	using clock_t = std::chrono::steady_clock;
+
+	// Приблизительные накладные расходы на один элемент кэша.
+	static constexpr std::size_t entry_overhead = 128u;
+
+	struct entry_t {
+		std::string url_;
+		reply_t reply_;
+		// Сколько памяти занимает элемент.
+		std::size_t size_;
+		// До какого момента ответ свежий.
+		clock_t::time_point fresh_until_;
+		// До какого момента ответ еще может использоваться как устаревший.
+		clock_t::time_point stale_until_;
+		// Выполняется ли сейчас фоновый запрос за новой версией.
+		bool revalidating_{false};
+	};
+
+	using lru_list_t = std::list<entry_t>;
+
+	struct segment_t {
+		mutable std::mutex lock_;
+		// Самые свежие элементы находятся в начале списка.
+		lru_list_t lru_;
+		std::unordered_map<std::string, lru_list_t::iterator> index_;
+		// URL, для которых снимок больше не используется. Сюда попадают
+		// только URL, которые есть в снимке, поэтому размер множества
+		// ограничен размером снимка.
+		std::unordered_set<std::string> snapshot_consumed_;
+		std::size_t bytes_{0u};
+		stats_t stats_;
+
+		void erase(lru_list_t::iterator it) {
+			bytes_ -= it->size_;
+			index_.erase(it->url_);
+			lru_.erase(it);
+		}
+	};
+
+	std::vector<segment_t> segments_;
+	const std::size_t segment_capacity_;
+	const cache_policy_t defaults_;
+
+	// Снимок кэша, сохраненный предыдущим экземпляром процесса.
+	std::shared_ptr<const cache_snapshot_t> snapshot_;
+
+	static clock_t::time_point to_steady_time(
+			std::chrono::system_clock::time_point tp) {
+		return clock_t::now() + std::chrono::duration_cast<clock_t::duration>(
+				tp - std::chrono::system_clock::now());
+	}
+
+	static std::chrono::system_clock::time_point to_system_time(
+			clock_t::time_point tp) {
+		return std::chrono::system_clock::now() +
+				std::chrono::duration_cast<std::chrono::system_clock::duration>(
+						tp - clock_t::now());
+	}
+
+	// Попытка перенести ответ из снимка в сегмент.
+	// Должна вызываться при захваченном mutex-е сегмента.
+	using index_iterator_t =
+			std::unordered_map<std::string, lru_list_t::iterator>::iterator;
+	index_iterator_t load_from_snapshot(
+			segment_t & segment,
+			const std::string & url) {
+		const auto not_found = segment.index_.end();
+		if(!snapshot_ || segment.snapshot_consumed_.count(url))
+			return not_found;
+
+		const auto * record = snapshot_->find(url);
+		if(!record)
+			return not_found;
+		// Каждая запись снимка используется не более одного раза.
+		segment.snapshot_consumed_.insert(url);
+		if(record->stale_until_ <= std::chrono::system_clock::now())
+			return not_found;
+
+		const auto size = entry_size(url.size(), record->reply_size_);
+		if(size > segment_capacity_)
+			return not_found;
+
+		auto reply = std::make_shared<const std::string>(
+				record->reply_, record->reply_size_);
+
+		++segment.stats_.snapshot_loads_;
+		return insert(segment, url, std::move(reply), size,
+				to_steady_time(record->fresh_until_),
+				to_steady_time(record->stale_until_));
+	}
+
+	// Удаление ответа вместе с его версией в снимке.
+	// Должна вызываться при захваченном mutex-е сегмента.
+	void remove_locked(segment_t & segment, const std::string & url) {
+		const auto it = segment.index_.find(url);
+		if(it != segment.index_.end())
+			segment.erase(it->second);
+		// Версия из снимка после этого устарела, даже если новый ответ
+		// кэшировать нельзя.
+		forget_snapshot_record(segment, url);
+	}
+
+	// Запись снимка для URL больше не должна использоваться.
+	// Должна вызываться при захваченном mutex-е сегмента.
+	void forget_snapshot_record(segment_t & segment, const std::string & url) {
+		if(snapshot_ && snapshot_->find(url))
+			segment.snapshot_consumed_.insert(url);
+	}
+
+	// Помещение нового элемента в сегмент. Место для него освобождается
+	// за счет самых старых элементов.
+	// Должна вызываться при захваченном mutex-е сегмента.
+	index_iterator_t insert(
+			segment_t & segment,
+			const std::string & url,
+			reply_t reply,
+			std::size_t size,
+			clock_t::time_point fresh_until,
+			clock_t::time_point stale_until) {
+		while(segment.bytes_ + size > segment_capacity_) {
+			++segment.stats_.evictions_;
+			segment.erase(std::prev(segment.lru_.end()));
+		}
+
+		segment.lru_.push_front(entry_t{url, std::move(reply), size,
+				fresh_until, stale_until});
+		segment.bytes_ += size;
+		return segment.index_.emplace(url, segment.lru_.begin()).first;
+	}
+
+	static std::size_t entry_size(std::size_t url_size, std::size_t reply_size) noexcept {
+		// URL хранится дважды: в элементе и в индексе.
+		return 2u * url_size + reply_size + entry_overhead;
+	}
+
+	segment_t & segment_for(const std::string & url) {
+		return segments_[std::hash<std::string>{}(url) % segments_.size()];
+	}
+};
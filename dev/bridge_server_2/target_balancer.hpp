@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//
+// Распределение исходящих запросов между несколькими экземплярами
+// удаленного сервера.
+//
+// Для каждого нового запроса выбирается экземпляр, у которого меньше
+// всего незавершенных запросов (least outstanding requests), либо
+// меньший по этому же критерию из двух случайно выбранных экземпляров
+// (power of two choices).
+//
+// Экземпляры, которые подряд отвечают ошибками или отвечают заметно
+// медленнее остальных, на время исключаются из выбора (passive ejection).
+// Но исключено может быть не больше половины экземпляров, чтобы
+// при общей деградации нагрузка не свалилась на единственный экземпляр.
+//
+
+// Адрес экземпляра удаленного сервера.
+struct target_t {
+	std::string address_;
+	std::uint16_t port_;
+};
+
+// Получение адреса из строки вида host:port.
+// Если строка имеет неправильный формат, то порождается исключение.
+inline target_t parse_target(const std::string & value) {
+	const auto colon = value.rfind(':');
+	if(std::string::npos == colon || 0u == colon || value.size() - 1u == colon)
+		throw std::runtime_error("invalid target, host:port expected: " + value);
+
+	const auto port = std::stoul(value.substr(colon + 1u));
+	if(0u == port || port > std::numeric_limits<std::uint16_t>::max())
+		throw std::runtime_error("invalid target port: " + value);
+
+	return target_t{value.substr(0u, colon), static_cast<std::uint16_t>(port)};
+}
+
+// Способ выбора экземпляра.
+enum class balancing_policy_t {
+	// Экземпляр с наименьшим количеством незавершенных запросов.
+	least_outstanding,
+	// Лучший из двух случайно выбранных экземпляров.
+	power_of_two
+};
+
+// Получение способа выбора экземпляра по его имени.
+// Если имя неизвестно, то порождается исключение.
+inline balancing_policy_t parse_balancing_policy(const std::string & name) {
+	if("least-outstanding" == name) return balancing_policy_t::least_outstanding;
+	if("p2c" == name) return balancing_policy_t::power_of_two;
+
+	throw std::runtime_error("unknown balancing policy: " + name);
+}
+
+namespace target_balancer_details {
+
+// После скольких ошибок подряд экземпляр исключается.
+constexpr unsigned failures_to_eject = 5u;
+// Во сколько раз экземпляр должен быть медленнее самого быстрого
+// из остальных, чтобы быть исключенным.
+constexpr double latency_factor = 3.0;
+// Сколько замеров задержки нужно, чтобы по ним можно было судить
+// о скорости экземпляра.
+constexpr unsigned min_latency_samples = 20u;
+// Вес нового замера в экспоненциальном скользящем среднем задержки.
+constexpr double latency_weight = 0.1;
+// На сколько экземпляр исключается.
+constexpr std::chrono::seconds ejection_time{10};
+
+} /* namespace target_balancer_details */
+
+// Распределение запросов одной рабочей нити.
+//
+// Объект не является thread-safe, за исключением счетчиков статистики,
+// которые можно читать из любой нити.
+class target_balancer_t {
+public:
+	using clock_t = std::chrono::steady_clock;
+
+	struct stats_t {
+		std::size_t outstanding_;
+		std::uint64_t requests_;
+		std::uint64_t failures_;
+		std::uint64_t ejections_;
+		bool ejected_;
+	};
+
+	target_balancer_t(
+			const std::vector<target_t> & targets,
+			balancing_policy_t policy)
+		:	targets_{targets}
+		,	policy_{policy}
+		,	endpoints_(targets.size())
+		{}
+
+	std::size_t size() const noexcept { return targets_.size(); }
+
+	const target_t & target(std::size_t index) const noexcept {
+		return targets_[index];
+	}
+
+	// Выбор экземпляра для нового запроса. Экземпляр avoid по возможности
+	// не выбирается (это нужно для дублирующих запросов).
+	std::size_t select(std::size_t avoid = std::numeric_limits<std::size_t>::max()) {
+		const auto now = clock_t::now();
+
+		candidates_.clear();
+		for(std::size_t i = 0u; i != endpoints_.size(); ++i)
+			if(i != avoid && available(i, now))
+				candidates_.push_back(i);
+		// Если выбирать не из чего, то годится любой экземпляр.
+		if(candidates_.empty())
+			for(std::size_t i = 0u; i != endpoints_.size(); ++i)
+				candidates_.push_back(i);
+
+		if(balancing_policy_t::power_of_two == policy_ && candidates_.size() > 2u) {
+			// Два разных случайных кандидата.
+			const auto n = candidates_.size();
+			const auto i = std::uniform_int_distribution<std::size_t>{0u, n - 1u}(random_);
+			auto j = std::uniform_int_distribution<std::size_t>{0u, n - 2u}(random_);
+			if(j >= i)
+				++j;
+			const auto first = candidates_[i];
+			const auto second = candidates_[j];
+			return outstanding(second) < outstanding(first) ? second : first;
+		}
+
+		// При равенстве счетчиков выбор начинается каждый раз с нового
+		// места, чтобы запросы не доставались всегда первому экземпляру.
+		const auto offset = next_offset_++;
+		auto best = candidates_[offset % candidates_.size()];
+		for(std::size_t n = 1u; n != candidates_.size(); ++n) {
+			const auto i = candidates_[(offset + n) % candidates_.size()];
+			if(outstanding(i) < outstanding(best))
+				best = i;
+		}
+		return best;
+	}
+
+	// Запрос к экземпляру index начался.
+	void on_start(std::size_t index) noexcept {
+		auto & e = endpoints_[index];
+		e.outstanding_.store(e.outstanding_.load(std::memory_order_relaxed) + 1u,
+				std::memory_order_relaxed);
+		e.requests_.fetch_add(1u, std::memory_order_relaxed);
+	}
+
+	// Запрос к экземпляру index прерван нами самими. О состоянии
+	// экземпляра это ничего не говорит.
+	void on_cancel(std::size_t index) noexcept {
+		auto & e = endpoints_[index];
+		e.outstanding_.store(e.outstanding_.load(std::memory_order_relaxed) - 1u,
+				std::memory_order_relaxed);
+	}
+
+	// Запрос к экземпляру index завершился.
+	void on_complete(
+			std::size_t index,
+			bool failed,
+			clock_t::duration latency) {
+		using namespace target_balancer_details;
+
+		on_cancel(index);
+
+		auto & e = endpoints_[index];
+		const auto now = clock_t::now();
+		// Результаты запросов, начатых до окончания исключения,
+		// уже не учитываются.
+		if(e.ejected_until_ > now)
+			return;
+
+		if(failed) {
+			e.failures_.fetch_add(1u, std::memory_order_relaxed);
+			if(++e.consecutive_failures_ >= failures_to_eject)
+				try_eject(index, now);
+			return;
+		}
+
+		e.consecutive_failures_ = 0u;
+		const double ms = std::chrono::duration<double, std::milli>(latency).count();
+		e.latency_ms_ = e.latency_samples_ ?
+				e.latency_ms_ + latency_weight * (ms - e.latency_ms_) : ms;
+		if(++e.latency_samples_ >= min_latency_samples && is_outlier(index, now))
+			try_eject(index, now);
+	}
+
+	stats_t stats(std::size_t index) const noexcept {
+		const auto & e = endpoints_[index];
+		return {
+			e.outstanding_.load(std::memory_order_relaxed),
+			e.requests_.load(std::memory_order_relaxed),
+			e.failures_.load(std::memory_order_relaxed),
+			e.ejections_.load(std::memory_order_relaxed),
+			e.ejected_.load(std::memory_order_relaxed)
+		};
+	}
+
+private:
+	struct endpoint_t {
+		std::atomic<std::size_t> outstanding_{0u};
+		std::atomic<std::uint64_t> requests_{0u};
+		std::atomic<std::uint64_t> failures_{0u};
+		std::atomic<std::uint64_t> ejections_{0u};
+		std::atomic<bool> ejected_{false};
+
+		unsigned consecutive_failures_{0u};
+		double latency_ms_{0.0};
+		unsigned latency_samples_{0u};
+		clock_t::time_point ejected_until_{};
+	};
+
+	const std::vector<target_t> targets_;
+	const balancing_policy_t policy_;
+	std::vector<endpoint_t> endpoints_;
+
+	std::vector<std::size_t> candidates_;
+	std::size_t next_offset_{0u};
+	std::minstd_rand random_{std::random_device{}()};
+
+	std::size_t outstanding(std::size_t index) const noexcept {
+		return endpoints_[index].outstanding_.load(std::memory_order_relaxed);
+	}
+
+	// Может ли экземпляр выбираться. Заодно возвращает в строй
+	// экземпляры, время исключения которых истекло.
+	bool available(std::size_t index, clock_t::time_point now) noexcept {
+		auto & e = endpoints_[index];
+		if(!e.ejected_.load(std::memory_order_relaxed))
+			return true;
+		if(e.ejected_until_ > now)
+			return false;
+
+		// Все, что было известно об экземпляре, устарело.
+		e.ejected_.store(false, std::memory_order_relaxed);
+		e.consecutive_failures_ = 0u;
+		e.latency_samples_ = 0u;
+		return true;
+	}
+
+	// Является ли экземпляр заметно более медленным, чем самый
+	// быстрый из остальных.
+	bool is_outlier(std::size_t index, clock_t::time_point now) noexcept {
+		using namespace target_balancer_details;
+
+		double fastest = std::numeric_limits<double>::max();
+		for(std::size_t i = 0u; i != endpoints_.size(); ++i) {
+			const auto & e = endpoints_[i];
+			if(i != index && available(i, now) &&
+					e.latency_samples_ >= min_latency_samples)
+				fastest = std::min(fastest, e.latency_ms_);
+		}
+
+		return fastest != std::numeric_limits<double>::max() &&
+				endpoints_[index].latency_ms_ > latency_factor * fastest;
+	}
+
+	void try_eject(std::size_t index, clock_t::time_point now) noexcept {
+		std::size_t ejected{0u};
+		for(std::size_t i = 0u; i != endpoints_.size(); ++i)
+			if(!available(i, now))
+				++ejected;
+		// Исключено может быть не больше половины экземпляров.
+		if(2u * (ejected + 1u) > endpoints_.size())
+			return;
+
+		auto & e = endpoints_[index];
+		e.ejected_.store(true, std::memory_order_relaxed);
+		e.ejected_until_ = now + target_balancer_details::ejection_time;
+		e.ejections_.fetch_add(1u, std::memory_order_relaxed);
+	}
+};
@@ -33,6 +33,15 @@ MxxRu::Cpp::composite_target( MxxRu::BUILD_ROOT ) {
 	required_prj 'delay_server/prj.rb'
 	required_prj 'bridge_server_1/prj.rb'
 	required_prj 'bridge_server_1_pipe/prj.rb'
+	required_prj 'bridge_server_1_poll/prj.rb'
 	required_prj 'bridge_server_2/prj.rb'
+
+	required_prj 'load_generator/prj.rb'
+	required_prj 'bridge_bench/prj.rb'
+
+	required_prj 'timer_wheel_bench/prj.rb'
+	required_prj 'handoff_bench/prj.rb'
+
+	required_prj 'response_cache_test/prj.rb'
 }
 
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include <fmt/format.h>
+
+#include <restinio/all.hpp>
+
+#include <common/response_headers.hpp>
+
+//
+// Ограничение количества исходящих запросов, которые находятся в обработке
+// или ждут своей очереди.
+//
+// Перед тем, как передать запрос на обработку, обработчик HTTP-запросов
+// пытается получить у admission_controller_t разрешение (admission_ticket_t).
+// Разрешение хранится вместе с информацией о запросе и возвращается
+// автоматически, когда эта информация уничтожается. Если лимит исчерпан,
+// то разрешение не выдается и на запрос нужно сразу ответить 503.
+//
+
+class admission_controller_t;
+
+// Разрешение на обработку одного исходящего запроса.
+// Это Moveable, но не Copyable класс.
+class admission_ticket_t {
+	friend class admission_controller_t;
+
+	admission_controller_t * owner_{nullptr};
+
+	explicit admission_ticket_t(admission_controller_t * owner) noexcept
+		:	owner_{owner}
+		{}
+
+public:
+	admission_ticket_t() noexcept = default;
+	~admission_ticket_t() noexcept { release(); }
+
+	admission_ticket_t(const admission_ticket_t &) = delete;
+	admission_ticket_t & operator=(const admission_ticket_t &) = delete;
+
+	admission_ticket_t(admission_ticket_t && o) noexcept
+		:	owner_{o.owner_} {
+		o.owner_ = nullptr;
+	}
+	admission_ticket_t & operator=(admission_ticket_t && o) noexcept {
+		if(this != &o) {
+			release();
+			owner_ = o.owner_;
+			o.owner_ = nullptr;
+		}
+		return *this;
+	}
+
+	// Было ли выдано разрешение?
+	explicit operator bool() const noexcept { return nullptr != owner_; }
+
+	// Досрочный возврат разрешения.
+	inline void release() noexcept;
+};
+
+// Счетчик исходящих запросов и выдача разрешений на их обработку.
+//
+// Все методы thread-safe: разрешения выдаются на нити HTTP-сервера,
+// а возвращаться могут на других нитях.
+class admission_controller_t {
+	friend class admission_ticket_t;
+
+	// Максимальное количество исходящих запросов. 0 означает отсутствие
+	// ограничения.
+	const std::size_t limit_;
+
+	// Сколько запросов сейчас находится в обработке и в очереди.
+	std::atomic<std::size_t> in_flight_{0u};
+
+	// Сколько запросов было принято и сколько отвергнуто.
+	std::atomic<std::uint64_t> accepted_{0u};
+	std::atomic<std::uint64_t> shed_{0u};
+
+	void release() noexcept {
+		in_flight_.fetch_sub(1u, std::memory_order_release);
+	}
+
+public:
+	explicit admission_controller_t(std::size_t limit) : limit_{limit} {}
+
+	// Это не Copyable и не Moveable класс.
+	admission_controller_t(const admission_controller_t &) = delete;
+	admission_controller_t(admission_controller_t &&) = delete;
+
+	// Попытка получить разрешение на обработку очередного запроса.
+	// Если лимит исчерпан, то возвращается пустое разрешение.
+	admission_ticket_t try_admit() noexcept {
+		const auto previous = in_flight_.fetch_add(1u, std::memory_order_acquire);
+		if(0u != limit_ && previous >= limit_) {
+			release();
+			shed_.fetch_add(1u, std::memory_order_relaxed);
+			return admission_ticket_t{};
+		}
+
+		accepted_.fetch_add(1u, std::memory_order_relaxed);
+		return admission_ticket_t{this};
+	}
+
+	std::size_t limit() const noexcept { return limit_; }
+
+	std::size_t in_flight() const noexcept {
+		return in_flight_.load(std::memory_order_relaxed);
+	}
+
+	std::uint64_t accepted() const noexcept {
+		return accepted_.load(std::memory_order_relaxed);
+	}
+
+	std::uint64_t shed() const noexcept {
+		return shed_.load(std::memory_order_relaxed);
+	}
+};
+
+inline void admission_ticket_t::release() noexcept {
+	if(owner_) {
+		owner_->release();
+		owner_ = nullptr;
+	}
+}
+
+// Немедленный ответ на запрос, который не может быть принят из-за
+// перегрузки.
+inline restinio::request_handling_status_t reject_overloaded(
+		const restinio::request_handle_t & req,
+		std::chrono::seconds retry_after) {
+	auto response = req->create_response(503, "Service Unavailable");
+	append_common_headers(response);
+	response.append_header(restinio::http_field::retry_after,
+			std::to_string(retry_after.count()));
+	response.set_body("Service overloaded, try again later\n");
+
+	return response.done();
+}
+
+// Формирование ответа со значениями счетчиков.
+inline restinio::request_handling_status_t reply_admission_stats(
+		const restinio::request_handle_t & req,
+		std::size_t limit,
+		std::size_t in_flight,
+		std::uint64_t accepted,
+		std::uint64_t shed) {
+	auto response = req->create_response();
+	append_common_headers(response);
+	response.set_body(
+			fmt::format("limit: {}\nin_flight: {}\naccepted: {}\nshed: {}\n",
+				limit, in_flight, accepted, shed));
+
+	return response.done();
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <curl/curl.h>
+
+//
+// Повторное использование curl_easy-объектов.
+//
+// Создание curl_easy на каждый исходящий запрос и его уничтожение после
+// завершения запроса обходятся в несколько аллокаций и в повторную
+// установку одних и тех же опций. Поэтому завершившиеся curl_easy
+// возвращаются в пул и затем выдаются для новых запросов.
+//
+// Кроме того, все curl_easy используют общий CURLSH, через который
+// разделяется кэш DNS.
+//
+
+// Обертка вокруг CURLSH, который может использоваться сразу
+// из нескольких нитей.
+//
+// Кэш соединений через CURLSH не разделяется: libcurl не поддерживает
+// совместное использование соединений из разных нитей. Соединения
+// переиспользуются через кэш соединений curl_multi, который у каждой
+// рабочей нити свой.
+class curl_share_t {
+	CURLSH * share_;
+
+	// Для каждого вида разделяемых данных собственный mutex.
+	std::array<std::mutex, CURL_LOCK_DATA_LAST> locks_;
+
+	static void lock_function(
+			CURL *, curl_lock_data data, curl_lock_access, void * userptr) {
+		reinterpret_cast<curl_share_t *>(userptr)->locks_[data].lock();
+	}
+
+	static void unlock_function(CURL *, curl_lock_data data, void * userptr) {
+		reinterpret_cast<curl_share_t *>(userptr)->locks_[data].unlock();
+	}
+
+public:
+	curl_share_t() : share_{curl_share_init()} {
+		curl_share_setopt(share_, CURLSHOPT_LOCKFUNC,
+				&curl_share_t::lock_function);
+		curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC,
+				&curl_share_t::unlock_function);
+		curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+
+		curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	}
+	~curl_share_t() {
+		curl_share_cleanup(share_);
+	}
+
+	// Это не Copyable и не Moveable класс.
+	curl_share_t(const curl_share_t &) = delete;
+	curl_share_t(curl_share_t &&) = delete;
+
+	CURLSH * handle() const noexcept { return share_; }
+};
+
+// Пул curl_easy-объектов.
+//
+// Опции, которые одинаковы для всех запросов, устанавливаются один раз
+// при создании curl_easy посредством configurator. При повторном
+// использовании curl_easy эти опции сохраняются, поэтому для очередного
+// запроса достаточно установить только те опции, которые зависят от
+// запроса (URL, CURLOPT_PRIVATE и т.п.). Такие опции должны
+// устанавливаться для каждого запроса, иначе будут использованы значения,
+// оставшиеся от предыдущего запроса.
+//
+// Пул не является thread-safe, поэтому у каждой рабочей нити
+// с curl_multi должен быть собственный пул.
+class curl_easy_pool_t {
+public:
+	// Тип функции для установки общих для всех запросов опций.
+	using configurator_t = std::function<void(CURL *)>;
+
+	curl_easy_pool_t(
+			CURLSH * share,
+			configurator_t configurator,
+			// Сколько свободных curl_easy может храниться в пуле.
+			std::size_t max_free = 4096u)
+		:	share_{share}
+		,	configurator_{std::move(configurator)}
+		,	max_free_{max_free}
+		{}
+	~curl_easy_pool_t() {
+		for(auto h : free_)
+			curl_easy_cleanup(h);
+	}
+
+	// Это не Copyable и не Moveable класс.
+	curl_easy_pool_t(const curl_easy_pool_t &) = delete;
+	curl_easy_pool_t(curl_easy_pool_t &&) = delete;
+
+	// Получение curl_easy для очередного запроса.
+	CURL * acquire() {
+		if(!free_.empty()) {
+			auto h = free_.back();
+			free_.pop_back();
+			return h;
+		}
+
+		auto h = curl_easy_init();
+		if(share_)
+			curl_easy_setopt(h, CURLOPT_SHARE, share_);
+		if(configurator_)
+			configurator_(h);
+		return h;
+	}
+
+	// Возврат curl_easy, который уже не участвует в curl_multi.
+	void release(CURL * h) {
+		if(free_.size() < max_free_)
+			free_.push_back(h);
+		else
+			curl_easy_cleanup(h);
+	}
+
+private:
+	CURLSH * const share_;
+	const configurator_t configurator_;
+	const std::size_t max_free_;
+
+	// Свободные curl_easy.
+	std::vector<CURL *> free_;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+//
+// Объединение одинаковых исходящих запросов.
+//
+// Если к одному и тому же URL одновременно обращаются сразу несколько
+// клиентов, то к удаленному серверу уходит только первый запрос
+// (лидер). Остальные запросы присоединяются к лидеру как ожидающие и
+// получают ответ, когда завершится запрос лидера.
+//
+
+// Реестр исходящих запросов, которые выполняются в данный момент.
+//
+// Реестр не является thread-safe, поэтому у каждой рабочей нити
+// с curl_multi должен быть собственный реестр. По этой же причине
+// объединяются только те запросы, которые попали на одну нить.
+template<typename T>
+class inflight_registry_t {
+	std::unordered_map<std::string, T *> inflight_;
+
+public:
+	// Поиск уже выполняющегося запроса к url.
+	// Если такого запроса нет, то leader регистрируется в качестве
+	// выполняющегося запроса и возвращается nullptr.
+	T * find_or_register(const std::string & url, T * leader) {
+		const auto it = inflight_.find(url);
+		if(it != inflight_.end())
+			return it->second;
+
+		inflight_.emplace(url, leader);
+		return nullptr;
+	}
+
+	// Запрос к url завершился.
+	void remove(const std::string & url) {
+		inflight_.erase(url);
+	}
+
+	std::size_t size() const noexcept { return inflight_.size(); }
+};
@@ -0,0 +1,407 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <restinio/all.hpp>
+
+//
+// Буфер для ответа удаленного сервера.
+//
+// Если удаленный сервер сообщил размер ответа в заголовке Content-Length,
+// то память под весь ответ выделяется сразу одним блоком. Иначе ответ
+// собирается из блоков фиксированного размера, которые берутся из пула
+// и возвращаются в него после использования. В любом случае уже
+// полученные данные никогда не копируются при поступлении новых.
+//
+// Блоки находятся под shared_ptr, поэтому их можно передать в RESTinio
+// в качестве частей тела ответа без копирования. Причем один и тот же
+// буфер может использоваться для формирования сразу нескольких ответов.
+//
+// Слишком большие ответы в памяти не держатся: как только размер ответа
+// превышает заданный порог, уже полученные данные сбрасываются во
+// временный файл, в который затем пишутся и все последующие данные.
+// Файл удаляется из каталога сразу после создания, поэтому он исчезнет
+// сам, когда будет закрыт последний его дескриптор. Клиенту содержимое
+// такого файла отдается через sendfile, т.е. без копирования в память
+// процесса.
+//
+
+// Параметры сброса больших ответов во временный файл.
+struct reply_spill_params_t {
+	// Ответы, которые больше этого размера, сохраняются во временном
+	// файле. 0 означает, что ответы всегда хранятся в памяти.
+	std::size_t threshold_{8u * 1024u * 1024u};
+	// Каталог для временных файлов.
+	std::string directory_{"/tmp"};
+};
+
+namespace reply_buffer_details {
+
+// Блок памяти для части ответа.
+class block_t {
+public:
+	block_t(std::unique_ptr<char[]> data, std::size_t capacity)
+		:	data_{std::move(data)}, capacity_{capacity}
+		{}
+
+	// Методы, которые нужны RESTinio для использования блока
+	// в качестве части тела ответа.
+	const char * data() const noexcept { return data_.get(); }
+	std::size_t size() const noexcept { return size_; }
+
+	std::size_t capacity() const noexcept { return capacity_; }
+	std::size_t free_space() const noexcept { return capacity_ - size_; }
+
+	// Дописать в блок столько данных, сколько в нем поместится.
+	// Возвращается количество записанных байт.
+	std::size_t append(const char * what, std::size_t size) noexcept {
+		const auto n = std::min(size, free_space());
+		std::memcpy(data_.get() + size_, what, n);
+		size_ += n;
+		return n;
+	}
+
+	std::unique_ptr<char[]> release_data() noexcept { return std::move(data_); }
+
+private:
+	std::unique_ptr<char[]> data_;
+	const std::size_t capacity_;
+	std::size_t size_{0u};
+};
+
+// Размер блоков, которые используются, если размер ответа неизвестен.
+constexpr std::size_t pooled_block_size = 16u * 1024u;
+// Сколько свободных блоков может храниться в пуле одной нити.
+constexpr std::size_t max_pooled_blocks = 1024u;
+
+// Пул памяти для блоков фиксированного размера.
+//
+// У каждой нити собственный пул, и блок всегда возвращается в пул той
+// нити, которая его выделила. Это важно, т.к. в вариантах bridge_server_1
+// блоки выделяются на нити curl_multi, а освобождаются на нити RESTinio
+// после отправки ответа. Если бы блок возвращался в пул освобождающей
+// нити, то пул нити curl_multi никогда бы не пополнялся.
+//
+// Своя нить возвращает блоки в локальный стек без синхронизации. Чужие
+// нити помещают их в lock-free список, который владелец забирает целиком,
+// когда локальный стек опустеет. Звеньями списка служат сами блоки:
+// указатель на следующий блок хранится в начале памяти блока.
+class block_pool_t {
+public:
+	~block_pool_t() {
+		for(char * data = remote_.exchange(nullptr); data; )
+			delete[] std::exchange(data, next_of(data));
+	}
+
+	// Должен вызываться только на нити-владельце.
+	std::unique_ptr<char[]> acquire() {
+		if(local_.empty())
+			drain_remote();
+
+		if(local_.empty())
+			return std::unique_ptr<char[]>{new char[pooled_block_size]};
+
+		auto data = std::move(local_.back());
+		local_.pop_back();
+		return data;
+	}
+
+	// Может вызываться на любой нити.
+	void release(std::unique_ptr<char[]> data) noexcept {
+		if(this == &current()) {
+			if(local_.size() < max_pooled_blocks) {
+				try {
+					local_.push_back(std::move(data));
+				}
+				catch(...) {}
+			}
+			return;
+		}
+
+		char * item = data.release();
+		char * old_head = remote_.load(std::memory_order_relaxed);
+		do {
+			next_of(item) = old_head;
+		} while(!remote_.compare_exchange_weak(old_head, item,
+				std::memory_order_release,
+				std::memory_order_relaxed));
+	}
+
+	// Пул текущей нити. Пул живет, пока живы выделенные из него блоки,
+	// даже если сама нить уже завершилась.
+	static const std::shared_ptr<block_pool_t> & current_ptr() {
+		thread_local const auto pool = std::make_shared<block_pool_t>();
+		return pool;
+	}
+
+	static block_pool_t & current() { return *current_ptr(); }
+
+private:
+	std::vector<std::unique_ptr<char[]>> local_;
+	std::atomic<char *> remote_{nullptr};
+
+	static char *& next_of(char * data) noexcept {
+		return *reinterpret_cast<char **>(data);
+	}
+
+	void drain_remote() {
+		for(char * data = remote_.exchange(nullptr, std::memory_order_acquire);
+				data; ) {
+			std::unique_ptr<char[]> block{std::exchange(data, next_of(data))};
+			if(local_.size() < max_pooled_blocks)
+				local_.push_back(std::move(block));
+		}
+	}
+};
+
+// Удаление блока фиксированного размера с возвратом его памяти в пул
+// нити, которая выделила блок.
+struct pooled_block_deleter_t {
+	std::shared_ptr<block_pool_t> owner_;
+
+	void operator()(block_t * block) const noexcept {
+		owner_->release(block->release_data());
+		delete block;
+	}
+};
+
+inline std::shared_ptr<block_t> make_pooled_block() {
+	const auto & pool = block_pool_t::current_ptr();
+	return std::shared_ptr<block_t>{
+			new block_t{pool->acquire(), pooled_block_size},
+			pooled_block_deleter_t{pool}};
+}
+
+inline std::shared_ptr<block_t> make_exact_block(std::size_t capacity) {
+	return std::make_shared<block_t>(
+			std::unique_ptr<char[]>{new char[capacity]}, capacity);
+}
+
+// Временный файл, в который сбрасывается большой ответ.
+class spill_file_t {
+public:
+	explicit spill_file_t(int fd) : fd_{fd} {}
+	~spill_file_t() { ::close(fd_); }
+
+	// Это не Copyable и не Moveable класс.
+	spill_file_t(const spill_file_t &) = delete;
+	spill_file_t(spill_file_t &&) = delete;
+
+	int fd() const noexcept { return fd_; }
+
+	// Запись всех данных в конец файла.
+	bool write(const char * what, std::size_t size) noexcept {
+		while(size) {
+			const auto n = ::write(fd_, what, size);
+			if(n < 0) {
+				if(EINTR == errno)
+					continue;
+				return false;
+			}
+			what += n;
+			size -= static_cast<std::size_t>(n);
+		}
+		return true;
+	}
+
+private:
+	const int fd_;
+};
+
+// Создание безымянного временного файла в каталоге directory.
+// Если файл создать не удалось, то возвращается -1.
+inline int make_unlinked_temp_file(const std::string & directory) {
+#if defined(O_TMPFILE)
+	// Файл без имени сразу создается ядром.
+	const int fd = ::open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if(-1 != fd)
+		return fd;
+#endif
+	// Не все файловые системы поддерживают O_TMPFILE, поэтому файл
+	// может создаваться обычным образом и сразу же удаляться.
+	std::string name = directory + "/bridge_reply_XXXXXX";
+	const int tmp_fd = ::mkstemp(&name[0]);
+	if(-1 != tmp_fd) {
+		::unlink(name.c_str());
+		::fcntl(tmp_fd, F_SETFD, FD_CLOEXEC);
+	}
+	return tmp_fd;
+}
+
+} /* namespace reply_buffer_details */
+
+class reply_buffer_t {
+public:
+	// Максимальный объем памяти, который может быть выделен одним
+	// блоком на основании заголовка Content-Length.
+	static constexpr std::size_t max_reserve = 64u * 1024u * 1024u;
+
+	reply_buffer_t() = default;
+	// Буфер, который может сбрасывать большие ответы во временный файл.
+	// Объект spill должен жить дольше буфера.
+	explicit reply_buffer_t(const reply_spill_params_t & spill)
+		:	spill_{0u != spill.threshold_ ? &spill : nullptr}
+		{}
+
+	// Удаленный сервер сообщил, что ответ будет иметь размер size.
+	// Учитывается только если данные еще не поступали.
+	void expect(std::size_t size) {
+		if(!blocks_.empty() || file_ || 0u == size)
+			return;
+
+		// Такой большой ответ лучше сразу писать в файл.
+		if(spill_ && size > spill_->threshold_ && try_spill())
+			return;
+
+		if(size <= max_reserve)
+			blocks_.push_back(reply_buffer_details::make_exact_block(size));
+	}
+
+	// Если возвращается false, то данные сохранить не удалось
+	// (например, из-за нехватки места на диске).
+	bool append(const char * what, std::size_t size) {
+		if(!file_ && spill_ && size_ + size > spill_->threshold_)
+			try_spill();
+
+		if(file_) {
+			if(!file_->write(what, size))
+				return false;
+			size_ += size;
+			return true;
+		}
+
+		while(size) {
+			if(blocks_.empty() || 0u == blocks_.back()->free_space())
+				blocks_.push_back(reply_buffer_details::make_pooled_block());
+
+			const auto n = blocks_.back()->append(what, size);
+			what += n;
+			size -= n;
+			size_ += n;
+		}
+		return true;
+	}
+
+	std::size_t size() const noexcept { return size_; }
+
+	// Находятся ли данные во временном файле?
+	bool spilled() const noexcept { return static_cast<bool>(file_); }
+
+	// Добавление всех блоков в тело ответа без копирования.
+	// Содержимое временного файла передается через sendfile. Каждый ответ
+	// получает собственную копию дескриптора, которую RESTinio закроет
+	// после отправки ответа.
+	template<typename Response_Builder>
+	void append_to(Response_Builder & response) const {
+		if(file_) {
+			if(!size_)
+				return;
+			const int fd = ::dup(file_->fd());
+			if(-1 == fd)
+				throw std::runtime_error("unable to dup spill file descriptor");
+			response.append_body(restinio::sendfile(
+					fd, restinio::file_meta_t{size_, {}}));
+			return;
+		}
+
+		for(const auto & block : blocks_)
+			if(block->size())
+				response.append_body(block);
+	}
+
+	// Копия всего содержимого буфера одной строкой. Нужна только для
+	// сохранения ответа в кэше bridge_server_2, т.е. лишь когда кэш включен
+	// и готов принять ответ. Клиенту ответ всегда отдается блоками.
+	std::string to_string() const {
+		std::string result;
+		if(file_) {
+			result.resize(size_);
+			std::size_t offset = 0u;
+			while(offset != size_) {
+				const auto n = ::pread(file_->fd(), &result[offset],
+						size_ - offset, static_cast<off_t>(offset));
+				if(n < 0 && EINTR == errno)
+					continue;
+				if(n <= 0)
+					throw std::runtime_error("unable to read spill file");
+				offset += static_cast<std::size_t>(n);
+			}
+			return result;
+		}
+
+		result.reserve(size_);
+		for(const auto & block : blocks_)
+			result.append(block->data(), block->size());
+		return result;
+	}
+
+private:
+	// Параметры сброса во временный файл. Если сброс не нужен или
+	// не удался, то здесь nullptr.
+	const reply_spill_params_t * spill_{nullptr};
+
+	std::vector<std::shared_ptr<reply_buffer_details::block_t>> blocks_;
+	std::size_t size_{0u};
+
+	// Временный файл с данными, если был выполнен сброс.
+	std::shared_ptr<reply_buffer_details::spill_file_t> file_;
+
+	// Попытка перенести уже полученные данные во временный файл.
+	// Если попытка не удалась, то данные остаются в памяти и повторные
+	// попытки для этого буфера не делаются.
+	bool try_spill() {
+		const auto spill = spill_;
+		spill_ = nullptr;
+
+		const int fd = reply_buffer_details::make_unlinked_temp_file(
+				spill->directory_);
+		if(-1 == fd)
+			return false;
+
+		auto file = std::make_shared<reply_buffer_details::spill_file_t>(fd);
+		for(const auto & block : blocks_)
+			if(!file->write(block->data(), block->size()))
+				return false;
+
+		blocks_.clear();
+		file_ = std::move(file);
+		return true;
+	}
+};
+
+// Попытка извлечь значение Content-Length из строки заголовка,
+// которую libcurl передает в CURLOPT_HEADERFUNCTION.
+inline bool parse_content_length(
+		const char * line, std::size_t size, std::size_t & value) {
+	static const char name[] = "content-length:";
+	constexpr std::size_t name_size = sizeof(name) - 1u;
+	if(size <= name_size)
+		return false;
+	for(std::size_t i = 0u; i != name_size; ++i)
+		if(std::tolower(static_cast<unsigned char>(line[i])) != name[i])
+			return false;
+
+	std::size_t i = name_size;
+	while(i != size && (' ' == line[i] || '\t' == line[i]))
+		++i;
+	if(i == size || !std::isdigit(static_cast<unsigned char>(line[i])))
+		return false;
+
+	value = 0u;
+	for(; i != size && std::isdigit(static_cast<unsigned char>(line[i])); ++i)
+		value = value * 10u + static_cast<std::size_t>(line[i] - '0');
+	return true;
+}
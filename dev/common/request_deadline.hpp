@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+#include <restinio/all.hpp>
+
+#include <curl/curl.h>
+
+#include <common/response_headers.hpp>
+
+//
+// Ограничение времени обработки запроса.
+//
+// Момент, до которого на запрос должен быть дан ответ, фиксируется при
+// получении запроса. Все, что происходит дальше (ожидание в очереди,
+// обращение к удаленному серверу), должно уложиться в этот срок. Поэтому
+// для исходящего запроса устанавливается таймаут, равный оставшемуся
+// времени, а если время истекло еще до обращения к удаленному серверу,
+// то клиенту сразу же отдается 504.
+//
+// Таймаут libcurl учитывает и время, пока получение ответа приостановлено.
+// Поэтому в режиме streaming bridge_server_2 ограничивает сроком только
+// время до начала передачи ответа клиенту (см. stream_progress_callback).
+//
+
+class request_deadline_t {
+public:
+	using clock_t = std::chrono::steady_clock;
+
+	// Запрос без ограничения времени.
+	request_deadline_t() = default;
+
+	// Запрос, который должен быть обработан за timeout.
+	// Нулевой timeout означает отсутствие ограничения.
+	static request_deadline_t after(std::chrono::milliseconds timeout) {
+		request_deadline_t result;
+		if(timeout.count() > 0)
+			result.expires_at_ = clock_t::now() + timeout;
+		return result;
+	}
+
+	bool unlimited() const noexcept {
+		return clock_t::time_point::max() == expires_at_;
+	}
+
+	bool expired() const {
+		return !unlimited() && clock_t::now() >= expires_at_;
+	}
+
+	// Сколько времени еще осталось. Для истекшего срока возвращается 0.
+	std::chrono::milliseconds remaining() const {
+		using namespace std::chrono;
+		const auto now = clock_t::now();
+		return now < expires_at_ ?
+				duration_cast<milliseconds>(expires_at_ - now) :
+				milliseconds::zero();
+	}
+
+	// Установка таймаута для исходящего запроса. Должна выполняться
+	// для каждого запроса, т.к. curl_easy используются повторно.
+	void apply_to(CURL * h) const {
+		long timeout_ms{0};
+		if(!unlimited())
+			// Таймаут 0 для libcurl означает его отсутствие, поэтому
+			// меньше 1ms он быть не должен.
+			timeout_ms = std::max<long>(1, static_cast<long>(remaining().count()));
+		curl_easy_setopt(h, CURLOPT_TIMEOUT_MS, timeout_ms);
+	}
+
+private:
+	clock_t::time_point expires_at_{clock_t::time_point::max()};
+};
+
+// Ответ на запрос, который не удалось обработать за отведенное время.
+inline restinio::request_handling_status_t reply_gateway_timeout(
+		const restinio::request_handle_t & req) {
+	auto response = req->create_response(504, "Gateway Timeout");
+	append_common_headers(response);
+	response.set_body("Target service didn't respond in time\n");
+
+	return response.done();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <ctime>
+#include <string>
+
+#include <restinio/all.hpp>
+
+//
+// Заранее подготовленные общие заголовки ответов.
+//
+// Значения статических заголовков (Server и Content-Type) создаются
+// один раз на все время работы, а значение заголовка Date формируется
+// не чаще одного раза в секунду на каждой рабочей нити. Поэтому при
+// создании очередного ответа форматировать нужно только его тело.
+//
+
+// Значение заголовка Date для текущего момента времени.
+// Кэш значения у каждой нити свой, поэтому синхронизация не нужна.
+inline const std::string & cached_date_field_value() {
+	struct cache_t {
+		std::time_t formatted_at_{-1};
+		std::string value_;
+	};
+	thread_local cache_t cache;
+
+	const auto now = std::time(nullptr);
+	if(now != cache.formatted_at_) {
+		cache.value_ = restinio::make_date_field_value(now);
+		cache.formatted_at_ = now;
+	}
+
+	return cache.value_;
+}
+
+// Добавление в ответ заголовков Server, Date и Content-Type.
+template<typename Response_Builder>
+Response_Builder & append_common_headers(Response_Builder & response) {
+	static const std::string server{"RESTinio hello world server"};
+	static const std::string content_type{"text/plain; charset=utf-8"};
+
+	response.append_header(restinio::http_field::server, server);
+	response.append_header(restinio::http_field::date, cached_date_field_value());
+	response.append_header(restinio::http_field::content_type, content_type);
+
+	return response;
+}
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <restinio/all.hpp>
+
+#include <curl/curl.h>
+
+#include <common/response_headers.hpp>
+
+//
+// Время, которое запросы проводят на отдельных стадиях обработки.
+//
+// Для каждого запроса фиксируются моменты его получения, передачи на
+// нить curl_multi, передачи в curl_multi, установления соединения,
+// получения первого байта ответа и завершения. Моменты установления
+// соединения и получения первого байта берутся из статистики libcurl.
+//
+// По этим моментам вычисляются длительности стадий, которые
+// накапливаются в гистограммах с логарифмической шкалой (как в
+// HdrHistogram): каждая степень двойки делится на 32 интервала, поэтому
+// погрешность не превышает 3% при любом значении. У каждой нити curl_multi
+// собственные гистограммы, в которые пишет только она. Поэтому запись
+// обходится без блокировок и без атомарных read-modify-write операций,
+// а читать гистограммы можно из любой нити.
+//
+// Содержимое гистограмм отдается в текстовом формате Prometheus.
+//
+
+// Стадии обработки запроса.
+enum class request_stage_t : std::size_t {
+	// От получения запроса до передачи его на нить curl_multi.
+	admission,
+	// Ожидание на нити curl_multi до передачи в curl_multi.
+	queue,
+	// Установление соединения с удаленным сервером (включая DNS).
+	connect,
+	// Ожидание первого байта ответа от удаленного сервера.
+	backend,
+	// Получение ответа от первого до последнего байта.
+	transfer,
+	// От получения запроса до завершения исходящего запроса.
+	total
+};
+
+namespace stage_metrics_details {
+
+constexpr std::size_t stage_count =
+		static_cast<std::size_t>(request_stage_t::total) + 1u;
+
+// Имена стадий для метрик.
+constexpr std::array<const char *, stage_count> stage_names{{
+		"admission", "queue", "connect", "backend", "transfer", "total" }};
+
+// Каждая степень двойки делится на 2^sub_bucket_bits интервалов.
+constexpr unsigned sub_bucket_bits = 5u;
+constexpr std::uint64_t sub_bucket_count = 1u << sub_bucket_bits;
+// Максимальное учитываемое значение, мкс (около 19 часов).
+// Все, что больше, попадает в последний интервал.
+constexpr unsigned max_value_bits = 36u;
+constexpr std::uint64_t max_value = (std::uint64_t{1} << max_value_bits) - 1u;
+constexpr std::size_t bucket_count =
+		(max_value_bits - sub_bucket_bits + 1u) * sub_bucket_count;
+
+// Номер интервала для значения value.
+inline std::size_t bucket_index(std::uint64_t value) noexcept {
+	if(value > max_value)
+		value = max_value;
+	// Значения меньше 2*sub_bucket_count учитываются точно.
+	if(value < 2u * sub_bucket_count)
+		return static_cast<std::size_t>(value);
+
+	unsigned shift{0u};
+	while((value >> shift) >= 2u * sub_bucket_count)
+		++shift;
+	return static_cast<std::size_t>((shift + 1u) * sub_bucket_count +
+			((value >> shift) - sub_bucket_count));
+}
+
+// Наименьшее значение, попадающее в интервал index.
+inline std::uint64_t bucket_lowest_value(std::size_t index) noexcept {
+	if(index < 2u * sub_bucket_count)
+		return index;
+
+	const auto shift = index / sub_bucket_count - 1u;
+	return (sub_bucket_count + index % sub_bucket_count) << shift;
+}
+
+// Границы интервалов гистограммы Prometheus, мкс.
+constexpr std::array<std::uint64_t, 16> prometheus_bounds{{
+		100u, 250u, 500u,
+		1000u, 2500u, 5000u,
+		10000u, 25000u, 50000u,
+		100000u, 250000u, 500000u,
+		1000000u, 2500000u, 5000000u,
+		10000000u }};
+
+// Перцентили, которые отдаются в дополнение к гистограмме.
+constexpr std::array<double, 4> quantiles{{ 0.5, 0.9, 0.99, 0.999 }};
+
+} /* namespace stage_metrics_details */
+
+// Моменты прохождения запросом стадий обработки.
+// Значение по умолчанию означает, что стадия не пройдена.
+struct stage_timestamps_t {
+	using clock_t = std::chrono::steady_clock;
+
+	clock_t::time_point accepted_;
+	clock_t::time_point enqueued_;
+	clock_t::time_point dispatched_;
+	clock_t::time_point connected_;
+	clock_t::time_point first_byte_;
+	clock_t::time_point completed_;
+
+	// Запрос только что получен.
+	static stage_timestamps_t accepted_now() {
+		stage_timestamps_t result;
+		result.accepted_ = clock_t::now();
+		return result;
+	}
+
+	// Запрос передан на нить curl_multi.
+	void mark_enqueued() { enqueued_ = clock_t::now(); }
+
+	// Исходящий запрос передан в curl_multi.
+	void mark_dispatched() { dispatched_ = clock_t::now(); }
+
+	// Исходящий запрос завершился. Моменты установления соединения и
+	// получения первого байта отсчитываются libcurl от начала запроса.
+	void mark_completed(CURL * handle) {
+		completed_ = clock_t::now();
+
+		std::chrono::microseconds connect, start_transfer;
+#if LIBCURL_VERSION_NUM >= 0x073d00
+		curl_off_t connect_us{0}, start_transfer_us{0};
+		curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect_us);
+		curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &start_transfer_us);
+		connect = std::chrono::microseconds{connect_us};
+		start_transfer = std::chrono::microseconds{start_transfer_us};
+#else
+		double connect_s{0.0}, start_transfer_s{0.0};
+		curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME, &connect_s);
+		curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME, &start_transfer_s);
+		connect = std::chrono::microseconds{
+				static_cast<std::chrono::microseconds::rep>(connect_s * 1e6)};
+		start_transfer = std::chrono::microseconds{
+				static_cast<std::chrono::microseconds::rep>(start_transfer_s * 1e6)};
+#endif
+		// Нули означают, что до этой стадии дело не дошло.
+		if(connect.count() > 0)
+			connected_ = dispatched_ + connect;
+		if(start_transfer.count() > 0)
+			first_byte_ = dispatched_ + start_transfer;
+	}
+};
+
+// Гистограмма длительностей в микросекундах.
+//
+// Писать в гистограмму может только одна нить, а читать -- любые.
+class latency_histogram_t {
+public:
+	// Копия содержимого одной или нескольких гистограмм.
+	struct snapshot_t {
+		std::vector<std::uint64_t> counts_ =
+				std::vector<std::uint64_t>(stage_metrics_details::bucket_count);
+		std::uint64_t count_{0u};
+		std::uint64_t sum_us_{0u};
+
+		// Значение, меньше которого не более quantile от всех значений.
+		std::uint64_t value_at_quantile(double quantile) const noexcept {
+			if(!count_)
+				return 0u;
+			const auto target = static_cast<std::uint64_t>(quantile * count_);
+			std::uint64_t seen{0u};
+			for(std::size_t i = 0u; i != counts_.size(); ++i) {
+				seen += counts_[i];
+				if(seen > target)
+					return stage_metrics_details::bucket_lowest_value(i);
+			}
+			return stage_metrics_details::max_value;
+		}
+	};
+
+	void record(std::uint64_t value_us) noexcept {
+		increment(counts_[stage_metrics_details::bucket_index(value_us)], 1u);
+		increment(count_, 1u);
+		increment(sum_us_, value_us);
+	}
+
+	// Добавление содержимого гистограммы к snapshot.
+	void add_to(snapshot_t & snapshot) const {
+		for(std::size_t i = 0u; i != stage_metrics_details::bucket_count; ++i)
+			snapshot.counts_[i] += counts_[i].load(std::memory_order_relaxed);
+		snapshot.count_ += count_.load(std::memory_order_relaxed);
+		snapshot.sum_us_ += sum_us_.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::uint64_t> counts_[stage_metrics_details::bucket_count]{};
+	std::atomic<std::uint64_t> count_{0u};
+	std::atomic<std::uint64_t> sum_us_{0u};
+
+	// Писатель только один, поэтому fetch_add не нужен.
+	static void increment(std::atomic<std::uint64_t> & v, std::uint64_t delta) noexcept {
+		v.store(v.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+	}
+};
+
+// Гистограммы стадий обработки для одной нити curl_multi.
+class stage_metrics_t {
+public:
+	using snapshot_t = std::array<
+			latency_histogram_t::snapshot_t, stage_metrics_details::stage_count>;
+
+	// Учет всех стадий, которые прошел запрос.
+	void record(const stage_timestamps_t & ts) noexcept {
+		record(request_stage_t::admission, ts.accepted_, ts.enqueued_);
+		record(request_stage_t::queue, ts.enqueued_, ts.dispatched_);
+		record(request_stage_t::connect, ts.dispatched_, ts.connected_);
+		record(request_stage_t::backend,
+				ts.connected_ != stage_timestamps_t::clock_t::time_point{} ?
+						ts.connected_ : ts.dispatched_,
+				ts.first_byte_);
+		record(request_stage_t::transfer, ts.first_byte_, ts.completed_);
+		record(request_stage_t::total, ts.accepted_, ts.completed_);
+	}
+
+	// Добавление содержимого гистограмм к snapshot.
+	void add_to(snapshot_t & snapshot) const {
+		for(std::size_t i = 0u; i != stage_metrics_details::stage_count; ++i)
+			histograms_[i].add_to(snapshot[i]);
+	}
+
+private:
+	latency_histogram_t histograms_[stage_metrics_details::stage_count];
+
+	void record(
+			request_stage_t stage,
+			stage_timestamps_t::clock_t::time_point from,
+			stage_timestamps_t::clock_t::time_point to) noexcept {
+		const stage_timestamps_t::clock_t::time_point none{};
+		if(none == from || none == to || to < from)
+			return;
+		histograms_[static_cast<std::size_t>(stage)].record(
+				static_cast<std::uint64_t>(
+						std::chrono::duration_cast<std::chrono::microseconds>(
+								to - from).count()));
+	}
+};
+
+// Текстовое представление гистограмм в формате Prometheus.
+inline std::string make_prometheus_metrics(const stage_metrics_t::snapshot_t & snapshot) {
+	using namespace stage_metrics_details;
+
+	std::string result =
+			"# HELP bridge_request_stage_seconds Time spent by requests "
+			"in each processing stage.\n"
+			"# TYPE bridge_request_stage_seconds histogram\n";
+	for(std::size_t s = 0u; s != stage_count; ++s) {
+		const auto & h = snapshot[s];
+		// Значение относится к интервалу Prometheus, если к нему относится
+		// нижняя граница интервала гистограммы, в который оно попало.
+		std::uint64_t cumulative{0u};
+		std::size_t bucket{0u};
+		for(const auto bound : prometheus_bounds) {
+			for(; bucket != bucket_count && bucket_lowest_value(bucket) <= bound; ++bucket)
+				cumulative += h.counts_[bucket];
+			result += fmt::format(
+					"bridge_request_stage_seconds_bucket{{stage=\"{}\",le=\"{}\"}} {}\n",
+					stage_names[s], bound / 1e6, cumulative);
+		}
+		result += fmt::format(
+				"bridge_request_stage_seconds_bucket{{stage=\"{}\",le=\"+Inf\"}} {}\n"
+				"bridge_request_stage_seconds_sum{{stage=\"{}\"}} {:.6f}\n"
+				"bridge_request_stage_seconds_count{{stage=\"{}\"}} {}\n",
+				stage_names[s], h.count_,
+				stage_names[s], h.sum_us_ / 1e6,
+				stage_names[s], h.count_);
+	}
+
+	result +=
+			"# HELP bridge_request_stage_quantile_seconds Quantiles of time "
+			"spent by requests in each processing stage.\n"
+			"# TYPE bridge_request_stage_quantile_seconds gauge\n";
+	for(std::size_t s = 0u; s != stage_count; ++s)
+		for(const auto q : quantiles)
+			result += fmt::format(
+					"bridge_request_stage_quantile_seconds"
+					"{{stage=\"{}\",quantile=\"{}\"}} {:.6f}\n",
+					stage_names[s], q, snapshot[s].value_at_quantile(q) / 1e6);
+
+	return result;
+}
+
+// Ответ со значениями метрик, собранными со всех нитей.
+inline restinio::request_handling_status_t reply_prometheus_metrics(
+		const restinio::request_handle_t & req,
+		const stage_metrics_t::snapshot_t & snapshot) {
+	auto response = req->create_response();
+	append_common_headers(response);
+	response.set_body(make_prometheus_metrics(snapshot));
+
+	return response.done();
+}
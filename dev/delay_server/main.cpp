@@ -1,6 +1,10 @@
 #include <iostream>
 #include <cstdint>
 #include <random>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
 
 #include <restinio/all.hpp>
 
@@ -8,6 +12,11 @@
 
 #include <fmt/format.h>
 
+#include <common/response_headers.hpp>
+
+#include "pauses_generator.hpp"
+#include "timer_wheel.hpp"
+
 using std::chrono::milliseconds;
 
 // Конфигурация, которая потребуется серверу.
@@ -22,10 +31,46 @@ struct config_t {
 	// Максимальная величина задержки перед выдачей ответа.
 	milliseconds max_pause_{6000};
 
+	// Распределение, из которого берутся задержки.
+	pause_distribution_t distribution_{pause_distribution_t::uniform};
+	// Параметры распределений (см. pauses_params_t).
+	double mean_pause_{5000.0};
+	double sigma_{0.5};
+	double alpha_{1.5};
+	// Файл с записанными задержками для empirical.
+	std::string latencies_file_;
+	// Файл с трассой задержек для replay.
+	std::string trace_file_;
+
+	// Размер тела ответа в байтах. Если 0, то в ответе будет только
+	// короткое текстовое сообщение.
+	std::size_t body_size_{0};
+	// Максимальный размер тела ответа. Если он больше body_size_, то размер
+	// тела для каждого ответа выбирается случайно из [body_size_, max_body_size_].
+	std::size_t max_body_size_{0};
+
+	// Время, в течение которого тело ответа отдается по частям
+	// (chunked transfer encoding). Если 0, то тело отдается целиком.
+	milliseconds stream_window_{0};
+	// Размер одной части тела при отдаче по частям.
+	std::size_t chunk_size_{16 * 1024};
+
+	// Количество рабочих нитей сервера.
+	// Если нитей больше одной, то сервер работает на пуле нитей.
+	std::size_t threads_{1};
+
+	// Нужно ли использовать колесо таймеров вместо отдельного
+	// Asio-таймера для каждого запроса?
+	bool timer_wheel_{false};
+
 	// Нужно ли включать трассировку?
 	bool tracing_{false};
 };
 
+// Размер блока, которым заполняется тело ответа.
+// Он же является максимальным размером одной части тела при отдаче по частям.
+constexpr std::size_t filler_block_size = 1024u * 1024u;
+
 // Разбор аргументов командной строки.
 // В случае неудачи порождается исключение.
 auto parse_cmd_line_args(int argc, char ** argv) {
@@ -36,6 +81,8 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 	result_t result;
 	long min_pause{result.config_.min_pause_.count()};
 	long max_pause{result.config_.max_pause_.count()};
+	std::string distribution{"uniform"};
+	long stream_window{result.config_.stream_window_.count()};
 
 	// Подготавливаем парсер аргументов командной строки.
 	using namespace clara;
@@ -45,9 +92,50 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 		| Opt(result.config_.port_, "port")["-p"]["--port"]
 				("port to listen (default: 8090)")
 		| Opt(min_pause, "minimal pause")["-m"]["--min-pause"]
-				("minimal pause before response, milliseconds")
+				(fmt::format("minimal pause before response, milliseconds "
+						"(default: {})", min_pause))
 		| Opt(max_pause, "maximum pause")["-M"]["--max-pause"]
-				("maximal pause before response, milliseconds")
+				(fmt::format("maximal pause before response, milliseconds "
+						"(default: {}); for exponential, lognormal and pareto "
+						"the tail above it is cut off, so raise it to keep "
+						"the heavy tail", max_pause))
+		| Opt(distribution, "distribution")["-d"]["--distribution"]
+				("distribution of pauses: uniform, exponential, lognormal, "
+				 "pareto, empirical, replay (default: uniform); "
+				 "pauses are always clamped to [min-pause, max-pause]")
+		| Opt(result.config_.mean_pause_, "mean pause")["--mean-pause"]
+				(fmt::format("mean pause for exponential and lognormal "
+						"distributions, milliseconds (default: {})",
+						result.config_.mean_pause_))
+		| Opt(result.config_.sigma_, "sigma")["--sigma"]
+				(fmt::format("sigma of lognormal distribution (default: {})",
+						result.config_.sigma_))
+		| Opt(result.config_.alpha_, "alpha")["--alpha"]
+				(fmt::format("shape of pareto distribution, min-pause is "
+						"used as scale (default: {})",
+						result.config_.alpha_))
+		| Opt(result.config_.latencies_file_, "file")["--latencies"]
+				("file with recorded latencies for empirical distribution, "
+				 "each line is: latency_ms [count]")
+		| Opt(result.config_.trace_file_, "file")["--trace"]
+				("file with latency trace for replay, "
+				 "each line is: YYYY/MM/DD latency_ms")
+		| Opt(result.config_.body_size_, "bytes")["-b"]["--body-size"]
+				("size of response body, bytes (default: short text message)")
+		| Opt(result.config_.max_body_size_, "bytes")["-B"]["--max-body-size"]
+				("if greater than body-size then size of response body is "
+				 "picked uniformly from [body-size, max-body-size]")
+		| Opt(stream_window, "stream window")["-s"]["--stream-window"]
+				("send response body in chunks spread over this time, "
+				 "milliseconds (default: 0, no streaming)")
+		| Opt(result.config_.chunk_size_, "bytes")["--chunk-size"]
+				(fmt::format("size of one chunk in streaming mode, bytes "
+						"(default: {})", result.config_.chunk_size_))
+		| Opt(result.config_.threads_, "threads")["-n"]["--threads"]
+				("number of worker threads; without --timer-wheel all threads "
+				"share one timer queue (default: 1)")
+		| Opt(result.config_.timer_wheel_)["-w"]["--timer-wheel"]
+				("use timer wheel instead of timer per request (default: OFF)")
 		| Opt(result.config_.tracing_)["-t"]["--tracing"]
 				("turn server tracing ON (default: OFF)")
 		| Help(result.help_requested_);
@@ -70,6 +158,31 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 		if(max_pause < min_pause)
 			throw std::runtime_error("minimal pause can't be less than "
 					"maximum pause");
+		if(0u == result.config_.threads_)
+			throw std::runtime_error("number of worker threads can't be 0");
+
+		if(stream_window < 0)
+			throw std::runtime_error("stream window can't be less than 0");
+		if(0u == result.config_.chunk_size_
+				|| result.config_.chunk_size_ > filler_block_size)
+			throw std::runtime_error(fmt::format(
+					"chunk size must be in range [1, {}]", filler_block_size));
+
+		result.config_.stream_window_ = milliseconds{stream_window};
+		result.config_.distribution_ = parse_pause_distribution(distribution);
+		if(result.config_.mean_pause_ <= 0.0)
+			throw std::runtime_error("mean pause must be greater than 0");
+		if(result.config_.sigma_ <= 0.0)
+			throw std::runtime_error("sigma must be greater than 0");
+		if(result.config_.alpha_ <= 0.0)
+			throw std::runtime_error("alpha must be greater than 0");
+		if(pause_distribution_t::empirical == result.config_.distribution_
+				&& result.config_.latencies_file_.empty())
+			throw std::runtime_error("empirical distribution requires "
+					"--latencies file");
+		if(pause_distribution_t::replay == result.config_.distribution_
+				&& result.config_.trace_file_.empty())
+			throw std::runtime_error("replay requires --trace file");
 
 		result.config_.min_pause_ = milliseconds{min_pause};
 		result.config_.max_pause_ = milliseconds{max_pause};
@@ -78,44 +191,264 @@ auto parse_cmd_line_args(int argc, char ** argv) {
 	return result;
 }
 
-// Вспомогательный тип для генерации случайных задержек.
-class pauses_generator_t {
+// Подготовка параметров для генераторов задержек.
+// Если нужно, то загружаются файлы с гистограммой или трассой задержек.
+// Загруженные данные разделяются между генераторами всех рабочих нитей.
+pauses_params_t make_pauses_params(const config_t & config) {
+	pauses_params_t params;
+	params.distribution_ = config.distribution_;
+	params.min_pause_ = config.min_pause_;
+	params.max_pause_ = config.max_pause_;
+	params.mean_ = config.mean_pause_;
+	params.sigma_ = config.sigma_;
+	params.alpha_ = config.alpha_;
+
+	if(pause_distribution_t::empirical == config.distribution_)
+		params.histogram_ = load_latency_histogram(config.latencies_file_);
+	if(pause_distribution_t::replay == config.distribution_)
+		params.trace_ = load_latency_trace(config.trace_file_);
+
+	return params;
+}
+
+// Получение ключа даты из параметров запроса.
+// Регулярное выражение маршрута гарантирует, что в значениях
+// параметров будут только цифры.
+template<typename Route_Params>
+std::uint32_t date_key_from(const Route_Params & params) {
+	const auto to_number = [](const auto & value) {
+		std::uint32_t result{0};
+		for(const char ch : value)
+			result = result * 10u + static_cast<std::uint32_t>(ch - '0');
+		return result;
+	};
+
+	return make_date_key(
+			to_number(params["year"]),
+			to_number(params["month"]),
+			to_number(params["day"]));
+}
+
+// Вспомогательный тип для выбора размеров тел ответов.
+class body_sizes_generator_t {
 	std::mt19937 generator_{std::random_device{}()};
-	std::uniform_int_distribution<long> distrib_;
-	const milliseconds minimal_;
+	std::uniform_int_distribution<std::size_t> distrib_;
+public:
+	body_sizes_generator_t(std::size_t min, std::size_t max)
+		:	distrib_{min, std::max(min, max)}
+		{}
+
+	auto next() { return distrib_(generator_); }
+};
+
+// Блок, которым заполняется тело ответа. Создается один раз и затем
+// отдается во всех ответах без копирования.
+const std::string & filler_block() {
+	static const std::string block = [] {
+			static const char pattern[] =
+					"0123456789abcdefghijklmnopqrstuvwxyz"
+					"ABCDEFGHIJKLMNOPQRSTUVWXYZ+-=*/!?#\n";
+			std::string result;
+			result.reserve(filler_block_size);
+			while(result.size() < filler_block_size)
+				result.append(pattern, sizeof(pattern) - 1u);
+			result.resize(filler_block_size);
+			return result;
+		}();
+
+	return block;
+}
+
+// Информация о запросе, задержка для которого истекает.
+struct pending_response_t {
+	restinio::request_handle_t req_;
+	milliseconds pause_{};
+	// Сколько байт должно быть в теле ответа.
+	std::size_t body_size_{0};
+};
+
+// Ответ, тело которого отдается частями через равные промежутки времени.
+class chunked_stream_t
+	:	public std::enable_shared_from_this<chunked_stream_t> {
+	restinio::response_builder_t<restinio::chunked_output_t> response_;
+	restinio::asio_ns::steady_timer timer_;
+	// Сколько байт тела еще предстоит отдать.
+	std::size_t remaining_;
+	const std::size_t chunk_size_;
+	// Интервал между отдачей соседних частей.
+	const std::chrono::steady_clock::duration interval_;
+
+	void send_next_chunk() {
+		const auto size = std::min(remaining_, chunk_size_);
+		response_.append_chunk(
+				restinio::const_buffer(filler_block().data(), size));
+		remaining_ -= size;
+
+		if(0u == remaining_) {
+			response_.done();
+			return;
+		}
+
+		response_.flush();
+		timer_.expires_after(interval_);
+		timer_.async_wait([self = shared_from_this()](const auto & ec) {
+				if(!ec)
+					self->send_next_chunk();
+			});
+	}
+
 public:
-	pauses_generator_t(milliseconds min, milliseconds max)
-		:	distrib_{0, (max - min).count()}
-		,	minimal_{min}
+	chunked_stream_t(
+			restinio::asio_ns::io_context & ioctx,
+			restinio::response_builder_t<restinio::chunked_output_t> response,
+			std::size_t remaining,
+			std::size_t chunk_size,
+			milliseconds window)
+		:	response_{std::move(response)}
+		,	timer_{ioctx}
+		,	remaining_{remaining}
+		,	chunk_size_{chunk_size}
+		,	interval_{window / std::max<std::size_t>(1u,
+				(remaining + chunk_size - 1u) / chunk_size)}
 		{}
 
-	auto next() {
-		return minimal_ + milliseconds{distrib_(generator_)};
+	void start() {
+		// Заголовок и все, что уже есть в теле, уходит сразу.
+		response_.flush();
+		if(0u == remaining_)
+			response_.done();
+		else {
+			timer_.expires_after(interval_);
+			timer_.async_wait([self = shared_from_this()](const auto & ec) {
+					if(!ec)
+						self->send_next_chunk();
+				});
+		}
+	}
+};
+
+// Генерация ответа на запрос, задержка для которого уже истекла.
+void send_response(
+		restinio::asio_ns::io_context & ioctx,
+		const config_t & config,
+		const pending_response_t & pending) {
+	auto text = fmt::format("Hello world!\nPause: {}ms.\n", pending.pause_.count());
+	// Сколько байт нужно добавить к тексту, чтобы получить тело
+	// нужного размера.
+	const auto filler_size = pending.body_size_ > text.size() ?
+			pending.body_size_ - text.size() : 0u;
+
+	if(milliseconds::zero() != config.stream_window_) {
+		// Тело должно отдаваться по частям.
+		auto response = pending.req_->create_response<restinio::chunked_output_t>();
+		append_common_headers(response).append_chunk(std::move(text));
+
+		std::make_shared<chunked_stream_t>(
+				ioctx,
+				std::move(response),
+				filler_size,
+				config.chunk_size_,
+				config.stream_window_)->start();
+		return;
+	}
+
+	auto response = pending.req_->create_response();
+	append_common_headers(response).set_body(std::move(text));
+
+	// Заполнитель не копируется, а отдается прямо из общего блока.
+	for(auto remaining = filler_size; remaining; ) {
+		const auto size = std::min(remaining, filler_block_size);
+		response.append_body(restinio::const_buffer(filler_block().data(), size));
+		remaining -= size;
+	}
+
+	response.done();
+}
+
+using pending_responses_wheel_t = timer_wheel_t<pending_response_t>;
+
+// Состояние, которым владеет одна рабочая нить.
+struct worker_context_t {
+	// Генератор задержек.
+	pauses_generator_t generator_;
+	// Генератор размеров тел ответов.
+	body_sizes_generator_t body_sizes_;
+
+	// Колесо таймеров. Создается только если его использование
+	// разрешено в конфигурации.
+	std::unique_ptr<pending_responses_wheel_t> timer_wheel_;
+
+	worker_context_t(
+			restinio::asio_ns::io_context & ioctx,
+			const config_t & config,
+			const pauses_params_t & pauses_params)
+		:	generator_{pauses_params}
+		,	body_sizes_{config.body_size_, config.max_body_size_} {
+		if(config.timer_wheel_)
+			timer_wheel_ = std::make_unique<pending_responses_wheel_t>(ioctx,
+					[&ioctx, &config](pending_response_t pending) {
+						send_response(ioctx, config, pending);
+					});
+	}
+};
+
+// Набор контекстов для всех рабочих нитей.
+//
+// Все контексты создаются заранее, а каждая рабочая нить при первом
+// обращении получает в монопольное владение один из них, поэтому при
+// работе на пуле нитей генераторы задержек и колеса таймеров
+// не разделяются между нитями.
+// Сами контексты принадлежат этому объекту, а не нитям, т.к. они должны
+// быть уничтожены до того, как будет уничтожен io_context.
+class worker_contexts_t {
+	std::vector<std::unique_ptr<worker_context_t>> contexts_;
+	std::atomic<std::size_t> next_free_{0};
+public:
+	worker_contexts_t(
+			restinio::asio_ns::io_context & ioctx,
+			const config_t & config,
+			const pauses_params_t & pauses_params) {
+		for(std::size_t i = 0; i != config.threads_; ++i)
+			contexts_.push_back(std::make_unique<worker_context_t>(
+					ioctx, config, pauses_params));
+	}
+
+	worker_context_t & this_thread_context() {
+		thread_local worker_context_t * context{nullptr};
+		if(!context)
+			context = contexts_.at(next_free_++).get();
+		return *context;
 	}
 };
 
 // Реализация обработчика запросов.
 restinio::request_handling_status_t handler(
 		restinio::asio_ns::io_context & ioctx,
-		pauses_generator_t & generator,
-		restinio::request_handle_t req) {
+		const config_t & config,
+		worker_context_t & context,
+		restinio::request_handle_t req,
+		std::uint32_t date_key) {
 	// Выполняем задержку на случайную величину (но в заданных пределах).
-	const auto pause = generator.next();
-	// Для отсчета задержки используем Asio-таймеры.
-	auto timer = std::make_shared<restinio::asio_ns::steady_timer>(ioctx);
-	timer->expires_after(pause);
-	timer->async_wait([timer, req, pause](const auto & ec) {
-			if(!ec) {
-				// Таймер успешно сработал, можно генерировать ответ.
-				req->create_response()
-					.append_header(restinio::http_field::server, "RESTinio hello world server")
-					.append_header_date_field()
-					.append_header(restinio::http_field::content_type, "text/plain; charset=utf-8")
-					.set_body(
-						fmt::format("Hello world!\nPause: {}ms.\n", pause.count()))
-					.done();
-			}
-		} );
+	const auto pause = context.generator_.next(date_key);
+	pending_response_t pending{
+			std::move(req), pause, context.body_sizes_.next()};
+	if(context.timer_wheel_) {
+		// Запрос будет ждать истечения задержки в колесе таймеров.
+		context.timer_wheel_->schedule(pause, std::move(pending));
+	}
+	else {
+		// Для отсчета задержки используем Asio-таймеры. Они принадлежат
+		// общему для всех нитей io_context, поэтому при работе на пуле
+		// нитей все запросы проходят через одну очередь таймеров.
+		auto timer = std::make_shared<restinio::asio_ns::steady_timer>(ioctx);
+		timer->expires_after(pause);
+		timer->async_wait(
+			[timer, &ioctx, &config, pending = std::move(pending)](const auto & ec) {
+				if(!ec)
+					// Таймер успешно сработал, можно генерировать ответ.
+					send_response(ioctx, config, pending);
+			} );
+	}
 
 	// Подтверждаем, что мы приняли запрос к обработке и что когда-то
 	// мы ответ сгенерируем.
@@ -126,7 +459,7 @@ restinio::request_handling_status_t handler(
 // для нужного типа.
 using express_router_t = restinio::router::express_router_t<>;
 
-// Так же нам потребуются два вспомогательных типа свойств для http-сервера.
+// Так же нам потребуются вспомогательные типы свойств для http-сервера.
 
 // Первый тип для случая, когда трассировка сервера не нужна.
 struct non_traceable_server_traits_t : public restinio::default_single_thread_traits_t {
@@ -139,11 +472,25 @@ struct traceable_server_traits_t : public restinio::default_single_thread_traits
 	using logger_t = restinio::single_threaded_ostream_logger_t;
 };
 
+// Еще два типа нужны для работы на пуле нитей. Они отличаются от
+// предыдущих тем, что базируются на многопоточных свойствах и используют
+// thread-safe логгер.
+struct non_traceable_pool_server_traits_t : public restinio::default_traits_t {
+	using request_handler_t = express_router_t;
+};
+
+struct traceable_pool_server_traits_t : public restinio::default_traits_t {
+	using request_handler_t = express_router_t;
+	using logger_t = restinio::shared_ostream_logger_t;
+};
+
 // Вспомогательная функция, которая отвечает за запуск сервера нужного типа.
-template<typename Server_Traits, typename Handler>
+// Параметр settings -- это результат on_this_thread или on_thread_pool.
+template<typename Settings, typename Handler>
 void run_server(
 		restinio::asio_ns::io_context & ioctx,
 		const config_t & config,
+		Settings && settings,
 		Handler && handler) {
 	// Сперва создадим и настроим объект express-роутера.
 	auto router = std::make_unique<express_router_t>();
@@ -154,16 +501,19 @@ void run_server(
 	// На все остальное будем отвечать 404.
 	router->non_matched_request_handler([](auto req) {
 			return req->create_response(404, "Not found")
-					.append_header_date_field()
+					.append_header(restinio::http_field::date,
+							cached_date_field_value())
 					.connection_close()
 					.done();
 		});
 
 	restinio::run(ioctx,
-			restinio::on_this_thread<Server_Traits>()
+			std::forward<Settings>(settings)
 				.address(config.address_)
 				.port(config.port_)
-				.handle_request_timeout(config.max_pause_)
+				// При отдаче тела по частям ответ формируется дольше
+				// на величину stream_window.
+				.handle_request_timeout(config.max_pause_ + config.stream_window_)
 				.request_handler(std::move(router)));
 }
 
@@ -177,26 +527,59 @@ int main(int argc, char ** argv) {
 		// работать напрямую в обработчике запросов.
 		restinio::asio_ns::io_context ioctx;
 
-		// Так же нам потребуется генератор случайных задержек в выдаче ответов.
-		pauses_generator_t generator{cfg.config_.min_pause_, cfg.config_.max_pause_};
+		// Состояние рабочих нитей (генераторы задержек и, если нужно,
+		// колеса таймеров).
+		worker_contexts_t contexts{
+				ioctx, cfg.config_, make_pauses_params(cfg.config_)};
 
 		// Нам нужен обработчик запросов, который будет использоваться
 		// вне зависимости от того, какой именно сервер мы будем запускать
-		// (с трассировкой происходящего или нет).
-		auto actual_handler = [&ioctx, &generator](auto req, auto /*params*/) {
-				return handler(ioctx, generator, std::move(req));
+		// (с трассировкой происходящего или нет, на одной нити или на пуле).
+		// Свое состояние обработчик берет у той нити, на которой он
+		// был вызван.
+		auto actual_handler = [&ioctx, &cfg, &contexts](auto req, auto params) {
+				return handler(ioctx,
+						cfg.config_,
+						contexts.this_thread_context(),
+						std::move(req),
+						date_key_from(params));
 			};
 
-		// Если должна использоваться трассировка запросов, то должен
-		// запускаться один тип сервера.
-		if(cfg.config_.tracing_) {
-			run_server<traceable_server_traits_t>(
-					ioctx, cfg.config_, std::move(actual_handler));
+		if(1u == cfg.config_.threads_) {
+			// Если должна использоваться трассировка запросов, то должен
+			// запускаться один тип сервера.
+			if(cfg.config_.tracing_) {
+				run_server(ioctx, cfg.config_,
+						restinio::on_this_thread<traceable_server_traits_t>(),
+						std::move(actual_handler));
+			}
+			else {
+				// Трассировка не нужна, запускается другой тип сервера.
+				run_server(ioctx, cfg.config_,
+						restinio::on_this_thread<non_traceable_server_traits_t>(),
+						std::move(actual_handler));
+			}
 		}
 		else {
-			// Трассировка не нужна, запускается другой тип сервера.
-			run_server<non_traceable_server_traits_t>(
-					ioctx, cfg.config_, std::move(actual_handler));
+			// Сервер должен работать на пуле нитей. Все нити пула
+			// обслуживают общий io_context, но генераторы задержек
+			// у каждой нити свои. Без колеса таймеров Asio-таймеры всех
+			// запросов попадают в общую очередь таймеров io_context-а,
+			// за которую нити конкурируют. С --timer-wheel у каждой нити
+			// свое колесо, а в общей очереди остается только по одному
+			// таймеру тика на нить.
+			if(cfg.config_.tracing_) {
+				run_server(ioctx, cfg.config_,
+						restinio::on_thread_pool<traceable_pool_server_traits_t>(
+								cfg.config_.threads_),
+						std::move(actual_handler));
+			}
+			else {
+				run_server(ioctx, cfg.config_,
+						restinio::on_thread_pool<non_traceable_pool_server_traits_t>(
+								cfg.config_.threads_),
+						std::move(actual_handler));
+			}
 		}
 
 		// Все, теперь ждем завершения работы сервера.
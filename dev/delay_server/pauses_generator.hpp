@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//
+// Генерация задержек перед выдачей ответов.
+//
+// Задержки могут браться из разных распределений (равномерного,
+// экспоненциального, логнормального, Парето), из эмпирической гистограммы,
+// загруженной из файла, или из трассы реальных задержек с разбивкой по датам.
+// В любом случае итоговая задержка ограничивается диапазоном
+// [min_pause, max_pause].
+//
+
+// Вид распределения задержек.
+enum class pause_distribution_t {
+	uniform,
+	exponential,
+	lognormal,
+	pareto,
+	empirical,
+	replay
+};
+
+// Получение вида распределения по его имени.
+// Если имя неизвестно, то порождается исключение.
+inline pause_distribution_t parse_pause_distribution(const std::string & name) {
+	if("uniform" == name) return pause_distribution_t::uniform;
+	if("exponential" == name) return pause_distribution_t::exponential;
+	if("lognormal" == name) return pause_distribution_t::lognormal;
+	if("pareto" == name) return pause_distribution_t::pareto;
+	if("empirical" == name) return pause_distribution_t::empirical;
+	if("replay" == name) return pause_distribution_t::replay;
+
+	throw std::runtime_error("unknown pause distribution: " + name);
+}
+
+// Ключ для поиска задержек конкретной даты в трассе.
+inline std::uint32_t make_date_key(
+		std::uint32_t year, std::uint32_t month, std::uint32_t day) {
+	return year * 10000u + month * 100u + day;
+}
+
+// Эмпирическая гистограмма задержек.
+struct latency_histogram_t {
+	// Значения задержек в миллисекундах.
+	std::vector<long> values_;
+	// Веса значений (сколько раз значение встретилось).
+	std::vector<double> weights_;
+};
+
+// Трасса задержек с разбивкой по датам.
+struct latency_trace_t {
+	// Задержки для каждой из дат в том порядке, в котором они
+	// встретились в трассе.
+	std::unordered_map<std::uint32_t, std::vector<long>> by_date_;
+	// Все задержки трассы. Используются для дат, которых в трассе нет.
+	std::vector<long> all_;
+};
+
+namespace pauses_details {
+
+// Открытие файла с данными о задержках.
+// В случае неудачи порождается исключение.
+inline std::ifstream open_latencies_file(const std::string & file_name) {
+	std::ifstream file{file_name};
+	if(!file)
+		throw std::runtime_error("unable to open file: " + file_name);
+	return file;
+}
+
+// Нужно ли пропустить строку из файла с данными о задержках?
+// Пропускаются пустые строки и комментарии.
+inline bool should_skip(const std::string & line) {
+	const auto pos = line.find_first_not_of(" \t\r");
+	return std::string::npos == pos || '#' == line[pos];
+}
+
+[[noreturn]] inline void throw_invalid_line(
+		const std::string & file_name, std::size_t line_number) {
+	throw std::runtime_error("invalid line " + std::to_string(line_number)
+			+ " in file: " + file_name);
+}
+
+} /* namespace pauses_details */
+
+// Загрузка эмпирической гистограммы задержек.
+//
+// Каждая строка файла содержит величину задержки в миллисекундах и,
+// возможно, количество раз, которое эта задержка встретилась:
+//
+//   # latency_ms [count]
+//   12 8000
+//   250 1500
+//   4200
+//
+// Если количество не указано, то оно считается равным единице. Поэтому
+// файл может быть просто списком записанных задержек.
+inline std::shared_ptr<const latency_histogram_t>
+load_latency_histogram(const std::string & file_name) {
+	using namespace pauses_details;
+
+	auto file = open_latencies_file(file_name);
+	auto result = std::make_shared<latency_histogram_t>();
+
+	std::string line;
+	for(std::size_t line_number = 1u; std::getline(file, line); ++line_number) {
+		if(should_skip(line))
+			continue;
+
+		std::istringstream in{line};
+		long value{0};
+		double weight{1.0};
+		if(!(in >> value) || value < 0)
+			throw_invalid_line(file_name, line_number);
+		// Количество считается не указанным, только если после задержки
+		// в строке ничего нет. Иначе строка вроде "250 1,5" была бы молча
+		// загружена с количеством 1.
+		if(!(in >> std::ws).eof() &&
+				(!(in >> weight) || weight < 0.0 || !(in >> std::ws).eof()))
+			throw_invalid_line(file_name, line_number);
+
+		result->values_.push_back(value);
+		result->weights_.push_back(weight);
+	}
+
+	if(result->values_.empty())
+		throw std::runtime_error("no latencies in file: " + file_name);
+	// std::discrete_distribution не определено для нулевых весов.
+	if(std::all_of(result->weights_.begin(), result->weights_.end(),
+			[](double w) { return 0.0 == w; }))
+		throw std::runtime_error("all latencies have zero count in file: "
+				+ file_name);
+
+	return result;
+}
+
+// Загрузка трассы задержек.
+//
+// Каждая строка файла содержит дату (в виде YYYY/MM/DD или YYYY-MM-DD)
+// и величину задержки для запроса к этой дате в миллисекундах:
+//
+//   # date latency_ms
+//   2018/02/21 4312
+//   2018/02/21 180
+//   2017-12-31 5120
+inline std::shared_ptr<const latency_trace_t>
+load_latency_trace(const std::string & file_name) {
+	using namespace pauses_details;
+
+	auto file = open_latencies_file(file_name);
+	auto result = std::make_shared<latency_trace_t>();
+
+	std::string line;
+	for(std::size_t line_number = 1u; std::getline(file, line); ++line_number) {
+		if(should_skip(line))
+			continue;
+
+		std::istringstream in{line};
+		std::uint32_t year{0}, month{0}, day{0};
+		char sep1{0}, sep2{0};
+		long value{0};
+		if(!(in >> year >> sep1 >> month >> sep2 >> day >> value)
+				|| ('/' != sep1 && '-' != sep1)
+				|| ('/' != sep2 && '-' != sep2)
+				|| value < 0)
+			throw_invalid_line(file_name, line_number);
+
+		result->by_date_[make_date_key(year, month, day)].push_back(value);
+		result->all_.push_back(value);
+	}
+
+	if(result->all_.empty())
+		throw std::runtime_error("no latencies in file: " + file_name);
+
+	return result;
+}
+
+// Параметры, определяющие способ генерации задержек.
+struct pauses_params_t {
+	pause_distribution_t distribution_{pause_distribution_t::uniform};
+
+	// Границы, в которые должна попадать любая задержка.
+	std::chrono::milliseconds min_pause_{4000};
+	std::chrono::milliseconds max_pause_{6000};
+
+	// Среднее значение задержки для exponential и lognormal, миллисекунды.
+	double mean_{5000.0};
+	// Среднеквадратичное отклонение логарифма задержки для lognormal.
+	double sigma_{0.5};
+	// Показатель степени для pareto. Масштабом служит min_pause.
+	double alpha_{1.5};
+
+	// Гистограмма для empirical.
+	std::shared_ptr<const latency_histogram_t> histogram_;
+	// Трасса для replay.
+	std::shared_ptr<const latency_trace_t> trace_;
+};
+
+// Вспомогательный тип для генерации случайных задержек.
+//
+// Объект этого типа не является thread-safe, поэтому у каждой рабочей
+// нити должен быть собственный генератор. Данные гистограммы и трассы
+// при этом разделяются между генераторами, т.к. они только читаются.
+class pauses_generator_t {
+	using milliseconds = std::chrono::milliseconds;
+
+	std::mt19937 generator_{std::random_device{}()};
+
+	const pauses_params_t params_;
+
+	std::uniform_int_distribution<long> uniform_;
+	std::exponential_distribution<double> exponential_;
+	std::lognormal_distribution<double> lognormal_;
+	std::uniform_real_distribution<double> unit_{0.0, 1.0};
+	std::discrete_distribution<std::size_t> empirical_;
+
+	// Текущие позиции в трассе для каждой из дат.
+	std::unordered_map<std::uint32_t, std::size_t> replay_positions_;
+	std::size_t replay_all_position_{0u};
+
+	// Значение ограничивается до округления, т.к. распределения с тяжелым
+	// хвостом могут дать величину, не представимую в long (например,
+	// inf у pareto при U -> 1).
+	milliseconds clamp(double value) const {
+		const auto min = static_cast<double>(params_.min_pause_.count());
+		const auto max = static_cast<double>(params_.max_pause_.count());
+		if(!(value > min))
+			return params_.min_pause_;
+		if(!(value < max))
+			return params_.max_pause_;
+		return milliseconds{static_cast<long>(std::llround(value))};
+	}
+
+	long next_from_trace(std::uint32_t date_key) {
+		const auto & trace = *params_.trace_;
+		const auto it = trace.by_date_.find(date_key);
+		if(it == trace.by_date_.end())
+			return trace.all_[replay_all_position_++ % trace.all_.size()];
+
+		auto & position = replay_positions_[date_key];
+		return it->second[position++ % it->second.size()];
+	}
+
+public:
+	explicit pauses_generator_t(pauses_params_t params)
+		:	params_{std::move(params)}
+		,	uniform_{0, (params_.max_pause_ - params_.min_pause_).count()}
+		,	exponential_{1.0 / params_.mean_}
+			// Параметр mu подбирается так, чтобы среднее значение
+			// логнормального распределения было равно mean.
+		,	lognormal_{std::log(params_.mean_) - params_.sigma_ * params_.sigma_ / 2.0,
+				params_.sigma_}
+		{
+			if(params_.histogram_)
+				empirical_ = std::discrete_distribution<std::size_t>{
+						params_.histogram_->weights_.begin(),
+						params_.histogram_->weights_.end()};
+		}
+
+	// Следующая задержка для запроса к указанной дате.
+	// Дата имеет значение только для replay.
+	milliseconds next(std::uint32_t date_key) {
+		switch(params_.distribution_) {
+			case pause_distribution_t::uniform:
+				return params_.min_pause_ + milliseconds{uniform_(generator_)};
+
+			case pause_distribution_t::exponential:
+				return clamp(exponential_(generator_));
+
+			case pause_distribution_t::lognormal:
+				return clamp(lognormal_(generator_));
+
+			case pause_distribution_t::pareto:
+				// Обратное преобразование: xm / U^(1/alpha).
+				return clamp(
+						static_cast<double>(params_.min_pause_.count()) /
+						std::pow(1.0 - unit_(generator_), 1.0 / params_.alpha_));
+
+			case pause_distribution_t::empirical:
+				return clamp(static_cast<double>(
+						params_.histogram_->values_[empirical_(generator_)]));
+
+			case pause_distribution_t::replay:
+				return clamp(static_cast<double>(next_from_trace(date_key)));
+		}
+
+		return params_.min_pause_;
+	}
+};
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <restinio/all.hpp>
+
+//
+// Иерархическое колесо таймеров с разрешением в одну миллисекунду.
+//
+// Вместо того, чтобы заводить отдельный Asio-таймер на каждое отложенное
+// действие, все отложенные действия хранятся в корзинах колеса, а само
+// колесо "прокручивается" одним-единственным Asio-таймером, который
+// срабатывает раз в миллисекунду (и только пока колесо не пусто).
+//
+// Колесо состоит из levels уровней по slots_per_level корзин в каждом.
+// Корзина уровня 0 соответствует одной миллисекунде, корзина уровня 1 --
+// slots_per_level миллисекундам и т.д. Когда младший уровень совершает
+// полный оборот, содержимое очередной корзины старшего уровня
+// перераспределяется по младшим уровням. Поэтому постановка действия в
+// колесо и его извлечение имеют сложность O(1).
+//
+// Корзины -- это интрузивные односвязные списки. Узлы списков берутся
+// из собственного пула колеса и возвращаются в него после срабатывания,
+// поэтому в установившемся режиме динамических аллокаций нет.
+//
+// Методы schedule() и обработчик тика защищены mutex-ом, т.к. при работе
+// на пуле нитей Asio может вызвать обработчик тика на любой из нитей.
+// Обработчик срабатывания вызывается вне mutex-а.
+//
+template<typename T>
+class timer_wheel_t {
+public:
+	// Тип обработчика срабатывания.
+	using expiration_handler_t = std::function<void(T)>;
+
+	timer_wheel_t(
+			restinio::asio_ns::io_context & ioctx,
+			expiration_handler_t handler)
+		:	tick_timer_{ioctx}
+		,	handler_{std::move(handler)}
+		{}
+
+	// Это не Copyable и не Moveable класс.
+	timer_wheel_t(const timer_wheel_t &) = delete;
+	timer_wheel_t(timer_wheel_t &&) = delete;
+
+	// Поставить новое действие, которое должно сработать через pause.
+	void schedule(std::chrono::milliseconds pause, T payload) {
+		std::lock_guard<std::mutex> l{lock_};
+
+		const auto now = now_tick();
+		if(0u == pending_)
+			// Колесо было пустым и не прокручивалось, поэтому
+			// синхронизируем его с текущим временем.
+			current_tick_ = now;
+
+		const auto delta = pause.count() > 0 ?
+				static_cast<std::uint64_t>(pause.count()) : 1u;
+
+		node_t * node = acquire_node();
+		node->payload_ = std::move(payload);
+		// Действие не должно уйти за пределы, которые охватывает колесо.
+		node->expires_ = std::min(now + delta, current_tick_ + max_delta);
+		insert(node);
+		++pending_;
+
+		if(!timer_armed_)
+			arm_tick_timer();
+	}
+
+	// Количество действий, которые ждут срабатывания.
+	std::size_t pending() const {
+		std::lock_guard<std::mutex> l{lock_};
+		return pending_;
+	}
+
+private:
+	using clock_t = std::chrono::steady_clock;
+
+	static constexpr unsigned slot_bits = 6u;
+	static constexpr std::size_t slots_per_level = std::size_t{1} << slot_bits;
+	static constexpr std::uint64_t slot_mask = slots_per_level - 1u;
+	static constexpr unsigned levels = 4u;
+	// Максимальная задержка, которую охватывает колесо (чуть больше 4.5 часов).
+	static constexpr std::uint64_t max_delta =
+			(std::uint64_t{1} << (slot_bits * levels)) - 1u;
+
+	// Сколько узлов выделяется за один раз при исчерпании пула.
+	static constexpr std::size_t nodes_per_chunk = 1024u;
+
+	// Узел интрузивного списка.
+	struct node_t {
+		node_t * next_{nullptr};
+		// Номер тика, на котором узел должен сработать.
+		std::uint64_t expires_{0u};
+		T payload_{};
+	};
+
+	using bucket_t = node_t *;
+
+	mutable std::mutex lock_;
+
+	// Корзины всех уровней.
+	std::array<std::array<bucket_t, slots_per_level>, levels> buckets_{};
+
+	// Точка отсчета для номеров тиков.
+	const clock_t::time_point start_{clock_t::now()};
+	// Номер последнего обработанного тика.
+	std::uint64_t current_tick_{0u};
+	// Количество действий, которые ждут срабатывания.
+	std::size_t pending_{0u};
+
+	// Пул узлов. Блоки узлов освобождаются только вместе с колесом.
+	std::vector<std::unique_ptr<node_t[]>> chunks_;
+	node_t * free_nodes_{nullptr};
+
+	// Таймер, посредством которого колесо прокручивается.
+	restinio::asio_ns::steady_timer tick_timer_;
+	bool timer_armed_{false};
+
+	expiration_handler_t handler_;
+
+	// Номер текущего тика. При постановке действия в колесо используется
+	// округление вверх, чтобы действие никогда не срабатывало раньше
+	// запрошенного времени. При прокрутке колеса -- округление вниз.
+	std::uint64_t now_tick(bool round_up = true) const {
+		using namespace std::chrono;
+		const auto ns = duration_cast<nanoseconds>(clock_t::now() - start_);
+		return static_cast<std::uint64_t>(
+				(ns.count() + (round_up ? 999999 : 0)) / 1000000);
+	}
+
+	node_t * acquire_node() {
+		if(!free_nodes_) {
+			std::unique_ptr<node_t[]> chunk{new node_t[nodes_per_chunk]};
+			for(std::size_t i = 0u; i != nodes_per_chunk; ++i) {
+				chunk[i].next_ = free_nodes_;
+				free_nodes_ = &chunk[i];
+			}
+			chunks_.push_back(std::move(chunk));
+		}
+
+		node_t * node = free_nodes_;
+		free_nodes_ = node->next_;
+		node->next_ = nullptr;
+		return node;
+	}
+
+	// Помещение узла в подходящую корзину. Уровень корзины определяется
+	// тем, насколько далеко от текущего тика узел должен сработать.
+	void insert(node_t * node) {
+		const auto delta = node->expires_ - current_tick_;
+		unsigned level = 0u;
+		while(level + 1u < levels &&
+				delta >= (std::uint64_t{1} << (slot_bits * (level + 1u))))
+			++level;
+
+		auto & bucket = buckets_[level][
+				(node->expires_ >> (slot_bits * level)) & slot_mask];
+		node->next_ = bucket;
+		bucket = node;
+	}
+
+	// Прокрутка колеса до тика target включительно.
+	// Возвращается список сработавших узлов.
+	node_t * advance_to(std::uint64_t target) {
+		node_t * expired{nullptr};
+		while(current_tick_ < target) {
+			++current_tick_;
+
+			// Когда младшие уровни совершают полный оборот, нужно
+			// перераспределить содержимое очередной корзины старшего уровня.
+			for(unsigned level = 1u; level < levels; ++level) {
+				const auto low_bits_mask =
+						(std::uint64_t{1} << (slot_bits * level)) - 1u;
+				if(0u != (current_tick_ & low_bits_mask))
+					break;
+
+				auto & bucket = buckets_[level][
+						(current_tick_ >> (slot_bits * level)) & slot_mask];
+				node_t * node = bucket;
+				bucket = nullptr;
+				while(node) {
+					node_t * next = node->next_;
+					insert(node);
+					node = next;
+				}
+			}
+
+			// Все, что лежит в текущей корзине нулевого уровня, сработало.
+			auto & bucket = buckets_[0][current_tick_ & slot_mask];
+			while(bucket) {
+				node_t * node = bucket;
+				bucket = node->next_;
+				node->next_ = expired;
+				expired = node;
+				--pending_;
+			}
+		}
+
+		return expired;
+	}
+
+	// Взвести таймер на начало следующего тика.
+	// Должен вызываться при захваченном mutex-е.
+	void arm_tick_timer() {
+		timer_armed_ = true;
+		tick_timer_.expires_at(
+				start_ + std::chrono::milliseconds{current_tick_ + 1u});
+		tick_timer_.async_wait([this](const auto & ec) {
+				if(!ec)
+					this->on_tick();
+			});
+	}
+
+	void on_tick() {
+		node_t * expired{nullptr};
+		{
+			std::lock_guard<std::mutex> l{lock_};
+			expired = advance_to(now_tick(false));
+			if(0u != pending_)
+				arm_tick_timer();
+			else
+				timer_armed_ = false;
+		}
+
+		if(!expired)
+			return;
+
+		// Обработчики срабатывания вызываются без захвата mutex-а.
+		node_t * last{nullptr};
+		for(node_t * node = expired; node; node = node->next_) {
+			handler_(std::move(node->payload_));
+			node->payload_ = T{};
+			last = node;
+		}
+
+		// Все узлы возвращаются в пул за один захват mutex-а.
+		std::lock_guard<std::mutex> l{lock_};
+		last->next_ = free_nodes_;
+		free_nodes_ = expired;
+	}
+};
@@ -0,0 +1,606 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <restinio/all.hpp>
+
+#include <clara.hpp>
+
+#include <fmt/format.h>
+
+//
+// Сравнение способов передачи сообщений между нитями.
+//
+// Варианты bridge_server отличаются прежде всего тем, как request_info_t
+// попадает с нити RESTinio на нить curl_multi. Здесь эти способы
+// выделены в чистом виде, без HTTP и libcurl:
+//
+// mutex_sleep      -- очередь под mutex-ом, читатель периодически
+//                     просыпается и проверяет ее (исходный bridge_server_1);
+// mutex_pipe       -- очередь под mutex-ом и нотификационный пайп
+//                     (bridge_server_1_pipe, bridge_server_1_poll);
+// mutex_eventfd    -- то же самое, но вместо пайпа eventfd;
+// lockfree_eventfd -- lock-free список и eventfd (bridge_server_1);
+// lockfree_spin    -- lock-free список, читатель не засыпает никогда;
+// asio_post        -- asio::post прямо в io_context, который обслуживается
+//                     одной нитью (bridge_server_2, в котором у каждой
+//                     рабочей нити собственный io_context);
+// asio_strand      -- asio::post в strand, который обслуживается
+//                     одной нитью (исходный bridge_server_2, в котором
+//                     curl_multi защищался strand-ом поверх пула нитей).
+//
+// В нынешнем bridge_server_2 запрос передается в io_context той же нити,
+// на которой его принял RESTinio, т.е. перехода между нитями там нет
+// вовсе. asio_post показывает, во что обошелся бы тот же asio::post,
+// если бы писатели работали на других нитях.
+//
+// Каждый способ проверяется в двух сценариях:
+//
+// throughput -- писатели отправляют сообщения так быстро, как могут,
+//               замеряется пропускная способность;
+// paced      -- писатели отправляют сообщения с паузами, поэтому читатель
+//               большую часть времени ждет, и задержка определяется
+//               стоимостью его пробуждения.
+//
+// Для каждого сообщения фиксируется задержка от момента отправки
+// до момента, когда его получил читатель. Результаты выводятся
+// в виде таблицы в духе Google Benchmark.
+//
+
+using std::chrono::steady_clock;
+
+// Конфигурация бенчмарка.
+struct config_t {
+	// Количество нитей-писателей, для которых выполняются замеры.
+	std::vector<std::size_t> producers_{1u, 2u, 4u, 8u};
+
+	// Общее количество сообщений в сценарии throughput.
+	std::size_t messages_{1000000u};
+
+	// Количество сообщений от каждого писателя в сценарии paced
+	// и пауза между ними.
+	std::size_t paced_messages_{5000u};
+	std::chrono::microseconds interval_{100};
+
+	// Период проверки очереди в mutex_sleep.
+	std::chrono::milliseconds poll_interval_{50};
+
+	// Выполняются только бенчмарки, в имени которых есть эта подстрока.
+	std::string filter_;
+};
+
+// Разбор аргументов командной строки.
+// В случае неудачи порождается исключение.
+auto parse_cmd_line_args(int argc, char ** argv) {
+	struct result_t {
+		bool help_requested_{false};
+		config_t config_;
+	};
+	result_t result;
+	std::string producers{"1,2,4,8"};
+	long interval{result.config_.interval_.count()};
+	long poll_interval{result.config_.poll_interval_.count()};
+
+	// Подготавливаем парсер аргументов командной строки.
+	using namespace clara;
+
+	auto cli = Opt(producers, "list")["-p"]["--producers"]
+				(fmt::format("comma separated numbers of producer threads "
+						"(default: {})", producers))
+		| Opt(result.config_.messages_, "messages")["-m"]["--messages"]
+				(fmt::format("total number of messages in throughput benchmarks "
+						"(default: {})", result.config_.messages_))
+		| Opt(result.config_.paced_messages_, "messages")["--paced-messages"]
+				(fmt::format("number of messages from each producer in paced "
+						"benchmarks (default: {})", result.config_.paced_messages_))
+		| Opt(interval, "microseconds")["-i"]["--interval"]
+				(fmt::format("pause between messages in paced benchmarks "
+						"(default: {})", interval))
+		| Opt(poll_interval, "milliseconds")["--poll-interval"]
+				(fmt::format("queue polling period for mutex_sleep (default: {})",
+						poll_interval))
+		| Opt(result.config_.filter_, "substring")["-f"]["--filter"]
+				("run only benchmarks whose names contain this substring")
+		| Help(result.help_requested_);
+
+	// Выполняем парсинг...
+	auto parse_result = cli.parse(Args(argc, argv));
+	// ...и бросаем исключение если столкнулись с ошибкой.
+	if(!parse_result)
+		throw std::runtime_error("Invalid command line: "
+				+ parse_result.errorMessage());
+
+	if(result.help_requested_)
+		std::cout << cli << std::endl;
+	else {
+		result.config_.producers_.clear();
+		std::istringstream in{producers};
+		std::string item;
+		while(std::getline(in, item, ','))
+			if(!item.empty()) {
+				const auto value = std::stoul(item);
+				if(0u == value)
+					throw std::runtime_error("number of producers can't be 0");
+				result.config_.producers_.push_back(value);
+			}
+		if(result.config_.producers_.empty())
+			throw std::runtime_error("no producer counts");
+
+		if(0u == result.config_.messages_ || 0u == result.config_.paced_messages_)
+			throw std::runtime_error("number of messages can't be 0");
+		if(interval < 0)
+			throw std::runtime_error("invalid interval");
+		result.config_.interval_ = std::chrono::microseconds{interval};
+		if(poll_interval <= 0)
+			throw std::runtime_error("invalid poll interval");
+		result.config_.poll_interval_ = std::chrono::milliseconds{poll_interval};
+	}
+
+	return result;
+}
+
+//
+// ПРИМЕЧАНИЕ: КАК И В BRIDGE_SERVER-АХ, КОДЫ ВОЗВРАТА СИСТЕМНЫХ ФУНКЦИЙ
+// ВРОДЕ read, write И Т.Д. НЕ ПРОВЕРЯЮТСЯ.
+//
+
+// Вспомогательная штука, чтобы подавить предупреждения об игнорировании
+// возвращаемого значения.
+namespace {
+	struct just_ignore_t {
+		template<typename T> void operator=(T) {}
+	} _;
+}
+
+// Передаваемое сообщение. Как и request_info_t, создается в динамической
+// памяти для каждой передачи.
+struct message_t {
+	// Когда сообщение было отправлено.
+	steady_clock::time_point sent_at_;
+
+	// Для интрузивного списка в lock-free очереди.
+	message_t * next_{nullptr};
+};
+
+using message_ptr_t = std::unique_ptr<message_t>;
+
+// Читающая сторона. Фиксирует задержку каждого полученного сообщения.
+class consumer_t {
+public:
+	explicit consumer_t(std::size_t expected) : expected_{expected} {
+		latencies_.reserve(expected);
+	}
+
+	void accept(message_ptr_t msg) {
+		latencies_.push_back(static_cast<std::uint64_t>(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(
+						steady_clock::now() - msg->sent_at_).count()));
+	}
+
+	// Получены ли все ожидаемые сообщения.
+	bool done() const noexcept { return latencies_.size() == expected_; }
+
+	// Задержки всех сообщений, нс.
+	std::vector<std::uint64_t> & latencies() noexcept { return latencies_; }
+
+private:
+	const std::size_t expected_;
+	std::vector<std::uint64_t> latencies_;
+};
+
+//
+// Способы ожидания читателем появления новых сообщений.
+//
+// notify() вызывается писателем, когда он помещает сообщение в пустую
+// очередь. wait() вызывается читателем, когда очередь оказалась пуста,
+// и возвращает управление, когда в ней могли появиться новые сообщения.
+// wait() сбрасывает нотификацию до того, как читатель снова заглянет
+// в очередь, поэтому нотификации не теряются.
+//
+
+// Периодическая проверка очереди.
+class sleep_notifier_t {
+public:
+	explicit sleep_notifier_t(const config_t & config)
+		:	poll_interval_{config.poll_interval_}
+		{}
+
+	void notify() noexcept {}
+
+	void wait() { std::this_thread::sleep_for(poll_interval_); }
+
+private:
+	const std::chrono::milliseconds poll_interval_;
+};
+
+// Ожидание готовности к чтению дескриптора fd.
+inline void wait_readable(int fd) {
+	pollfd notify_fd{fd, POLLIN, 0};
+	// Таймаут только для подстраховки, как у curl_multi_wait
+	// в bridge_server-ах.
+	_ = ::poll(&notify_fd, 1, 50);
+}
+
+// Нотификационный пайп.
+class pipe_notifier_t {
+public:
+	explicit pipe_notifier_t(const config_t &) {
+		_ = ::pipe(pipefd_);
+
+		_ = ::fcntl(pipefd_[0], F_SETFL, O_NONBLOCK);
+		_ = ::fcntl(pipefd_[1], F_SETFL, O_NONBLOCK);
+	}
+	~pipe_notifier_t() {
+		::close(pipefd_[0]);
+		::close(pipefd_[1]);
+	}
+
+	pipe_notifier_t(const pipe_notifier_t &) = delete;
+	pipe_notifier_t(pipe_notifier_t &&) = delete;
+
+	void notify() {
+		char dummy{0};
+		_ = ::write(pipefd_[1], &dummy, sizeof(dummy));
+	}
+
+	void wait() {
+		wait_readable(pipefd_[0]);
+
+		char dummy[64];
+		_ = ::read(pipefd_[0], dummy, sizeof(dummy));
+	}
+
+private:
+	int pipefd_[2];
+};
+
+// eventfd. В отличие от пайпа, все накопившиеся нотификации
+// сбрасываются одним read.
+class eventfd_notifier_t {
+public:
+	explicit eventfd_notifier_t(const config_t &)
+		:	eventfd_{::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)} {
+		if(-1 == eventfd_)
+			throw std::runtime_error("unable to create eventfd");
+	}
+	~eventfd_notifier_t() {
+		::close(eventfd_);
+	}
+
+	eventfd_notifier_t(const eventfd_notifier_t &) = delete;
+	eventfd_notifier_t(eventfd_notifier_t &&) = delete;
+
+	void notify() {
+		const std::uint64_t value{1u};
+		_ = ::write(eventfd_, &value, sizeof(value));
+	}
+
+	void wait() {
+		wait_readable(eventfd_);
+
+		std::uint64_t value{0u};
+		_ = ::read(eventfd_, &value, sizeof(value));
+	}
+
+private:
+	const int eventfd_;
+};
+
+// Читатель не засыпает, а постоянно проверяет очередь.
+class spin_notifier_t {
+public:
+	explicit spin_notifier_t(const config_t &) {}
+
+	void notify() noexcept {}
+
+	void wait() noexcept {}
+};
+
+//
+// Способы передачи сообщений.
+//
+// push() вызывается писателями, consume() -- читателем, и возвращает
+// управление, когда читатель получил все ожидаемые сообщения.
+//
+
+// Очередь под mutex-ом. Содержимое очереди забирается целиком при
+// захваченном mutex-е, а передача сообщений читателю осуществляется
+// уже без него.
+template<typename Notifier>
+class mutex_queue_t {
+public:
+	mutex_queue_t(consumer_t & consumer, const config_t & config)
+		:	consumer_{consumer}, notifier_{config}
+		{}
+
+	void push(message_ptr_t what) {
+		bool was_empty{false};
+		{
+			std::lock_guard<std::mutex> l{lock_};
+			was_empty = content_.empty();
+			content_.emplace(std::move(what));
+		}
+
+		if(was_empty)
+			notifier_.notify();
+	}
+
+	void consume() {
+		std::queue<message_ptr_t> extracted;
+		while(!consumer_.done()) {
+			{
+				std::lock_guard<std::mutex> l{lock_};
+				extracted.swap(content_);
+			}
+
+			if(extracted.empty())
+				notifier_.wait();
+			else
+				while(!extracted.empty()) {
+					consumer_.accept(std::move(extracted.front()));
+					extracted.pop();
+				}
+		}
+	}
+
+private:
+	consumer_t & consumer_;
+	Notifier notifier_;
+
+	std::mutex lock_;
+	std::queue<message_ptr_t> content_;
+};
+
+// Lock-free список, как mpsc_queue_t из bridge_server_1. Писатели
+// добавляют сообщения в голову списка посредством compare_exchange,
+// а читатель забирает весь список посредством exchange и разворачивает
+// его, чтобы сообщения обрабатывались в порядке их поступления.
+template<typename Notifier>
+class lockfree_queue_t {
+public:
+	lockfree_queue_t(consumer_t & consumer, const config_t & config)
+		:	consumer_{consumer}, notifier_{config}
+		{}
+
+	void push(message_ptr_t what) {
+		message_t * item = what.release();
+		message_t * old_head = head_.load(std::memory_order_relaxed);
+		do {
+			item->next_ = old_head;
+		} while(!head_.compare_exchange_weak(old_head, item,
+				std::memory_order_release,
+				std::memory_order_relaxed));
+
+		if(!old_head)
+			notifier_.notify();
+	}
+
+	void consume() {
+		while(!consumer_.done()) {
+			message_t * items = head_.exchange(nullptr, std::memory_order_acquire);
+			if(!items) {
+				notifier_.wait();
+				continue;
+			}
+
+			message_t * reversed{nullptr};
+			while(items) {
+				message_t * next = items->next_;
+				items->next_ = reversed;
+				reversed = items;
+				items = next;
+			}
+
+			while(reversed) {
+				message_t * next = reversed->next_;
+				consumer_.accept(message_ptr_t{reversed});
+				reversed = next;
+			}
+		}
+	}
+
+private:
+	consumer_t & consumer_;
+	Notifier notifier_;
+
+	std::atomic<message_t *> head_{nullptr};
+};
+
+// asio::post прямо в io_context. Читатель -- единственная нить, которая
+// выполняет io_context::run_one.
+class asio_post_t {
+public:
+	asio_post_t(consumer_t & consumer, const config_t &)
+		:	consumer_{consumer}
+		{}
+
+	void push(message_ptr_t what) {
+		restinio::asio_ns::post(ioctx_, [this, msg = what.release()] {
+				consumer_.accept(message_ptr_t{msg});
+			});
+	}
+
+	void consume() {
+		auto work = restinio::asio_ns::make_work_guard(ioctx_);
+		while(!consumer_.done())
+			ioctx_.run_one();
+	}
+
+private:
+	consumer_t & consumer_;
+
+	restinio::asio_ns::io_context ioctx_;
+};
+
+// asio::post в strand. Читатель -- единственная нить, которая
+// выполняет io_context::run_one.
+class asio_strand_t {
+public:
+	asio_strand_t(consumer_t & consumer, const config_t &)
+		:	consumer_{consumer}
+		{}
+
+	void push(message_ptr_t what) {
+		restinio::asio_ns::post(strand_, [this, msg = what.release()] {
+				consumer_.accept(message_ptr_t{msg});
+			});
+	}
+
+	void consume() {
+		auto work = restinio::asio_ns::make_work_guard(ioctx_);
+		while(!consumer_.done())
+			ioctx_.run_one();
+	}
+
+private:
+	consumer_t & consumer_;
+
+	restinio::asio_ns::io_context ioctx_;
+	restinio::asio_ns::io_context::strand strand_{ioctx_};
+};
+
+// Сценарий замера.
+enum class scenario_t {
+	throughput,
+	paced
+};
+
+// Результаты одного замера.
+struct measurement_t {
+	std::size_t messages_;
+	std::chrono::nanoseconds duration_;
+	// Задержки сообщений, нс.
+	std::uint64_t p50_;
+	std::uint64_t p99_;
+	std::uint64_t p999_;
+	std::uint64_t max_;
+};
+
+// Замер для указанного способа передачи, сценария и количества писателей.
+template<typename Mechanism>
+measurement_t measure(
+		const config_t & config,
+		scenario_t scenario,
+		std::size_t producers) {
+	const auto per_producer = scenario_t::throughput == scenario ?
+			std::max<std::size_t>(1u, config.messages_ / producers) :
+			config.paced_messages_;
+
+	consumer_t consumer{per_producer * producers};
+	Mechanism mechanism{consumer, config};
+
+	// Писатели начинают работу одновременно, когда все они запущены.
+	std::atomic<bool> started{false};
+	std::vector<std::thread> threads;
+	threads.reserve(producers);
+	for(std::size_t i = 0u; i != producers; ++i)
+		threads.emplace_back([&] {
+			while(!started.load(std::memory_order_acquire))
+				std::this_thread::yield();
+
+			for(std::size_t n = 0u; n != per_producer; ++n) {
+				auto msg = std::make_unique<message_t>();
+				msg->sent_at_ = steady_clock::now();
+				mechanism.push(std::move(msg));
+
+				if(scenario_t::paced == scenario)
+					std::this_thread::sleep_for(config.interval_);
+			}
+		});
+
+	const auto started_at = steady_clock::now();
+	started.store(true, std::memory_order_release);
+	mechanism.consume();
+	const auto finished_at = steady_clock::now();
+
+	for(auto & t : threads)
+		t.join();
+
+	auto & latencies = consumer.latencies();
+	std::sort(latencies.begin(), latencies.end());
+	const auto at_quantile = [&latencies](double q) {
+		return latencies[std::min(latencies.size() - 1u,
+				static_cast<std::size_t>(q * static_cast<double>(latencies.size())))];
+	};
+
+	return measurement_t{
+			latencies.size(),
+			finished_at - started_at,
+			at_quantile(0.5),
+			at_quantile(0.99),
+			at_quantile(0.999),
+			latencies.back()};
+}
+
+void report(const std::string & name, const measurement_t & m) {
+	const auto n = static_cast<double>(m.messages_);
+	const auto ns = static_cast<double>(m.duration_.count());
+	std::cout << fmt::format(
+			"{:<40} {:>12.1f} {:>14.0f} {:>12.1f} {:>12.1f} {:>12.1f} {:>12.1f}\n",
+			name,
+			ns / n,
+			n * 1e9 / ns,
+			static_cast<double>(m.p50_) / 1000.0,
+			static_cast<double>(m.p99_) / 1000.0,
+			static_cast<double>(m.p999_) / 1000.0,
+			static_cast<double>(m.max_) / 1000.0);
+}
+
+// Выполнение всех замеров для указанного способа передачи.
+template<typename Mechanism>
+void run_benchmarks(const config_t & config, const char * mechanism_name) {
+	for(const auto scenario : {scenario_t::throughput, scenario_t::paced})
+		for(const auto producers : config.producers_) {
+			const auto name = fmt::format("{}/{}/producers:{}",
+					mechanism_name,
+					scenario_t::throughput == scenario ? "throughput" : "paced",
+					producers);
+			if(std::string::npos == name.find(config.filter_))
+				continue;
+
+			report(name, measure<Mechanism>(config, scenario, producers));
+		}
+}
+
+int main(int argc, char ** argv) {
+	try {
+		const auto cfg = parse_cmd_line_args(argc, argv);
+		if(cfg.help_requested_)
+			return 1;
+		const auto & config = cfg.config_;
+
+		std::cout << fmt::format(
+				"{:<40} {:>12} {:>14} {:>12} {:>12} {:>12} {:>12}\n",
+				"benchmark", "ns/msg", "msgs/s",
+				"p50_us", "p99_us", "p999_us", "max_us");
+
+		run_benchmarks<mutex_queue_t<sleep_notifier_t>>(config, "mutex_sleep");
+		run_benchmarks<mutex_queue_t<pipe_notifier_t>>(config, "mutex_pipe");
+		run_benchmarks<mutex_queue_t<eventfd_notifier_t>>(config, "mutex_eventfd");
+		run_benchmarks<lockfree_queue_t<eventfd_notifier_t>>(config, "lockfree_eventfd");
+		run_benchmarks<lockfree_queue_t<spin_notifier_t>>(config, "lockfree_spin");
+		run_benchmarks<asio_post_t>(config, "asio_post");
+		run_benchmarks<asio_strand_t>(config, "asio_strand");
+	}
+	catch( const std::exception & ex ) {
+		std::cerr << "Error: " << ex.what() << std::endl;
+		return 2;
+	}
+
+	return 0;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+//
+// Выбор дат для очередных запросов к /data.
+//
+// Запросы идут к dates последовательным датам, начиная с заданной.
+// От того, насколько часто повторяются одни и те же даты, зависит доля
+// попаданий в кэш ответов bridge_server_2 и доля объединенных запросов.
+// Поэтому распределение дат можно выбирать:
+//
+// uniform -- все даты равновероятны;
+// zipf    -- вероятность k-й даты пропорциональна 1/k^s, т.е. небольшое
+//            количество "горячих" дат получает большую часть запросов;
+// unique  -- даты перебираются по кругу, поэтому пока запросов меньше,
+//            чем дат, повторов нет совсем.
+//
+
+// Распределение дат.
+enum class date_distribution_t {
+	uniform,
+	zipf,
+	unique
+};
+
+// Получение распределения по его имени.
+// Если имя неизвестно, то порождается исключение.
+inline date_distribution_t parse_date_distribution(const std::string & name) {
+	if("uniform" == name) return date_distribution_t::uniform;
+	if("zipf" == name) return date_distribution_t::zipf;
+	if("unique" == name) return date_distribution_t::unique;
+
+	throw std::runtime_error("unknown date distribution: " + name);
+}
+
+// Набор дат и их распределение. После создания не изменяется, поэтому
+// может использоваться из нескольких нитей одновременно. Состояние
+// выбора (генератор случайных чисел, позиция перебора) у каждой нити
+// свое, см. date_picker_t::cursor_t.
+class date_picker_t {
+public:
+	date_picker_t(
+			std::size_t dates,
+			date_distribution_t distribution,
+			double zipf_exponent,
+			int first_year)
+		:	distribution_{distribution} {
+		if(0u == dates)
+			throw std::runtime_error("number of dates can't be 0");
+
+		// Все строки запросов формируются заранее, чтобы не тратить
+		// на это время во время генерации нагрузки.
+		std::tm first{};
+		first.tm_year = first_year - 1900;
+		first.tm_mon = 0;
+		first.tm_mday = 1;
+		first.tm_hour = 12;
+		const auto base = timegm(&first);
+
+		queries_.reserve(dates);
+		for(std::size_t i = 0u; i != dates; ++i) {
+			const std::time_t t = base + static_cast<std::time_t>(i) * 24 * 3600;
+			std::tm day{};
+			gmtime_r(&t, &day);
+			queries_.push_back(fmt::format("year={}&month={:02}&day={:02}",
+					day.tm_year + 1900, day.tm_mon + 1, day.tm_mday));
+		}
+
+		if(date_distribution_t::zipf == distribution_) {
+			zipf_cdf_.reserve(dates);
+			double sum{0.0};
+			for(std::size_t k = 1u; k <= dates; ++k) {
+				sum += 1.0 / std::pow(static_cast<double>(k), zipf_exponent);
+				zipf_cdf_.push_back(sum);
+			}
+			for(auto & v : zipf_cdf_)
+				v /= sum;
+		}
+	}
+
+	// Состояние выбора для одной нити.
+	class cursor_t {
+		friend class date_picker_t;
+
+		std::mt19937_64 generator_;
+		std::size_t next_;
+
+	public:
+		cursor_t(std::uint64_t seed, std::size_t start)
+			:	generator_{seed}, next_{start}
+			{}
+	};
+
+	// Строка запроса для очередной даты.
+	const std::string & pick(cursor_t & cursor) const {
+		switch(distribution_) {
+			case date_distribution_t::uniform:
+				return queries_[std::uniform_int_distribution<std::size_t>{
+						0u, queries_.size() - 1u}(cursor.generator_)];
+
+			case date_distribution_t::zipf: {
+				const auto u = std::uniform_real_distribution<double>{
+						0.0, 1.0}(cursor.generator_);
+				const auto it = std::lower_bound(
+						zipf_cdf_.begin(), zipf_cdf_.end(), u);
+				return queries_[std::min<std::size_t>(
+						static_cast<std::size_t>(it - zipf_cdf_.begin()),
+						queries_.size() - 1u)];
+			}
+
+			case date_distribution_t::unique: break;
+		}
+
+		const auto & result = queries_[cursor.next_ % queries_.size()];
+		++cursor.next_;
+		return result;
+	}
+
+	std::size_t size() const noexcept { return queries_.size(); }
+
+private:
+	const date_distribution_t distribution_;
+
+	// Готовые строки запроса вида year=YYYY&month=MM&day=DD.
+	std::vector<std::string> queries_;
+
+	// Функция распределения для zipf.
+	std::vector<double> zipf_cdf_;
+};
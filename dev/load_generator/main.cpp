@@ -0,0 +1,480 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <clara.hpp>
+
+#include <fmt/format.h>
+
+#include <cpp_util_3/at_scope_exit.hpp>
+
+#include <curl/curl.h>
+
+#include <common/curl_easy_pool.hpp>
+#include <common/stage_metrics.hpp>
+
+#include <load_generator/date_picker.hpp>
+
+//
+// Генератор нагрузки для delay_server и bridge_server-ов.
+//
+// Запросы к /data выполняются через curl_multi, по одному экземпляру
+// curl_multi на каждую рабочую нить. Поддерживаются два режима:
+//
+// closed-loop -- на каждой нити одновременно выполняется заданное
+//                количество запросов, новый запрос отправляется сразу
+//                после завершения предыдущего;
+// open-loop   -- запросы отправляются с постоянной частотой независимо
+//                от того, успевает ли сервер на них отвечать.
+//
+// В режиме open-loop задержка отсчитывается от момента, когда запрос
+// должен был быть отправлен по расписанию, а не от момента его
+// фактической отправки. Иначе, если сервер начинает тормозить, генератор
+// невольно снижает нагрузку и не учитывает время, которое запросы
+// провели бы в очереди (coordinated omission).
+//
+
+using clock_type = std::chrono::steady_clock;
+
+// Конфигурация генератора.
+struct config_t {
+	// Адрес и порт сервера.
+	std::string address_{"localhost"};
+	std::uint16_t port_{8080};
+	// Путь, к которому идут запросы.
+	std::string path_{"/data"};
+
+	// Количество рабочих нитей.
+	std::size_t threads_{1u};
+
+	// Сколько запросов одновременно выполняется на всех нитях. В режиме
+	// open-loop это ограничение сверху, которое защищает сам генератор.
+	std::size_t connections_{64u};
+	// Частота запросов в секунду на все нити. 0 означает режим closed-loop.
+	double rate_{0.0};
+
+	// Длительность замера.
+	std::chrono::seconds duration_{10};
+	// Таймаут одного запроса.
+	std::chrono::milliseconds timeout_{30000};
+
+	// Количество различных дат в запросах и их распределение.
+	std::size_t dates_{365u};
+	date_distribution_t distribution_{date_distribution_t::uniform};
+	double zipf_exponent_{1.0};
+	// Год, с 1 января которого начинаются даты.
+	int first_year_{2018};
+
+	// Начальное значение для генераторов случайных чисел.
+	std::uint64_t seed_{42u};
+};
+
+// Разбор аргументов командной строки.
+// В случае неудачи порождается исключение.
+auto parse_cmd_line_args(int argc, char ** argv) {
+	struct result_t {
+		bool help_requested_{false};
+		config_t config_;
+	};
+	result_t result;
+	long duration{result.config_.duration_.count()};
+	long timeout{result.config_.timeout_.count()};
+	std::string distribution{"uniform"};
+
+	// Подготавливаем парсер аргументов командной строки.
+	using namespace clara;
+
+	auto cli = Opt(result.config_.address_, "address")["-a"]["--address"]
+				(fmt::format("server address (default: {})", result.config_.address_))
+		| Opt(result.config_.port_, "port")["-p"]["--port"]
+				(fmt::format("server port (default: {})", result.config_.port_))
+		| Opt(result.config_.path_, "path")["--path"]
+				(fmt::format("request path (default: {})", result.config_.path_))
+		| Opt(result.config_.threads_, "threads")["-n"]["--threads"]
+				(fmt::format("number of worker threads (default: {})",
+						result.config_.threads_))
+		| Opt(result.config_.connections_, "requests")["-c"]["--connections"]
+				(fmt::format("number of concurrent requests, max in flight "
+						"for open-loop mode (default: {})",
+						result.config_.connections_))
+		| Opt(result.config_.rate_, "rps")["-r"]["--rate"]
+				("requests per second for open-loop mode, "
+				"0 means closed-loop (default: 0)")
+		| Opt(duration, "seconds")["-d"]["--duration"]
+				(fmt::format("duration of the test (default: {})", duration))
+		| Opt(timeout, "ms")["--timeout"]
+				(fmt::format("timeout for one request (default: {})", timeout))
+		| Opt(result.config_.dates_, "dates")["--dates"]
+				(fmt::format("number of different dates in requests (default: {})",
+						result.config_.dates_))
+		| Opt(distribution, "distribution")["--date-distribution"]
+				("distribution of dates: uniform, zipf, unique (default: uniform)")
+		| Opt(result.config_.zipf_exponent_, "s")["--zipf-exponent"]
+				(fmt::format("exponent of zipf distribution (default: {})",
+						result.config_.zipf_exponent_))
+		| Opt(result.config_.first_year_, "year")["--first-year"]
+				(fmt::format("dates start from January 1 of this year (default: {})",
+						result.config_.first_year_))
+		| Opt(result.config_.seed_, "seed")["--seed"]
+				(fmt::format("seed for random generators (default: {})",
+						result.config_.seed_))
+		| Help(result.help_requested_);
+
+	// Выполняем парсинг...
+	auto parse_result = cli.parse(Args(argc, argv));
+	// ...и бросаем исключение если столкнулись с ошибкой.
+	if(!parse_result)
+		throw std::runtime_error("Invalid command line: "
+				+ parse_result.errorMessage());
+
+	if(result.help_requested_)
+		std::cout << cli << std::endl;
+	else {
+		if(0u == result.config_.threads_)
+			throw std::runtime_error("number of threads can't be 0");
+		if(result.config_.connections_ < result.config_.threads_)
+			throw std::runtime_error(
+					"number of connections can't be less than number of threads");
+		if(result.config_.rate_ < 0.0)
+			throw std::runtime_error("invalid rate");
+		if(duration <= 0)
+			throw std::runtime_error("invalid duration");
+		result.config_.duration_ = std::chrono::seconds{duration};
+		if(timeout <= 0)
+			throw std::runtime_error("invalid timeout");
+		result.config_.timeout_ = std::chrono::milliseconds{timeout};
+		result.config_.distribution_ = parse_date_distribution(distribution);
+	}
+
+	return result;
+}
+
+// Результаты одной рабочей нити.
+struct worker_results_t {
+	// Задержки завершившихся запросов, мкс.
+	latency_histogram_t latencies_;
+	std::uint64_t max_latency_us_{0u};
+
+	// Сколько запросов завершилось.
+	std::uint64_t completed_{0u};
+	// Распределение завершившихся запросов по результатам.
+	std::uint64_t ok_{0u};
+	std::uint64_t overloaded_{0u};
+	std::uint64_t timed_out_{0u};
+	std::uint64_t other_status_{0u};
+	std::uint64_t failed_{0u};
+	// Сколько запросов так и не было отправлено в режиме open-loop,
+	// т.к. все время было исчерпано ограничение на их количество.
+	std::uint64_t unsent_{0u};
+	// Сколько байт тела ответов получено.
+	std::uint64_t bytes_{0u};
+};
+
+// Эту функцию будет вызывать curl когда начнут приходить данные
+// от сервера. Сами данные не нужны, учитывается только их объем.
+std::size_t write_callback(
+		char *, size_t size, size_t nmemb, void * userdata) {
+	const auto total_size = size * nmemb;
+	*reinterpret_cast<std::uint64_t *>(userdata) += total_size;
+	return total_size;
+}
+
+// Генерация нагрузки на одной нити.
+class load_worker_t {
+public:
+	load_worker_t(
+			const config_t & config,
+			CURLSH * share,
+			const date_picker_t & dates,
+			std::size_t index,
+			clock_type::time_point start_at,
+			worker_results_t & results)
+		:	config_{config}
+		,	dates_{dates}
+		,	cursor_{config.seed_ + index, index * dates.size() / config.threads_}
+		,	results_{results}
+		,	max_in_flight_{connections_for(config, index)}
+		,	start_at_{start_at}
+		,	finish_at_{start_at + config.duration_}
+		,	url_prefix_{fmt::format("http://{}:{}{}?",
+				config.address_, config.port_, config.path_)}
+		,	pool_{share, [this](CURL * h) {
+				curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, write_callback);
+				curl_easy_setopt(h, CURLOPT_WRITEDATA, &results_.bytes_);
+				curl_easy_setopt(h, CURLOPT_NOSIGNAL, 1L);
+				curl_easy_setopt(h, CURLOPT_TIMEOUT_MS,
+						static_cast<long>(config_.timeout_.count()));
+			}} {
+		if(config.rate_ > 0.0) {
+			// Нити отправляют запросы по очереди, а не одновременно.
+			const auto per_thread = config.rate_ / config.threads_;
+			interval_ = std::chrono::duration_cast<clock_type::duration>(
+					std::chrono::duration<double>{1.0 / per_thread});
+			next_send_ = start_at_ + interval_ * index / config.threads_;
+		}
+		slots_.resize(max_in_flight_);
+		for(auto & s : slots_)
+			free_slots_.push_back(&s);
+	}
+
+	~load_worker_t() {
+		curl_multi_cleanup(curlm_);
+	}
+
+	// Это не Copyable и не Moveable класс.
+	load_worker_t(const load_worker_t &) = delete;
+	load_worker_t(load_worker_t &&) = delete;
+
+	void run() {
+		std::this_thread::sleep_until(start_at_);
+
+		int still_running{0};
+		while(true) {
+			const auto now = clock_type::now();
+			if(now < finish_at_)
+				issue_requests(now);
+			else if(free_slots_.size() == slots_.size())
+				break;
+
+			curl_multi_wait(curlm_, nullptr, 0, wait_timeout_ms(now), nullptr);
+			curl_multi_perform(curlm_, &still_running);
+			check_completions();
+		}
+
+		// Запросы, которые по расписанию должны были быть отправлены,
+		// но так и не были.
+		if(open_loop())
+			for(; next_send_ < finish_at_; next_send_ += interval_)
+				++results_.unsent_;
+	}
+
+private:
+	// Запрос, который сейчас выполняется.
+	struct slot_t {
+		// Момент, от которого отсчитывается задержка.
+		clock_type::time_point intended_at_;
+	};
+
+	const config_t & config_;
+	const date_picker_t & dates_;
+	date_picker_t::cursor_t cursor_;
+	worker_results_t & results_;
+
+	const std::size_t max_in_flight_;
+	const clock_type::time_point start_at_;
+	const clock_type::time_point finish_at_;
+
+	// Интервал между запросами и момент отправки следующего запроса
+	// в режиме open-loop.
+	clock_type::duration interval_{clock_type::duration::zero()};
+	clock_type::time_point next_send_;
+
+	const std::string url_prefix_;
+	std::string url_;
+
+	CURLM * curlm_{curl_multi_init()};
+	curl_easy_pool_t pool_;
+
+	std::vector<slot_t> slots_;
+	std::vector<slot_t *> free_slots_;
+
+	// Сколько запросов одновременно может выполнять нить index.
+	// Общее количество делится между нитями как можно более поровну.
+	static std::size_t connections_for(const config_t & config, std::size_t index) {
+		return config.connections_ / config.threads_ +
+				(index < config.connections_ % config.threads_ ? 1u : 0u);
+	}
+
+	bool open_loop() const noexcept { return interval_ != clock_type::duration::zero(); }
+
+	void issue_requests(clock_type::time_point now) {
+		if(!open_loop()) {
+			while(!free_slots_.empty())
+				start_request(now);
+			return;
+		}
+
+		// Если запрос не удалось отправить вовремя из-за ограничения на
+		// количество одновременных запросов, то он будет отправлен позже,
+		// но задержка для него все равно отсчитывается по расписанию.
+		while(next_send_ <= now && next_send_ < finish_at_ && !free_slots_.empty()) {
+			start_request(next_send_);
+			next_send_ += interval_;
+		}
+	}
+
+	void start_request(clock_type::time_point intended_at) {
+		auto slot = free_slots_.back();
+		free_slots_.pop_back();
+		slot->intended_at_ = intended_at;
+
+		url_.assign(url_prefix_);
+		url_.append(dates_.pick(cursor_));
+
+		CURL * h = pool_.acquire();
+		// libcurl делает собственную копию URL.
+		curl_easy_setopt(h, CURLOPT_URL, url_.c_str());
+		curl_easy_setopt(h, CURLOPT_PRIVATE, slot);
+		curl_multi_add_handle(curlm_, h);
+	}
+
+	// Сколько можно ждать событий от curl_multi, чтобы не пропустить
+	// момент отправки следующего запроса.
+	int wait_timeout_ms(clock_type::time_point now) const {
+		constexpr int max_wait_ms = 100;
+		if(!open_loop() || now >= finish_at_ || free_slots_.empty())
+			return max_wait_ms;
+		if(next_send_ <= now)
+			return 0;
+		const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+				next_send_ - now).count();
+		return static_cast<int>(std::min<long long>(wait, max_wait_ms));
+	}
+
+	void check_completions() {
+		CURLMsg * msg;
+		int messages_left{0};
+		while(nullptr != (msg = curl_multi_info_read(curlm_, &messages_left))) {
+			if(CURLMSG_DONE != msg->msg)
+				continue;
+
+			const auto now = clock_type::now();
+			CURL * h = msg->easy_handle;
+			curl_multi_remove_handle(curlm_, h);
+
+			slot_t * slot{nullptr};
+			curl_easy_getinfo(h, CURLINFO_PRIVATE, &slot);
+
+			long response_code{0};
+			if(CURLE_OK == msg->data.result)
+				curl_easy_getinfo(h, CURLINFO_RESPONSE_CODE, &response_code);
+			pool_.release(h);
+
+			const auto latency_us = static_cast<std::uint64_t>(
+					std::chrono::duration_cast<std::chrono::microseconds>(
+							now - slot->intended_at_).count());
+			results_.latencies_.record(latency_us);
+			results_.max_latency_us_ = std::max(results_.max_latency_us_, latency_us);
+			free_slots_.push_back(slot);
+
+			++results_.completed_;
+			if(CURLE_OK != msg->data.result)
+				++results_.failed_;
+			else if(200 == response_code)
+				++results_.ok_;
+			else if(503 == response_code)
+				++results_.overloaded_;
+			else if(504 == response_code)
+				++results_.timed_out_;
+			else
+				++results_.other_status_;
+		}
+	}
+};
+
+// Вывод итогов по всем нитям.
+void report(
+		const config_t & config,
+		const std::vector<std::unique_ptr<worker_results_t>> & results,
+		std::chrono::duration<double> elapsed) {
+	latency_histogram_t::snapshot_t latencies;
+	worker_results_t total;
+	for(const auto & r : results) {
+		r->latencies_.add_to(latencies);
+		total.max_latency_us_ = std::max(total.max_latency_us_, r->max_latency_us_);
+		total.completed_ += r->completed_;
+		total.ok_ += r->ok_;
+		total.overloaded_ += r->overloaded_;
+		total.timed_out_ += r->timed_out_;
+		total.other_status_ += r->other_status_;
+		total.failed_ += r->failed_;
+		total.unsent_ += r->unsent_;
+		total.bytes_ += r->bytes_;
+	}
+
+	const auto ms = [](std::uint64_t us) { return us / 1000.0; };
+
+	std::cout << (config.rate_ > 0.0 ?
+			fmt::format("mode: open-loop\nrate: {}\nmax_in_flight: {}\n",
+					config.rate_, config.connections_) :
+			fmt::format("mode: closed-loop\nconnections: {}\n",
+					config.connections_));
+	std::cout << fmt::format(
+			"duration_s: {:.3f}\n"
+			"requests: {}\n"
+			"throughput_rps: {:.1f}\n"
+			"ok: {}\nstatus_503: {}\nstatus_504: {}\nstatus_other: {}\n"
+			"errors: {}\nunsent: {}\n"
+			"bytes: {}\n"
+			"latency_mean_ms: {:.3f}\n"
+			"latency_p50_ms: {:.3f}\n"
+			"latency_p90_ms: {:.3f}\n"
+			"latency_p99_ms: {:.3f}\n"
+			"latency_p999_ms: {:.3f}\n"
+			"latency_max_ms: {:.3f}\n",
+			elapsed.count(),
+			total.completed_,
+			static_cast<double>(total.completed_) / config.duration_.count(),
+			total.ok_, total.overloaded_, total.timed_out_, total.other_status_,
+			total.failed_, total.unsent_,
+			total.bytes_,
+			latencies.count_ ? ms(latencies.sum_us_) / latencies.count_ : 0.0,
+			ms(latencies.value_at_quantile(0.5)),
+			ms(latencies.value_at_quantile(0.9)),
+			ms(latencies.value_at_quantile(0.99)),
+			ms(latencies.value_at_quantile(0.999)),
+			ms(total.max_latency_us_));
+}
+
+int main(int argc, char ** argv) {
+	try {
+		const auto cfg = parse_cmd_line_args(argc, argv);
+		if(cfg.help_requested_)
+			return 1;
+		const auto & config = cfg.config_;
+
+		// Инциализируем сам curl. Это нужно сделать до запуска рабочих
+		// нитей, т.к. curl_global_init не является thread-safe.
+		curl_global_init(CURL_GLOBAL_ALL);
+		auto curl_global_deinitializer =
+				cpp_util_3::at_scope_exit([]{ curl_global_cleanup(); });
+
+		// Кэш DNS разделяется между всеми рабочими нитями.
+		curl_share_t curl_share;
+
+		const date_picker_t dates{config.dates_, config.distribution_,
+				config.zipf_exponent_, config.first_year_};
+
+		// Все нити начинают одновременно, немного погодя, чтобы успеть
+		// создать их все.
+		const auto start_at = clock_type::now() + std::chrono::milliseconds{100};
+
+		std::vector<std::unique_ptr<worker_results_t>> results;
+		std::vector<std::unique_ptr<load_worker_t>> workers;
+		for(std::size_t i = 0u; i != config.threads_; ++i) {
+			results.emplace_back(std::make_unique<worker_results_t>());
+			workers.emplace_back(std::make_unique<load_worker_t>(
+					config, curl_share.handle(), dates, i, start_at, *results.back()));
+		}
+
+		std::vector<std::thread> threads;
+		threads.reserve(workers.size());
+		for(auto & w : workers)
+			threads.emplace_back([&worker = *w]{ worker.run(); });
+		for(auto & t : threads)
+			t.join();
+
+		report(config, results,
+				std::chrono::duration<double>{clock_type::now() - start_at});
+	}
+	catch( const std::exception & ex ) {
+		std::cerr << "Error: " << ex.what() << std::endl;
+		return 2;
+	}
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <bridge_server_2/response_cache.hpp>
+
+//
+// Проверка того, что кэш ответов bridge_server_2 не возвращает
+// из снимка версии ответов, которые этот процесс уже заменил,
+// вытеснил или которые удаленный сервер запретил кэшировать, а также
+// того, что некорректные заголовки удаленного сервера не нарушают
+// работу кэша.
+//
+// В случае неудачи проверки порождается исключение, а процесс
+// завершается с ненулевым кодом.
+//
+
+using namespace std::chrono_literals;
+
+void ensure(bool condition, const char * what) {
+	if(!condition)
+		throw std::runtime_error(fmt::format("check failed: {}", what));
+}
+
+// Снимок, в котором для каждого из URL сохранен ответ "old".
+std::shared_ptr<const cache_snapshot_t> make_snapshot(
+		const std::string & file_name,
+		std::initializer_list<const char *> urls) {
+	write_cache_snapshot(file_name, [&urls](auto && handler) {
+			const auto now = std::chrono::system_clock::now();
+			for(const auto * url : urls)
+				handler(std::string{url}, std::string{"old"}, now + 60s, now + 90s);
+		});
+
+	std::shared_ptr<const cache_snapshot_t> result{cache_snapshot_t::open(file_name)};
+	ensure(nullptr != result, "snapshot is opened");
+	return result;
+}
+
+auto make_reply(std::string content) {
+	return std::make_shared<const std::string>(std::move(content));
+}
+
+// Ответ с no-store должен удалять и версию из снимка.
+void store_not_cacheable_hides_snapshot(const std::string & file_name) {
+	response_cache_t cache{64u * 1024u, cache_policy_t{true, 60s, 0s}, 1u};
+	cache.attach_snapshot(make_snapshot(file_name, {"/a", "/b"}));
+
+	// Ответ для /a уже загружен из снимка, для /b -- еще нет.
+	ensure(nullptr != cache.lookup("/a").reply_, "/a is loaded from snapshot");
+
+	const auto no_store = cache.policy_for("no-store", "");
+	cache.store("/a", make_reply("new"), no_store);
+	cache.store("/b", make_reply("new"), no_store);
+
+	ensure(nullptr == cache.lookup("/a").reply_, "/a is not resurrected");
+	ensure(nullptr == cache.lookup("/b").reply_, "/b is not resurrected");
+}
+
+// Вытесненный ответ не должен снова загружаться из снимка.
+void evicted_entry_is_not_reloaded(const std::string & file_name) {
+	// Места в кэше хватает только на один ответ.
+	response_cache_t cache{200u, cache_policy_t{true, 60s, 0s}, 1u};
+	cache.attach_snapshot(make_snapshot(file_name, {"/a"}));
+
+	ensure(nullptr != cache.lookup("/a").reply_, "/a is loaded from snapshot");
+
+	cache.store("/c", make_reply("other"), cache.policy_for("", ""));
+	ensure(0u != cache.stats().evictions_, "/a is evicted");
+
+	ensure(nullptr == cache.lookup("/a").reply_, "/a is not reloaded");
+}
+
+// Ответ, сохраненный этим процессом, имеет приоритет над снимком.
+void stored_reply_wins_over_snapshot(const std::string & file_name) {
+	response_cache_t cache{64u * 1024u, cache_policy_t{true, 60s, 0s}, 1u};
+	cache.attach_snapshot(make_snapshot(file_name, {"/a"}));
+
+	cache.store("/a", make_reply("new"), cache.policy_for("", ""));
+
+	const auto found = cache.lookup("/a").reply_;
+	ensure(found && "new" == *found, "/a has new reply");
+}
+
+// Слишком большой ответ кэшем не принимается, а его предыдущая версия
+// удаляется.
+void oversized_reply_removes_previous_version() {
+	response_cache_t cache{200u, cache_policy_t{true, 60s, 0s}, 1u};
+
+	cache.store("/a", make_reply("old"), cache.policy_for("", ""));
+	ensure(cache.accepts("/a", 3u), "small reply is accepted");
+	ensure(!cache.accepts("/a", 1024u), "oversized reply is not accepted");
+
+	cache.remove("/a");
+	ensure(nullptr == cache.lookup("/a").reply_, "/a is removed");
+}
+
+// Огромные max-age, s-maxage и stale-while-revalidate не должны ни
+// приводить к исключению, ни переполнять время устаревания ответа.
+void huge_max_age_is_clamped() {
+	response_cache_t cache{64u * 1024u, cache_policy_t{true, 60s, 0s}, 1u};
+
+	for(const auto * cache_control : {
+			"max-age=99999999999999999999",
+			"max-age=9223372036854775",
+			"s-maxage=99999999999999999999, "
+				"stale-while-revalidate=99999999999999999999"}) {
+		const auto policy = cache.policy_for(cache_control, "");
+		ensure(policy.cacheable_, "reply with huge max-age is cacheable");
+		ensure(2147483648s == policy.ttl_, "max-age is clamped to 2^31");
+
+		cache.store("/a", make_reply("new"), policy);
+		const auto found = cache.lookup("/a");
+		ensure(found.reply_ && !found.revalidate_,
+				"reply with huge max-age is fresh");
+	}
+}
+
+int main() {
+	const auto file_name = fmt::format("/tmp/response_cache_test.{}", ::getpid());
+	try {
+		store_not_cacheable_hides_snapshot(file_name);
+		evicted_entry_is_not_reloaded(file_name);
+		stored_reply_wins_over_snapshot(file_name);
+		oversized_reply_removes_previous_version();
+		huge_max_age_is_clamped();
+	}
+	catch( const std::exception & ex ) {
+		std::remove(file_name.c_str());
+		std::cerr << "Error: " << ex.what() << std::endl;
+		return 2;
+	}
+
+	std::remove(file_name.c_str());
+	std::cout << "OK" << std::endl;
+	return 0;
+}
@@ -0,0 +1,12 @@
+require 'mxx_ru/cpp'
+
+MxxRu::Cpp::exe_target {
+
+  target 'response_cache_test'
+
+  required_prj 'fmt_mxxru/prj.rb'
+
+  lib 'curl'
+
+  cpp_source 'main.cpp'
+}
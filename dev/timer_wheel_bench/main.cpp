@@ -0,0 +1,231 @@
+#include <iostream>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <atomic>
+#include <new>
+#include <random>
+#include <vector>
+
+#include <restinio/all.hpp>
+
+#include <clara.hpp>
+
+#include <fmt/format.h>
+
+#include <delay_server/timer_wheel.hpp>
+
+//
+// Сравнение расхода памяти на один ожидающий ответа запрос
+// в delay_server для двух способов отсчета задержек:
+// отдельный Asio-таймер на каждый запрос и колесо таймеров.
+//
+// Для подсчета расхода памяти глобальные operator new/delete заменяются
+// собственными, которые ведут учет количества выделенных байт.
+//
+
+namespace {
+
+std::atomic<std::size_t> g_bytes_in_use{0};
+std::atomic<std::size_t> g_allocations{0};
+
+// Перед каждым выделенным блоком хранится его размер.
+constexpr std::size_t header_size = alignof(std::max_align_t);
+
+} /* namespace anonymous */
+
+void * operator new(std::size_t size) {
+	auto * raw = static_cast<char *>(std::malloc(size + header_size));
+	if(!raw)
+		throw std::bad_alloc{};
+	*reinterpret_cast<std::size_t *>(raw) = size;
+	g_bytes_in_use += size;
+	++g_allocations;
+	return raw + header_size;
+}
+
+void operator delete(void * ptr) noexcept {
+	if(ptr) {
+		auto * raw = static_cast<char *>(ptr) - header_size;
+		g_bytes_in_use -= *reinterpret_cast<std::size_t *>(raw);
+		std::free(raw);
+	}
+}
+
+void operator delete(void * ptr, std::size_t) noexcept {
+	operator delete(ptr);
+}
+
+using std::chrono::milliseconds;
+
+// Конфигурация бенчмарка.
+struct config_t {
+	// Количество одновременно ожидающих запросов.
+	std::size_t requests_{100000};
+
+	// Минимальная и максимальная величины задержек.
+	milliseconds min_pause_{4000};
+	milliseconds max_pause_{6000};
+};
+
+// Разбор аргументов командной строки.
+// В случае неудачи порождается исключение.
+auto parse_cmd_line_args(int argc, char ** argv) {
+	struct result_t {
+		bool help_requested_{false};
+		config_t config_;
+	};
+	result_t result;
+	long min_pause{result.config_.min_pause_.count()};
+	long max_pause{result.config_.max_pause_.count()};
+
+	// Подготавливаем парсер аргументов командной строки.
+	using namespace clara;
+
+	auto cli = Opt(result.config_.requests_, "requests")["-r"]["--requests"]
+				(fmt::format("number of pending requests (default: {})",
+						result.config_.requests_))
+		| Opt(min_pause, "minimal pause")["-m"]["--min-pause"]
+				("minimal pause before response, milliseconds")
+		| Opt(max_pause, "maximum pause")["-M"]["--max-pause"]
+				("maximal pause before response, milliseconds")
+		| Help(result.help_requested_);
+
+	// Выполняем парсинг...
+	auto parse_result = cli.parse(Args(argc, argv));
+	// ...и бросаем исключение если столкнулись с ошибкой.
+	if(!parse_result)
+		throw std::runtime_error("Invalid command line: "
+				+ parse_result.errorMessage());
+
+	if(result.help_requested_)
+		std::cout << cli << std::endl;
+	else {
+		if(0u == result.config_.requests_)
+			throw std::runtime_error("number of requests can't be 0");
+		if(min_pause <= 0 || max_pause < min_pause)
+			throw std::runtime_error("invalid pauses");
+
+		result.config_.min_pause_ = milliseconds{min_pause};
+		result.config_.max_pause_ = milliseconds{max_pause};
+	}
+
+	return result;
+}
+
+// Заменитель restinio::request_handle_t. Имеет такой же размер и так же
+// требует копирования/перемещения shared_ptr.
+using fake_request_handle_t = std::shared_ptr<int>;
+
+// Результаты одного замера.
+struct measurement_t {
+	std::size_t bytes_;
+	std::size_t allocations_;
+	std::chrono::nanoseconds duration_;
+};
+
+// Замер для указанного способа постановки запросов на ожидание.
+template<typename Scheduler>
+measurement_t measure(
+		const config_t & config,
+		const std::vector<fake_request_handle_t> & requests,
+		Scheduler && scheduler) {
+	std::mt19937 generator{42};
+	std::uniform_int_distribution<long> distrib{
+			0, (config.max_pause_ - config.min_pause_).count()};
+
+	const auto bytes_before = g_bytes_in_use.load();
+	const auto allocations_before = g_allocations.load();
+	const auto started_at = std::chrono::steady_clock::now();
+
+	for(const auto & req : requests)
+		scheduler(req, config.min_pause_ + milliseconds{distrib(generator)});
+
+	const auto finished_at = std::chrono::steady_clock::now();
+
+	return measurement_t{
+			g_bytes_in_use.load() - bytes_before,
+			g_allocations.load() - allocations_before,
+			finished_at - started_at};
+}
+
+void report(
+		const char * name,
+		const config_t & config,
+		const measurement_t & m) {
+	const auto n = static_cast<double>(config.requests_);
+	std::cout << fmt::format(
+			"{:<16} {:>12.1f} {:>12.2f} {:>12.1f}\n",
+			name,
+			static_cast<double>(m.bytes_) / n,
+			static_cast<double>(m.allocations_) / n,
+			static_cast<double>(m.duration_.count()) / n);
+}
+
+// Текущий способ: отдельный таймер на каждый запрос.
+measurement_t measure_timer_per_request(
+		const config_t & config,
+		const std::vector<fake_request_handle_t> & requests) {
+	restinio::asio_ns::io_context ioctx;
+
+	return measure(config, requests,
+		[&ioctx](const fake_request_handle_t & req, milliseconds pause) {
+			auto timer = std::make_shared<restinio::asio_ns::steady_timer>(ioctx);
+			timer->expires_after(pause);
+			timer->async_wait([timer, req, pause](const auto & ec) {
+					if(!ec)
+						*req += static_cast<int>(pause.count());
+				});
+		});
+}
+
+// Информация об ожидающем запросе, которая хранится в колесе таймеров.
+struct pending_response_t {
+	fake_request_handle_t req_;
+	milliseconds pause_{};
+};
+
+// Новый способ: колесо таймеров.
+measurement_t measure_timer_wheel(
+		const config_t & config,
+		const std::vector<fake_request_handle_t> & requests) {
+	restinio::asio_ns::io_context ioctx;
+	timer_wheel_t<pending_response_t> wheel{ioctx,
+			[](pending_response_t pending) {
+				*pending.req_ += static_cast<int>(pending.pause_.count());
+			}};
+
+	return measure(config, requests,
+		[&wheel](const fake_request_handle_t & req, milliseconds pause) {
+			wheel.schedule(pause, pending_response_t{req, pause});
+		});
+}
+
+int main(int argc, char ** argv) {
+	try {
+		const auto cfg = parse_cmd_line_args(argc, argv);
+		if(cfg.help_requested_)
+			return 1;
+
+		// Заменители запросов создаются заранее, чтобы их размер
+		// не попал в замеры.
+		std::vector<fake_request_handle_t> requests;
+		requests.reserve(cfg.config_.requests_);
+		for(std::size_t i = 0; i != cfg.config_.requests_; ++i)
+			requests.push_back(std::make_shared<int>(0));
+
+		std::cout << fmt::format("{:<16} {:>12} {:>12} {:>12}\n",
+				"scheduler", "bytes/req", "allocs/req", "ns/req");
+
+		report("timer-per-req", cfg.config_,
+				measure_timer_per_request(cfg.config_, requests));
+		report("timer-wheel", cfg.config_,
+				measure_timer_wheel(cfg.config_, requests));
+	}
+	catch( const std::exception & ex ) {
+		std::cerr << "Error: " << ex.what() << std::endl;
+		return 2;
+	}
+
+	return 0;
+}